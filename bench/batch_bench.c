@@ -0,0 +1,176 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define BATCH_FILES   2000
+#define BATCH_PACE_US 100
+
+/* Values of IN_BATCH_DELAY to compare, in milliseconds */
+static const int batch_delays[] = { 0, 1, 5, 20 };
+static const int num_delays = sizeof (batch_delays) / sizeof (batch_delays[0]);
+
+/**
+ * Read the events available now and account their latencies.
+ *
+ * @param[in]  fd       An inotify instance.
+ * @param[in]  created  Creation times of the files, indexed by name.
+ * @param[in]  timeout  poll(2) timeout in milliseconds.
+ * @param[out] latency  Sum of the latencies of the events read.
+ * @param[out] reads    Number of successful reads.
+ * @return Number of IN_CREATE events read.
+ **/
+static size_t
+batch_read (int fd, const double *created, int timeout, double *latency,
+            size_t *reads)
+{
+    char buf[64 * 1024];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    if (poll (&pfd, 1, timeout) <= 0) {
+        return 0;
+    }
+
+    ssize_t len = read (fd, buf, sizeof (buf));
+    if (len <= 0) {
+        return 0;
+    }
+
+    double now = bench_now ();
+    size_t received = 0;
+    ssize_t i = 0;
+    ++*reads;
+    while (i < len) {
+        struct inotify_event *ie = (struct inotify_event *) &buf[i];
+        if (ie->mask & IN_CREATE && ie->len > 0) {
+            long n = strtol (ie->name, NULL, 10);
+            if (n >= 0 && n < BATCH_FILES) {
+                *latency += now - created[n];
+            }
+            ++received;
+        }
+        i += sizeof (struct inotify_event) + ie->len;
+    }
+    return received;
+}
+
+/**
+ * Run one pass of the batching benchmark.
+ *
+ * @param[in] delay A value of IN_BATCH_DELAY in milliseconds.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+batch_pass (int delay)
+{
+    static double created[BATCH_FILES];
+    char path[64], metric[64];
+    size_t received = 0, reads = 0;
+    double latency = 0;
+    int i;
+
+    snprintf (path, sizeof (path), BENCH_WORKDIR "/batch-%d", delay);
+    if (bench_mkdir ("%s", path) == -1) {
+        return -1;
+    }
+
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        return -1;
+    }
+
+    if (inotify_add_watch (fd, path, IN_CREATE) == -1) {
+        perror ("inotify_add_watch");
+        close (fd);
+        return -1;
+    }
+
+#ifndef __linux__
+    if (libinotify_set_param (fd, IN_BATCH_DELAY, delay) == -1) {
+        perror ("libinotify_set_param");
+        close (fd);
+        return -1;
+    }
+#endif
+
+    /* Files are created at a steady pace, events are read as soon as
+     * they are available */
+    for (i = 0; i < BATCH_FILES; i++) {
+        created[i] = bench_now ();
+        if (bench_touch ("%s/%d", path, i) == -1) {
+            close (fd);
+            return -1;
+        }
+        received += batch_read (fd, created, 0, &latency, &reads);
+        usleep (BATCH_PACE_US);
+    }
+
+    while (received < BATCH_FILES) {
+        size_t got = batch_read (fd, created, 5000, &latency, &reads);
+        if (got == 0) {
+            fprintf (stderr, "batch: %zu events missing\n",
+                     BATCH_FILES - received);
+            close (fd);
+            return -1;
+        }
+        received += got;
+    }
+    close (fd);
+
+    snprintf (metric, sizeof (metric), "delay %d ms: events per read", delay);
+    bench_report ("batch", metric, (double) received / reads, "events");
+    snprintf (metric, sizeof (metric), "delay %d ms: change to event", delay);
+    bench_report ("batch", metric, latency * 1e6 / received, "us");
+    return 0;
+}
+
+/**
+ * Measure the trade-off between the latency of events and the number of
+ * reads needed to receive them for different IN_BATCH_DELAY values. The
+ * native inotify of GNU/Linux has no such knob, so only the first pass is
+ * run there.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+batch_bench (void)
+{
+    int i;
+
+    for (i = 0; i < num_delays; i++) {
+#ifdef __linux__
+        if (batch_delays[i] != 0) {
+            break;
+        }
+#endif
+        if (batch_pass (batch_delays[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
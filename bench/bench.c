@@ -0,0 +1,215 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+static const bench benches[] = {
+    { "bulk", "Deliver IN_CREATE from many directories changed at once",
+      bulk_bench },
+    { "latency", "inotify_add_watch latency while a huge directory churns",
+      latency_bench },
+    { "listing", "Listing of a huge directory with readdir and in bulk",
+      listing_bench },
+    { "hot", "Changes noticed per second in a constantly changed directory",
+      hot_bench },
+    { "snapshot", "Memory and diff time of a huge directory snapshot",
+      snapshot_bench },
+    { "hash", "Hashing of file names and matching files by name",
+      hash_bench },
+    { "tree", "Snapshot and diff of a large directory tree",
+      tree_bench },
+    { "batch", "Event latency against reads with different batch delays",
+      batch_bench },
+#ifndef __linux__
+    { "flags", "Per-event cost of inotify/kqueue flags translation",
+      flags_bench },
+#endif
+};
+static const int num_benches = sizeof (benches) / sizeof (benches[0]);
+
+/**
+ * Get a monotonic timestamp.
+ *
+ * @return Current time in seconds.
+ **/
+double
+bench_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Print a single benchmark result in a machine-readable form.
+ **/
+void
+bench_report (const char *bench, const char *metric, double value,
+              const char *unit)
+{
+    printf ("%-12s %-32s %14.3f %s\n", bench, metric, value, unit);
+    fflush (stdout);
+}
+
+/**
+ * Create a directory, path is specified by a printf-like format.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+bench_mkdir (const char *fmt, ...)
+{
+    char path[FILENAME_MAX];
+    va_list ap;
+
+    va_start (ap, fmt);
+    vsnprintf (path, sizeof (path), fmt, ap);
+    va_end (ap);
+
+    if (mkdir (path, 0755) == -1 && errno != EEXIST) {
+        perror (path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Create an empty file, path is specified by a printf-like format.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+bench_touch (const char *fmt, ...)
+{
+    char path[FILENAME_MAX];
+    va_list ap;
+
+    va_start (ap, fmt);
+    vsnprintf (path, sizeof (path), fmt, ap);
+    va_end (ap);
+
+    int fd = open (path, O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        perror (path);
+        return -1;
+    }
+    close (fd);
+    return 0;
+}
+
+/**
+ * Remove a directory tree.
+ **/
+void
+bench_rmtree (const char *path)
+{
+    char cmd[FILENAME_MAX + 16];
+    snprintf (cmd, sizeof (cmd), "rm -rf %s", path);
+    system (cmd);
+}
+
+/**
+ * Read inotify events until the expected number of matching ones arrive.
+ *
+ * @param[in] fd         An inotify instance.
+ * @param[in] count      Number of events to wait for.
+ * @param[in] mask       Events to count. Other events are skipped.
+ * @param[in] timeout_ms Maximal delay between two reads.
+ * @return Number of matching events received.
+ **/
+size_t
+bench_wait_events (int fd, size_t count, uint32_t mask, int timeout_ms)
+{
+    char buf[64 * 1024];
+    size_t received = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    while (received < count) {
+        if (poll (&pfd, 1, timeout_ms) <= 0) {
+            break;
+        }
+
+        ssize_t len = read (fd, buf, sizeof (buf));
+        if (len <= 0) {
+            break;
+        }
+
+        ssize_t i = 0;
+        while (i < len) {
+            struct inotify_event *ie = (struct inotify_event *) &buf[i];
+            if (ie->mask & mask) {
+                ++received;
+            }
+            i += sizeof (struct inotify_event) + ie->len;
+        }
+    }
+    return received;
+}
+
+int
+main (int argc, char *argv[])
+{
+    struct rlimit rl;
+    int i, j, failed = 0;
+
+    /* Every watched file consumes a file descriptor */
+    if (getrlimit (RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &rl);
+    }
+
+    for (i = 0; i < num_benches; i++) {
+        int selected = (argc < 2);
+        for (j = 1; j < argc; j++) {
+            if (strcmp (argv[j], benches[i].name) == 0) {
+                selected = 1;
+            }
+        }
+        if (!selected) {
+            continue;
+        }
+
+        fprintf (stderr, "%s: %s\n", benches[i].name, benches[i].description);
+        bench_rmtree (BENCH_WORKDIR);
+        if (bench_mkdir (BENCH_WORKDIR) == -1 || benches[i].run () != 0) {
+            fprintf (stderr, "%s: failed\n", benches[i].name);
+            failed = 1;
+        }
+        bench_rmtree (BENCH_WORKDIR);
+    }
+
+    return failed;
+}
@@ -0,0 +1,62 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint32_t */
+
+#ifdef __linux__
+#  include <sys/inotify.h>
+#else
+#  include "sys/inotify.h"
+#endif
+
+/* A directory where all the benchmarks create their files */
+#define BENCH_WORKDIR "bench-workdir"
+
+typedef struct bench {
+    const char *name;         /* name used to select a benchmark */
+    const char *description;  /* short human-readable description */
+    int (* run) (void);       /* returns 0 on success */
+} bench;
+
+double   bench_now        (void);
+void     bench_report     (const char *bench, const char *metric,
+                           double value, const char *unit);
+int      bench_mkdir      (const char *fmt, ...);
+int      bench_touch      (const char *fmt, ...);
+void     bench_rmtree     (const char *path);
+size_t   bench_wait_events (int fd, size_t count, uint32_t mask, int timeout_ms);
+
+int bulk_bench    (void);
+int latency_bench (void);
+int listing_bench (void);
+int hot_bench     (void);
+int snapshot_bench (void);
+int hash_bench     (void);
+int tree_bench     (void);
+int batch_bench    (void);
+int flags_bench    (void);
+
+#endif /* __BENCH_H__ */
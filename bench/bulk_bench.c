@@ -0,0 +1,95 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define BULK_DIRS   300
+#define BULK_ROUNDS 10
+
+/**
+ * Measure wall-clock time to deliver all the events after a bulk operation
+ * touching many watched directories at once (e.g. a build).
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+bulk_bench (void)
+{
+    double total = 0, worst = 0;
+    int i, round;
+
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        return -1;
+    }
+
+    for (i = 0; i < BULK_DIRS; i++) {
+        if (bench_mkdir (BENCH_WORKDIR "/%d", i) == -1) {
+            close (fd);
+            return -1;
+        }
+        for (round = 0; round < 100; round++) {
+            bench_touch (BENCH_WORKDIR "/%d/old-%d", i, round);
+        }
+
+        char path[FILENAME_MAX];
+        snprintf (path, sizeof (path), BENCH_WORKDIR "/%d", i);
+        if (inotify_add_watch (fd, path, IN_CREATE) == -1) {
+            perror (path);
+            close (fd);
+            return -1;
+        }
+    }
+
+    for (round = 0; round < BULK_ROUNDS; round++) {
+        double start = bench_now ();
+
+        for (i = 0; i < BULK_DIRS; i++) {
+            bench_touch (BENCH_WORKDIR "/%d/new-%d", i, round);
+        }
+
+        size_t received = bench_wait_events (fd, BULK_DIRS, IN_CREATE, 5000);
+        double elapsed = bench_now () - start;
+
+        if (received != BULK_DIRS) {
+            fprintf (stderr, "bulk: %zu of %d events received\n",
+                     received, BULK_DIRS);
+            close (fd);
+            return -1;
+        }
+
+        total += elapsed;
+        if (elapsed > worst) {
+            worst = elapsed;
+        }
+    }
+
+    bench_report ("bulk", "mean delivery time", total / BULK_ROUNDS * 1e3, "ms");
+    bench_report ("bulk", "worst delivery time", worst * 1e3, "ms");
+
+    close (fd);
+    return 0;
+}
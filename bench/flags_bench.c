@@ -0,0 +1,103 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "watch-flags.h"
+
+#define FLAGS_EVENTS 4096
+#define FLAGS_ROUNDS 2000
+
+static uint32_t masks[FLAGS_EVENTS];
+static uint32_t fflags[FLAGS_EVENTS];
+static watch_flags_t wfs[FLAGS_EVENTS];
+
+/**
+ * Measure time of a conversion function over the prepared events.
+ *
+ * @return Time per conversion in nanoseconds.
+ **/
+static double
+time_conversion (uint32_t (* convert) (uint32_t, watch_flags_t),
+                 const uint32_t *flags)
+{
+    volatile uint32_t sink = 0;
+    double start = bench_now ();
+    int i, j;
+
+    for (j = 0; j < FLAGS_ROUNDS; j++) {
+        for (i = 0; i < FLAGS_EVENTS; i++) {
+            sink ^= convert (flags[i], wfs[i]);
+        }
+    }
+    (void) sink;
+    return (bench_now () - start) * 1e9 / FLAGS_ROUNDS / FLAGS_EVENTS;
+}
+
+/**
+ * Compare per-event cost of the table-driven flags conversion with the
+ * reference one on a mix of watches and events.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+flags_bench (void)
+{
+    static const watch_flags_t types[] = {
+        S_IFREG | WF_ISSUBWATCH, S_IFDIR | WF_ISSUBWATCH, S_IFREG, S_IFDIR,
+        S_IFREG | WF_MODIFIED, S_IFLNK | WF_ISSUBWATCH,
+    };
+    static const uint32_t notes[] = {
+        NOTE_WRITE, NOTE_ATTRIB, NOTE_DELETE, NOTE_WRITE | NOTE_EXTEND,
+        NOTE_LINK, NOTE_RENAME, NOTE_ATTRIB | NOTE_WRITE,
+    };
+    static const uint32_t inotify_masks[] = {
+        IN_ALL_EVENTS, IN_MODIFY, IN_CREATE | IN_DELETE | IN_MOVE,
+        IN_ATTRIB | IN_CLOSE_WRITE, IN_MODIFY | IN_ONESHOT,
+    };
+    int i;
+
+    watch_flags_init ();
+    srand (1);
+    for (i = 0; i < FLAGS_EVENTS; i++) {
+        wfs[i] = types[rand () % (sizeof (types) / sizeof (types[0]))];
+        fflags[i] = notes[rand () % (sizeof (notes) / sizeof (notes[0]))];
+        masks[i] = inotify_masks[rand () % (sizeof (inotify_masks)
+                                           / sizeof (inotify_masks[0]))];
+    }
+
+    bench_report ("flags", "kqueue_to_inotify, reference",
+                  time_conversion (kqueue_to_inotify_ref, fflags), "ns");
+    bench_report ("flags", "kqueue_to_inotify, tables",
+                  time_conversion (kqueue_to_inotify, fflags), "ns");
+    bench_report ("flags", "inotify_to_kqueue, reference",
+                  time_conversion (inotify_to_kqueue_ref, masks), "ns");
+    bench_report ("flags", "inotify_to_kqueue, tables",
+                  time_conversion (inotify_to_kqueue, masks), "ns");
+    return 0;
+}
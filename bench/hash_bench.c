@@ -0,0 +1,145 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <limits.h> /* NAME_MAX */
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "dep-list.h"
+
+#define HASH_NAMES   4096
+#define HASH_ROUNDS  200
+#define HASH_ENTRIES 100000
+
+/**
+ * Hash a name a byte at a time (FNV-1a). A reference for dl_name_hash.
+ **/
+static uint32_t
+hash_bytewise (const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void
+count_pair (void *udata, dep_item *from_di, dep_item *to_di)
+{
+    (void) from_di;
+    (void) to_di;
+    ++*(size_t *) udata;
+}
+
+/**
+ * Measure time to hash names of the given length.
+ *
+ * @param[in] len Length of names.
+ **/
+static void
+hash_names (size_t len)
+{
+    static char names[HASH_NAMES][NAME_MAX + 1];
+    volatile uint32_t sink = 0;
+    char metric[64];
+    double start;
+    int i, j;
+
+    for (i = 0; i < HASH_NAMES; i++) {
+        int n = snprintf (names[i], sizeof (names[i]), "f%d-", i);
+        memset (names[i] + n, 'x', len - n);
+        names[i][len] = '\0';
+    }
+
+    start = bench_now ();
+    for (j = 0; j < HASH_ROUNDS; j++) {
+        for (i = 0; i < HASH_NAMES; i++) {
+            sink ^= hash_bytewise (names[i], len);
+        }
+    }
+    snprintf (metric, sizeof (metric), "bytewise, %zu chars", len);
+    bench_report ("hash", metric,
+                  (bench_now () - start) * 1e9 / HASH_ROUNDS / HASH_NAMES, "ns");
+
+    start = bench_now ();
+    for (j = 0; j < HASH_ROUNDS; j++) {
+        for (i = 0; i < HASH_NAMES; i++) {
+            sink ^= dl_name_hash (names[i], len);
+        }
+    }
+    snprintf (metric, sizeof (metric), "dl_name_hash, %zu chars", len);
+    bench_report ("hash", metric,
+                  (bench_now () - start) * 1e9 / HASH_ROUNDS / HASH_NAMES, "ns");
+    (void) sink;
+}
+
+/**
+ * Measure time to hash names and to match files by long names, when
+ * every file of a directory has been overwritten.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+hash_bench (void)
+{
+    traverse_cbs cbs = { NULL, NULL, NULL, count_pair, NULL,
+                         NULL, NULL, NULL };
+    char name[256];
+    size_t pairs = 0;
+    int i;
+
+    hash_names (10);
+    hash_names (40);
+    hash_names (255);
+
+    dep_list *before = dl_create ();
+    dep_list *after = dl_create ();
+    if (before == NULL || after == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < HASH_ENTRIES; i++) {
+        snprintf (name, sizeof (name),
+                  "a-long-common-prefix-of-generated-files-%d", i);
+        if (dl_insert (before, name, i + 1, 0) == -1
+            || dl_insert (after, name, HASH_ENTRIES + i + 1, 0) == -1) {
+            return -1;
+        }
+    }
+    dl_sort (before);
+    dl_sort (after);
+
+    double start = bench_now ();
+    if (dl_calculate (before, after, &cbs, &pairs) == -1) {
+        fprintf (stderr, "hash: failed to diff lists\n");
+        return -1;
+    }
+    bench_report ("hash", "overwrite detection", (bench_now () - start) * 1000,
+                  "ms");
+
+    dl_free (after);
+    return pairs == HASH_ENTRIES ? 0 : -1;
+}
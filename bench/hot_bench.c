@@ -0,0 +1,92 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define HOT_ENTRIES 10000
+#define HOT_OPS     2000
+
+/**
+ * Measure how many directory changes per second are noticed in a watched
+ * directory which is modified all the time. Every change is waited for,
+ * so the library has to list and diff the directory once per change.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+hot_bench (void)
+{
+    int i;
+
+    if (bench_mkdir (BENCH_WORKDIR "/hot") == -1) {
+        return -1;
+    }
+    for (i = 0; i < HOT_ENTRIES; i++) {
+        if (bench_touch (BENCH_WORKDIR "/hot/%d", i) == -1) {
+            return -1;
+        }
+    }
+
+    int fd = inotify_init ();
+    if (fd == -1) {
+        perror ("inotify_init");
+        return -1;
+    }
+
+    if (inotify_add_watch (fd, BENCH_WORKDIR "/hot", IN_CREATE | IN_DELETE)
+        == -1) {
+        perror ("inotify_add_watch");
+        close (fd);
+        return -1;
+    }
+
+    double start = bench_now ();
+
+    for (i = 0; i < HOT_OPS; i++) {
+        uint32_t expected;
+
+        if (i & 1) {
+            unlink (BENCH_WORKDIR "/hot/hot-file");
+            expected = IN_DELETE;
+        } else {
+            bench_touch (BENCH_WORKDIR "/hot/hot-file");
+            expected = IN_CREATE;
+        }
+
+        if (bench_wait_events (fd, 1, expected, 5000) != 1) {
+            fprintf (stderr, "hot: no event for change %d\n", i);
+            close (fd);
+            return -1;
+        }
+    }
+
+    double elapsed = bench_now () - start;
+    close (fd);
+
+    bench_report ("hot", "diffs per second", HOT_OPS / elapsed, "1/s");
+    bench_report ("hot", "change to event",
+                  elapsed * 1e6 / HOT_OPS, "us");
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define LATENCY_ENTRIES 100000
+#define LATENCY_CALLS   2000
+
+static volatile int churn_stop = 0;
+
+/**
+ * Keep creating and removing files in a huge watched directory.
+ **/
+static void*
+churn_thread (void *arg)
+{
+    char path[FILENAME_MAX];
+    int i = 0;
+    (void) arg;
+
+    while (!churn_stop) {
+        snprintf (path, sizeof (path), BENCH_WORKDIR "/huge/churn-%d", i % 16);
+        if (i & 16) {
+            unlink (path);
+        } else {
+            bench_touch ("%s", path);
+        }
+        ++i;
+        usleep (1000);
+    }
+    return NULL;
+}
+
+static int
+double_cmp (const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Measure inotify_add_watch/inotify_rm_watch latency while the worker is
+ * busy with diffing of a huge directory.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+latency_bench (void)
+{
+    static double samples[LATENCY_CALLS];
+    pthread_t churn;
+    int i;
+
+    if (bench_mkdir (BENCH_WORKDIR "/huge") == -1
+        || bench_touch (BENCH_WORKDIR "/small") == -1) {
+        return -1;
+    }
+    for (i = 0; i < LATENCY_ENTRIES; i++) {
+        if (bench_touch (BENCH_WORKDIR "/huge/%d", i) == -1) {
+            return -1;
+        }
+    }
+
+    int fd = inotify_init1 (IN_NONBLOCK);
+    if (fd == -1) {
+        perror ("inotify_init1");
+        return -1;
+    }
+
+    if (inotify_add_watch (fd, BENCH_WORKDIR "/huge", IN_CREATE | IN_DELETE)
+        == -1) {
+        perror ("inotify_add_watch");
+        close (fd);
+        return -1;
+    }
+
+    churn_stop = 0;
+    pthread_create (&churn, NULL, churn_thread, NULL);
+
+    for (i = 0; i < LATENCY_CALLS; i++) {
+        double start = bench_now ();
+        int wd = inotify_add_watch (fd, BENCH_WORKDIR "/small", IN_ATTRIB);
+        if (wd != -1) {
+            inotify_rm_watch (fd, wd);
+        }
+        samples[i] = bench_now () - start;
+
+        /* Drain the queue so the worker is never blocked on a full socket */
+        bench_wait_events (fd, (size_t) -1, 0, 0);
+    }
+
+    churn_stop = 1;
+    pthread_join (churn, NULL);
+    close (fd);
+
+    qsort (samples, LATENCY_CALLS, sizeof (double), double_cmp);
+    bench_report ("latency", "add+rm watch p50",
+                  samples[LATENCY_CALLS / 2] * 1e3, "ms");
+    bench_report ("latency", "add+rm watch p99",
+                  samples[LATENCY_CALLS * 99 / 100] * 1e3, "ms");
+    bench_report ("latency", "add+rm watch max",
+                  samples[LATENCY_CALLS - 1] * 1e3, "ms");
+    return 0;
+}
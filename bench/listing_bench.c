@@ -0,0 +1,168 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "dir-reader.h"
+
+#define LISTING_FILES  100000
+#define LISTING_ROUNDS 20
+
+/**
+ * List a directory with readdir as the library did before bulk reads.
+ *
+ * @return Number of entries or -1 on error.
+ **/
+static long
+list_readdir (int dirfd)
+{
+    long count = 0;
+    struct dirent *ent;
+
+    int fd = openat (dirfd, ".", O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    DIR *dir = fdopendir (fd);
+    if (dir == NULL) {
+        close (fd);
+        return -1;
+    }
+
+    while ((ent = readdir (dir)) != NULL) {
+        if (strcmp (ent->d_name, ".") && strcmp (ent->d_name, "..")) {
+            ++count;
+        }
+    }
+    closedir (dir);
+    return count;
+}
+
+/**
+ * List a directory with a reused #dir_reader.
+ *
+ * @param[in] dirfd    A file descriptor of a directory.
+ * @param[in] dr       A pointer to #dir_reader.
+ * @param[in] in_place 1 to read through dirfd itself, 0 to reopen it.
+ * @return Number of entries or -1 on error.
+ **/
+static long
+list_reader (int dirfd, dir_reader *dr, int in_place)
+{
+    long count = 0;
+    dr_entry ent;
+    int ret;
+
+    int fd = in_place ? dirfd : openat (dirfd, ".", O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (dr_start (dr, fd) == -1) {
+        ret = -1;
+    } else {
+        while ((ret = dr_next (dr, &ent)) == 1) {
+            ++count;
+        }
+        dr_stop (dr);
+    }
+
+    if (fd != dirfd) {
+        close (fd);
+    }
+    return ret == 0 ? count : -1;
+}
+
+/**
+ * Measure time to list a large directory with readdir and with the bulk
+ * directory reader of the library.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+listing_bench (void)
+{
+    double start, readdir_time = 0, reader_time = 0, in_place_time = 0;
+    int i;
+
+    if (bench_mkdir (BENCH_WORKDIR "/big") == -1) {
+        return -1;
+    }
+    for (i = 0; i < LISTING_FILES; i++) {
+        if (bench_touch (BENCH_WORKDIR "/big/file-%d", i) == -1) {
+            return -1;
+        }
+    }
+
+    int fd = open (BENCH_WORKDIR "/big", O_RDONLY);
+    if (fd == -1) {
+        perror (BENCH_WORKDIR "/big");
+        return -1;
+    }
+
+    dir_reader *dr = dr_create (DIR_READER_BUFSIZE);
+    if (dr == NULL) {
+        close (fd);
+        return -1;
+    }
+
+    for (i = 0; i < LISTING_ROUNDS; i++) {
+        start = bench_now ();
+        long n1 = list_readdir (fd);
+        readdir_time += bench_now () - start;
+
+        start = bench_now ();
+        long n2 = list_reader (fd, dr, 0);
+        reader_time += bench_now () - start;
+
+        start = bench_now ();
+        long n3 = list_reader (fd, dr, 1);
+        in_place_time += bench_now () - start;
+
+        if (n1 != LISTING_FILES || n2 != LISTING_FILES || n3 != LISTING_FILES) {
+            fprintf (stderr, "listing: %ld, %ld and %ld of %d entries listed\n",
+                     n1, n2, n3, LISTING_FILES);
+            dr_free (dr);
+            close (fd);
+            return -1;
+        }
+    }
+
+    dr_free (dr);
+    close (fd);
+
+    bench_report ("listing", "readdir per listing",
+                  readdir_time * 1000 / LISTING_ROUNDS, "ms");
+    bench_report ("listing", "dir_reader per listing",
+                  reader_time * 1000 / LISTING_ROUNDS, "ms");
+    bench_report ("listing", "dir_reader in place per listing",
+                  in_place_time * 1000 / LISTING_ROUNDS, "ms");
+    bench_report ("listing", "dir_reader entries per second",
+                  LISTING_FILES * LISTING_ROUNDS / reader_time, "1/s");
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "dep-list.h"
+
+#define SNAPSHOT_FILES  100000
+#define SNAPSHOT_ROUNDS 20
+
+static void
+count_entry (void *udata, dep_item *di)
+{
+    (void) di;
+    ++*(size_t *) udata;
+}
+
+/**
+ * Measure memory taken by a snapshot of a large directory and time to
+ * diff the directory against it.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+snapshot_bench (void)
+{
+    traverse_cbs cbs = { count_entry, count_entry, NULL, NULL, NULL,
+                         NULL, NULL, NULL };
+    size_t changes = 0;
+    double start;
+    int i;
+
+    if (bench_mkdir (BENCH_WORKDIR "/big") == -1) {
+        return -1;
+    }
+    for (i = 0; i < SNAPSHOT_FILES; i++) {
+        if (bench_touch (BENCH_WORKDIR "/big/file-%d", i) == -1) {
+            return -1;
+        }
+    }
+
+    int fd = open (BENCH_WORKDIR "/big", O_RDONLY);
+    if (fd == -1) {
+        perror (BENCH_WORKDIR "/big");
+        return -1;
+    }
+
+    start = bench_now ();
+    dep_list *dl = dl_listing (fd, NULL);
+    double listing_time = bench_now () - start;
+    if (dl == NULL || dl->count != SNAPSHOT_FILES) {
+        fprintf (stderr, "snapshot: failed to list directory\n");
+        close (fd);
+        return -1;
+    }
+
+    bench_report ("snapshot", "bytes per entry",
+                  (double) dl_footprint (dl) / dl->count, "B");
+    bench_report ("snapshot", "listing", listing_time * 1000, "ms");
+
+    start = bench_now ();
+    for (i = 0; i < SNAPSHOT_ROUNDS; i++) {
+        dep_diff *dd = dl_diff_open (fd, NULL, dl);
+        if (dd == NULL
+            || dl_diff_read (dd, SIZE_MAX) == -1
+            || dl_diff_close (dd, &cbs, &changes) == -1) {
+            fprintf (stderr, "snapshot: failed to diff directory\n");
+            dl_free (dl);
+            close (fd);
+            return -1;
+        }
+    }
+    double diff_time = bench_now () - start;
+
+    bench_report ("snapshot", "unchanged diff",
+                  diff_time * 1000 / SNAPSHOT_ROUNDS, "ms");
+    bench_report ("snapshot", "bytes per entry after diffs",
+                  (double) dl_footprint (dl) / dl->count, "B");
+
+    /* A frozen snapshot is what a cold directory keeps under a memory cap */
+    start = bench_now ();
+    if (dl_freeze (dl) == -1) {
+        fprintf (stderr, "snapshot: failed to freeze snapshot\n");
+        dl_free (dl);
+        close (fd);
+        return -1;
+    }
+    double freeze_time = bench_now () - start;
+
+    bench_report ("snapshot", "frozen bytes per entry",
+                  (double) dl_footprint (dl) / dl->count, "B");
+    bench_report ("snapshot", "freeze", freeze_time * 1000, "ms");
+
+    start = bench_now ();
+    if (dl_thaw (dl) == -1) {
+        fprintf (stderr, "snapshot: failed to thaw snapshot\n");
+        dl_free (dl);
+        close (fd);
+        return -1;
+    }
+    bench_report ("snapshot", "thaw", (bench_now () - start) * 1000, "ms");
+
+    dl_free (dl);
+    close (fd);
+    return changes == 0 ? 0 : -1;
+}
@@ -0,0 +1,127 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "deplist.h"
+
+#define TREE_DIRS    2000
+#define TREE_FILES   25
+#define TREE_ROUNDS  10
+#define TREE_CHANGED 20
+
+static void
+count_entry (void *udata, dep_item *di)
+{
+    (void) di;
+    ++*(size_t *) udata;
+}
+
+/**
+ * Measure time to snapshot a deep directory tree and to diff it when
+ * nothing or only a few directories have changed.
+ *
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+tree_bench (void)
+{
+    traverse_cbs cbs = { count_entry, count_entry, NULL, NULL, NULL,
+                         NULL, NULL, NULL };
+    size_t changes = 0, ndirs = 0, nlisted = 0;
+    double start;
+    int i, j;
+
+    if (bench_mkdir (BENCH_WORKDIR "/tree") == -1) {
+        return -1;
+    }
+    /* Ten top-level directories with a chain of subdirectories each */
+    for (i = 0; i < TREE_DIRS; i++) {
+        char path[FILENAME_MAX];
+        int len = snprintf (path, sizeof (path), BENCH_WORKDIR "/tree");
+        for (j = i % 10; j <= i; j += 10) {
+            len += snprintf (path + len, sizeof (path) - len, "/d%d", j);
+        }
+        if (bench_mkdir ("%s", path) == -1) {
+            return -1;
+        }
+        for (j = 0; j < TREE_FILES; j++) {
+            if (bench_touch ("%s/file-%d", path, j) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    /* Directory stamps have to get older than listings to be trusted */
+    sleep (2);
+
+    start = bench_now ();
+    dep_tree *dt = dt_snapshot (BENCH_WORKDIR "/tree");
+    if (dt == NULL) {
+        fprintf (stderr, "tree: failed to take snapshot\n");
+        return -1;
+    }
+    bench_report ("tree", "snapshot", (bench_now () - start) * 1000, "ms");
+
+    dt_stats (dt, &ndirs, &nlisted);
+    if (ndirs != TREE_DIRS + 1) {
+        fprintf (stderr, "tree: %zu of %d directories listed\n",
+                 ndirs, TREE_DIRS + 1);
+        dt_free (dt);
+        return -1;
+    }
+
+    start = bench_now ();
+    for (i = 0; i < TREE_ROUNDS; i++) {
+        if (dt_diff (dt, &cbs, &changes) == -1) {
+            fprintf (stderr, "tree: failed to diff snapshot\n");
+            dt_free (dt);
+            return -1;
+        }
+    }
+    dt_stats (dt, &ndirs, &nlisted);
+    bench_report ("tree", "unchanged diff",
+                  (bench_now () - start) * 1000 / TREE_ROUNDS, "ms");
+    bench_report ("tree", "directories read by unchanged diff",
+                  nlisted, "");
+
+    /* Touch a file in a few of the top-level directories */
+    for (i = 0; i < TREE_CHANGED; i++) {
+        bench_touch (BENCH_WORKDIR "/tree/d%d/new-%d", i % 10, i);
+    }
+
+    start = bench_now ();
+    if (dt_diff (dt, &cbs, &changes) == -1) {
+        fprintf (stderr, "tree: failed to diff snapshot\n");
+        dt_free (dt);
+        return -1;
+    }
+    dt_stats (dt, &ndirs, &nlisted);
+    bench_report ("tree", "diff after changes",
+                  (bench_now () - start) * 1000, "ms");
+    bench_report ("tree", "directories read by that diff", nlisted, "");
+
+    dt_free (dt);
+    return changes == TREE_CHANGED ? 0 : -1;
+}
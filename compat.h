@@ -48,6 +48,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 
 #ifndef DTTOIF
@@ -58,6 +59,10 @@
 #define SIZE_MAX SIZE_T_MAX
 #endif
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #ifndef HAVE_PTHREAD_BARRIER
 typedef struct {
     int count;               /* the number of threads to wait on a barrier */
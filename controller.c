@@ -75,9 +75,10 @@ inotify_init1 (int flags) __THROW
     int lfd = -1;
 
 #ifdef O_CLOEXEC
-    if (flags & ~(IN_CLOEXEC|O_CLOEXEC|IN_NONBLOCK|O_NONBLOCK)) {
+    if (flags & ~(IN_CLOEXEC|O_CLOEXEC|IN_NONBLOCK|O_NONBLOCK
+                  |IN_EXTENDED)) {
 #else
-    if (flags & ~(IN_CLOEXEC|IN_NONBLOCK|O_NONBLOCK)) {
+    if (flags & ~(IN_CLOEXEC|IN_NONBLOCK|O_NONBLOCK|IN_EXTENDED)) {
 #endif
         errno = EINVAL;
         return -1;
@@ -121,43 +122,20 @@ inotify_init1 (int flags) __THROW
 
 
 /**
- * Add or modify a watch.
+ * Run a command on the worker of an inotify instance.
  *
- * If the watch with a such filename is already exist, its mask will
- * be updated. A new watch will be created otherwise.
+ * The command is copied to the worker, the worker thread is woken up and
+ * the results of the command are copied back when it is done.
  *
- * @param[in] fd   A file descriptor of an inotify instance.
- * @param[in] name A path to a file to watch.
- * @param[in] mask A combination of inotify flags. 
- * @return id of a watch, -1 on failure.
+ * @param[in]     fd  A file descriptor of an inotify instance.
+ * @param[in,out] cmd A command prepared with one of worker_cmd_* functions.
+ * @return The return value of the command, -1 on failure.
  **/
-INO_EXPORT int
-inotify_add_watch (int         fd,
-                   const char *name,
-                   uint32_t    mask) __THROW
+static int
+worker_exec (int fd, worker_cmd *cmd)
 {
-    struct stat st;
-
-    if (!is_opened (fd)) {
-        return -1;	/* errno = EBADF */
-    }
-
-    /*
-     * this lstat() call guards worker from incorrectly specified path.
-     * E.g, it prevents catching of SIGSEGV when pathname points outside
-     * of the process's accessible address space
-     */
-    if (lstat (name, &st) == -1) {
-        perror_msg("failed to lstat watch %s",
-                   errno != EFAULT ? name : "<bad addr>");
-        return -1;
-    }
-
-    if (mask == 0) {
-        perror_msg ("Failed to open watch %s. Bad event mask %x", name, mask);
-        errno = EINVAL;
-        return -1;
-    }
+    /* The barrier is initialized by the worker and is never copied */
+    const size_t cmd_size = offsetof (worker_cmd, sync);
 
     pthread_mutex_lock (&workers_mutex);
 
@@ -181,12 +159,11 @@ inotify_add_watch (int         fd,
                 return -1;
             }
 
-            worker_cmd_add (&wrk->cmd, name, mask);
+            memcpy (&wrk->cmd, cmd, cmd_size);
             safe_write (wrk->io[INOTIFY_FD], "*", 1);
 
             worker_cmd_wait (&wrk->cmd);
-            int retval = wrk->cmd.retval;
-            int error = wrk->cmd.error;
+            memcpy (cmd, &wrk->cmd, cmd_size);
 
             pthread_mutex_unlock (&wrk->mutex);
 
@@ -197,10 +174,10 @@ inotify_add_watch (int         fd,
             }
 
             pthread_mutex_unlock (&workers_mutex);
-            if (retval == -1) {
-                errno = error;
+            if (cmd->retval == -1) {
+                errno = cmd->error;
             }
-            return retval;
+            return cmd->retval;
         }
     }
 
@@ -209,6 +186,50 @@ inotify_add_watch (int         fd,
     return -1;
 }
 
+/**
+ * Add or modify a watch.
+ *
+ * If the watch with a such filename is already exist, its mask will
+ * be updated. A new watch will be created otherwise.
+ *
+ * @param[in] fd   A file descriptor of an inotify instance.
+ * @param[in] name A path to a file to watch.
+ * @param[in] mask A combination of inotify flags. 
+ * @return id of a watch, -1 on failure.
+ **/
+INO_EXPORT int
+inotify_add_watch (int         fd,
+                   const char *name,
+                   uint32_t    mask) __THROW
+{
+    struct stat st;
+
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    /*
+     * this lstat() call guards worker from incorrectly specified path.
+     * E.g, it prevents catching of SIGSEGV when pathname points outside
+     * of the process's accessible address space
+     */
+    if (lstat (name, &st) == -1) {
+        perror_msg("failed to lstat watch %s",
+                   errno != EFAULT ? name : "<bad addr>");
+        return -1;
+    }
+
+    if (mask == 0) {
+        perror_msg ("Failed to open watch %s. Bad event mask %x", name, mask);
+        errno = EINVAL;
+        return -1;
+    }
+
+    worker_cmd cmd;
+    worker_cmd_add (&cmd, name, mask);
+    return worker_exec (fd, &cmd);
+}
+
 /**
  * Remove a watch.
  *
@@ -228,6 +249,209 @@ inotify_rm_watch (int fd,
         return -1;	/* errno = EBADF */
     }
 
+    worker_cmd cmd;
+    worker_cmd_remove (&cmd, wd);
+    return worker_exec (fd, &cmd);
+}
+
+/**
+ * Add a name filter pattern to a directory watch.
+ *
+ * @param[in] fd      A file descriptor of an inotify instance.
+ * @param[in] wd      A watch descriptor of a directory watch.
+ * @param[in] kind    IN_FILTER_EXCLUDE or IN_FILTER_INCLUDE.
+ * @param[in] pattern A glob pattern of subfile names or NULL to remove
+ *     all the patterns of the watch.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_filter_watch (int         fd,
+                         int         wd,
+                         int         kind,
+                         const char *pattern) __THROW
+{
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    worker_cmd cmd;
+    worker_cmd_filter (&cmd, wd, kind, pattern);
+    return worker_exec (fd, &cmd);
+}
+
+/**
+ * Save listings of the watched directories to a snapshot directory.
+ *
+ * The directory is remembered: directories watched later are diffed
+ * against their snapshots and the changes found are reported, and the
+ * snapshots are saved again when the inotify instance is closed.
+ *
+ * @param[in] fd  A file descriptor of an inotify instance.
+ * @param[in] dir An existing directory to keep snapshots in or NULL to
+ *     stop using snapshots.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_checkpoint (int fd, const char *dir) __THROW
+{
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    worker_cmd cmd;
+    worker_cmd_checkpoint (&cmd, dir);
+    return worker_exec (fd, &cmd);
+}
+
+/**
+ * Get a copy of the directory listing of a watch.
+ *
+ * IN_LISTED is queued to the watch at the same time, so the listing
+ * can be matched with the events read from the inotify instance.
+ *
+ * @param[in]  fd      A file descriptor of an inotify instance.
+ * @param[in]  wd      An ID of a directory watch.
+ * @param[out] entries A buffer of inotify_dirent records to free(3).
+ * @param[out] size    Number of bytes in the buffer.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_get_listing (int fd, int wd, void **entries, size_t *size) __THROW
+{
+    if (entries == NULL || size == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    worker_cmd cmd;
+    worker_cmd_listing (&cmd, wd);
+
+    int retval = worker_exec (fd, &cmd);
+    *entries = cmd.listing.entries;
+    *size = cmd.listing.size;
+    return retval;
+}
+
+/**
+ * Report all the entries of a watched directory tree once more.
+ *
+ * Used to recover after events have been dropped by a user. The entries
+ * are reported with IN_CREATE between IN_RESYNC and IN_LISTED markers.
+ *
+ * @param[in] fd A file descriptor of an inotify instance.
+ * @param[in] wd An ID of a directory watch.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_resync (int fd, int wd) __THROW
+{
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    worker_cmd cmd;
+    worker_cmd_resync (&cmd, wd);
+    return worker_exec (fd, &cmd);
+}
+
+/**
+ * Set a libinotify-kqueue specific parameter of a watch.
+ *
+ * @param[in] fd    A file descriptor of an inotify instance.
+ * @param[in] wd    An ID of a watch.
+ * @param[in] param A parameter to set, one of IN_* parameter constants.
+ * @param[in] value A new value of the parameter.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_set_watch_param (int fd, int wd, int param, intptr_t value) __THROW
+{
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    worker_cmd cmd;
+    worker_cmd_watch_param (&cmd, wd, param, value);
+    return worker_exec (fd, &cmd);
+}
+
+/**
+ * Set a libinotify-kqueue specific parameter.
+ *
+ * @param[in] fd    A file descriptor of an inotify instance or -1 to set
+ *     a process-wide parameter.
+ * @param[in] param A parameter to set, one of IN_* parameter constants.
+ * @param[in] value A new value of the parameter.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_set_param (int fd, int param, intptr_t value) __THROW
+{
+    switch (param) {
+    case IN_SNAPSHOT_MEMLIMIT:
+        if (fd != -1 || value < 0) {
+            break;
+        }
+        iwatch_set_snapshot_limit (value);
+        return 0;
+    case IN_BATCH_DELAY:
+    case IN_BATCH_BYTES:
+        if (!is_opened (fd)) {
+            return -1;	/* errno = EBADF */
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    worker_cmd cmd;
+    worker_cmd_param (&cmd, param, value);
+    return worker_exec (fd, &cmd);
+}
+
+/**
+ * Get a libinotify-kqueue specific parameter or statistics counter.
+ *
+ * @param[in]  fd    A file descriptor of an inotify instance or -1 to get
+ *     a process-wide parameter.
+ * @param[in]  param A parameter to get, one of IN_* parameter constants.
+ * @param[out] value A pointer to store the value of the parameter.
+ * @return 0 on success, -1 on failure.
+ **/
+INO_EXPORT int
+libinotify_get_param (int fd, int param, intptr_t *value) __THROW
+{
+    if (value == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (param) {
+    case IN_SNAPSHOT_MEMLIMIT:
+        if (fd != -1) {
+            break;
+        }
+        *value = iwatch_get_snapshot_limit ();
+        return 0;
+    case IN_STAT_DIFFS_FULL:
+    case IN_STAT_DIFFS_MEMBERSHIP:
+    case IN_STAT_DIFFS_SKIPPED:
+    case IN_BATCH_DELAY:
+    case IN_BATCH_BYTES:
+        if (!is_opened (fd)) {
+            return -1;	/* errno = EBADF */
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
     pthread_mutex_lock (&workers_mutex);
 
     int i;
@@ -235,44 +459,34 @@ inotify_rm_watch (int fd,
         worker *wrk = workers[i];
         if (wrk != NULL
             && wrk->io[INOTIFY_FD] == fd
-            && wrk->closed == 0
-            && is_opened (wrk->io[INOTIFY_FD])) {
+            && wrk->closed == 0) {
+            /* The worker is not freed while its mutex is held */
             pthread_mutex_lock (&wrk->mutex);
-
-            if (wrk->closed) {
-                pthread_mutex_unlock (&wrk->mutex);
-                worker_free (wrk);
-                workers[i] = NULL;
-                pthread_mutex_unlock (&workers_mutex);
-                errno = EBADF;
-                return -1;
+            switch (param) {
+            case IN_STAT_DIFFS_FULL:
+                *value = wrk->stats.diffs_full;
+                break;
+            case IN_STAT_DIFFS_MEMBERSHIP:
+                *value = wrk->stats.diffs_membership;
+                break;
+            case IN_STAT_DIFFS_SKIPPED:
+                *value = wrk->stats.diffs_skipped;
+                break;
+            case IN_BATCH_DELAY:
+                *value = wrk->batch_delay;
+                break;
+            case IN_BATCH_BYTES:
+                *value = wrk->batch_bytes;
+                break;
             }
-
-            worker_cmd_remove (&wrk->cmd, wd);
-            safe_write (wrk->io[INOTIFY_FD], "*", 1);
-
-            worker_cmd_wait (&wrk->cmd);
-            int retval = wrk->cmd.retval;
-            int error = wrk->cmd.error;
-
             pthread_mutex_unlock (&wrk->mutex);
-
-            /* TODO: ???? */
-            if (wrk->closed) {
-                worker_free (wrk);
-                workers[i] = NULL;
-            }
-
             pthread_mutex_unlock (&workers_mutex);
-            if (retval == -1) {
-                errno = error;
-            }
-            return retval;
+            return 0;
         }
     }
 
     pthread_mutex_unlock (&workers_mutex);
-    errno = EINVAL;
+    errno = EBADF;
     return -1;
 }
 
@@ -24,19 +24,32 @@
 #include "compat.h"
 
 #include <errno.h>   /* errno */
+#include <limits.h>  /* NAME_MAX */
 #include <stddef.h>  /* offsetof */
 #include <stdlib.h>  /* calloc */
 #include <stdio.h>   /* printf */
-#include <dirent.h>  /* opendir, readdir, closedir */
 #include <string.h>  /* strcmp */
 #include <fcntl.h>   /* open */
 #include <unistd.h>  /* close */
 #include <assert.h>
 #include <errno.h>
 
+#include <sys/mman.h> /* mmap */
+
 #include "utils.h"
 #include "dep-list.h"
 
+/* A header of lists saved by dl_save, the last digit is a format version */
+#define DL_MAGIC "DEPLIST1"
+
+/* Items are aligned to keep inode numbers aligned */
+#define DI_ALIGN 8
+
+/* Size of an item with a name of the given length in an arena */
+#define DI_SIZE(pathlen) \
+    ((offsetof (dep_item, path) + (pathlen) + 1 + DI_ALIGN - 1) \
+     & ~((size_t) DI_ALIGN - 1))
+
 /**
  * Print a list to stdout.
  *
@@ -45,10 +58,11 @@
 void
 dl_print (const dep_list *dl)
 {
-    dep_node *dn;
+    size_t i;
 
-    SLIST_FOREACH (dn, &dl->head, next) {
-        printf ("%lld:%s ", (long long int) dn->item->inode, dn->item->path);
+    for (i = 0; i < dl->count; i++) {
+        printf ("%lld:%s ", (long long int) dl_item (dl, i)->inode,
+                dl_item (dl, i)->path);
     }
     printf ("\n");
 }
@@ -68,179 +82,916 @@ dl_create ()
         perror_msg ("Failed to allocate new dep-list");
         return NULL;
     }
-    SLIST_INIT (&dl->head);
+    dl->items = NULL;
+    dl->count = 0;
+    dl->alloc = 0;
+    dl->sorted = 1;
+    dl->arena = NULL;
+    dl->arena_used = 0;
+    dl->arena_size = 0;
+    dl->arena_dead = 0;
+    dl->frozen = 0;
     return dl;
 }
 
 /**
- * Create a new list node.
+ * Make sure a list has room for the specified number of items.
+ *
+ * @param[in] dl    A pointer to a list.
+ * @param[in] count Required number of items.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+dl_reserve (dep_list *dl, size_t count)
+{
+    if (count <= dl->alloc) {
+        return 0;
+    }
+
+    size_t to_allocate = dl->alloc > 0 ? dl->alloc : 16;
+    while (to_allocate < count) {
+        to_allocate *= 2;
+    }
+
+    void *ptr = realloc (dl->items, to_allocate * sizeof (uint32_t));
+    if (ptr == NULL) {
+        perror_msg ("Failed to extend dep-list to %zu items", to_allocate);
+        return -1;
+    }
+
+    dl->items = ptr;
+    dl->alloc = to_allocate;
+    return 0;
+}
+
+/**
+ * Make sure an arena of a list has room for the specified number of bytes.
  *
- * Create a new list node and initialize its fields.
+ * Pointers to items are invalidated if the arena is reallocated.
  *
- * @param[in] di Parent directory of depedence list.
- * @return A pointer to a new list or NULL in the case of error.
+ * @param[in] dl   A pointer to a list.
+ * @param[in] size Required number of free bytes.
+ * @return 0 on success, -1 otherwise.
  **/
-dep_node*
-dn_create (dep_item *di)
+static int
+dl_reserve_arena (dep_list *dl, size_t size)
 {
-    dep_node *dn = calloc (1, sizeof (dep_node));
-    if (dn == NULL) {
-        perror_msg ("Failed to allocate new dep-list node");
-        return NULL;
+    if (dl->arena_used + size <= dl->arena_size) {
+        return 0;
+    }
+
+    /* Items are addressed with 32-bit offsets */
+    if (dl->arena_used + size > UINT32_MAX) {
+        errno = ENOMEM;
+        perror_msg ("dep-list arena exceeds 4GB");
+        return -1;
+    }
+
+    size_t to_allocate = dl->arena_size > 0 ? dl->arena_size : 4096;
+    while (to_allocate < dl->arena_used + size) {
+        to_allocate *= 2;
+    }
+    if (to_allocate > UINT32_MAX) {
+        to_allocate = UINT32_MAX;
+    }
+
+    void *ptr = realloc (dl->arena, to_allocate);
+    if (ptr == NULL) {
+        perror_msg ("Failed to extend dep-list arena to %zu bytes",
+                    to_allocate);
+        return -1;
     }
-    dn->item = di;
-    return dn;
+
+    dl->arena = ptr;
+    dl->arena_size = to_allocate;
+    return 0;
+}
+
+#define DL_HASH_MUL 0x9e3779b97f4a7c15ULL
+
+/**
+ * Load 8 bytes of a name as a machine word.
+ **/
+static inline uint64_t
+dl_hash_word (const char *p)
+{
+    uint64_t w;
+    memcpy (&w, p, sizeof (w));
+    return w;
 }
 
 /**
- * Create a new list item.
+ * Mix a word of a name into a hash state.
+ **/
+static inline uint64_t
+dl_hash_mix (uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * DL_HASH_MUL;
+    return h ^ (h >> 32);
+}
+
+/**
+ * Calculate a hash of a file name.
  *
- * Create a new list item and initialize its fields.
+ * Names are hashed a word (8 bytes) at a time. Long names are hashed in
+ * two independent lanes, so both multiplications of a step can run in
+ * parallel. Hashes are used only in memory and depend on byte order.
+ *
+ * @param[in] name A file name.
+ * @param[in] len  A length of the name.
+ * @return A hash of the name.
+ **/
+uint32_t
+dl_name_hash (const char *name, size_t len)
+{
+    assert (name != NULL);
+
+    const char *end = name + len;
+    uint64_t h1 = len;
+    uint64_t h2 = ~(uint64_t) len;
+    uint64_t w = 0;
+
+    while (end - name >= 16) {
+        h1 = dl_hash_mix (h1, dl_hash_word (name));
+        h2 = dl_hash_mix (h2, dl_hash_word (name + 8));
+        name += 16;
+    }
+    if (end - name >= 8) {
+        h1 = dl_hash_mix (h1, dl_hash_word (name));
+        name += 8;
+    }
+    memcpy (&w, name, end - name);
+    h1 = dl_hash_mix (h1 ^ (h2 * DL_HASH_MUL), w);
+    return (uint32_t) h1;
+}
+
+/**
+ * Append an item with a precomputed name hash and length to a list.
+ *
+ * @param[in] dl      A pointer to a list.
+ * @param[in] path    A name of a file.
+ * @param[in] pathlen A length of the name.
+ * @param[in] hash    A hash of the name, see dl_name_hash.
+ * @param[in] inode   A file's inode number.
+ * @param[in] type    A file`s type (compatible with mode_t values)
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+dl_append (dep_list     *dl,
+           const char   *path,
+           size_t        pathlen,
+           uint32_t      hash,
+           ino_t         inode,
+           mode_t        type)
+{
+    size_t size = DI_SIZE (pathlen);
+
+    if (dl_reserve (dl, dl->count + 1) == -1
+        || dl_reserve_arena (dl, size) == -1) {
+        return -1;
+    }
+
+    dep_item *di = (dep_item *) (dl->arena + dl->arena_used);
+    di->inode = inode;
+    di->type = type;
+    di->hash = hash;
+    di->namelen = pathlen;
+    di->flags = 0;
+    memcpy (di->path, path, pathlen + 1);
+
+    dl->items[dl->count++] = dl->arena_used;
+    dl->arena_used += size;
+    dl->sorted = 0;
+    return 0;
+}
+
+/**
+ * Append a new item to a list.
  *
- * @param[in] path  A name of a file (the string is not copied!).
+ * @param[in] dl    A pointer to a list.
+ * @param[in] path  A name of a file. The string is copied.
  * @param[in] inode A file's inode number.
  * @param[in] type  A file`s type (compatible with mode_t values)
- * @return A pointer to a new item or NULL in the case of error.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+dl_insert (dep_list *dl, const char *path, ino_t inode, mode_t type)
+{
+    assert (dl != NULL);
+    assert (path != NULL);
+
+    size_t pathlen = strlen (path);
+    return dl_append (dl, path, pathlen, dl_name_hash (path, pathlen),
+                      inode, type);
+}
+
+/**
+ * Compare names of two items for equality. Names are rejected by hash
+ * and length before the bytes are compared.
+ **/
+static inline int
+di_same_name (const dep_item *di1, const dep_item *di2)
+{
+    return di1->hash == di2->hash
+        && di1->namelen == di2->namelen
+        && memcmp (di1->path, di2->path, di1->namelen) == 0;
+}
+
+/**
+ * Compare two items by inode number and then by name.
+ **/
+static int
+di_cmp_inode (const void *p1, const void *p2)
+{
+    const dep_item *di1 = *(const dep_item **) p1;
+    const dep_item *di2 = *(const dep_item **) p2;
+
+    if (di1->inode != di2->inode) {
+        return (di1->inode > di2->inode) - (di1->inode < di2->inode);
+    }
+    return strcmp (di1->path, di2->path);
+}
+
+/**
+ * Compare two items by name.
+ **/
+static int
+di_cmp_path (const void *p1, const void *p2)
+{
+    const dep_item *di1 = *(const dep_item **) p1;
+    const dep_item *di2 = *(const dep_item **) p2;
+
+    return strcmp (di1->path, di2->path);
+}
+
+/**
+ * Compare two items by name hash, then by name length and then by name.
+ *
+ * Unlike di_cmp_path, the order is not alphabetical, but equal names
+ * are still adjacent and most of comparisons are resolved without
+ * touching the names.
+ **/
+static int
+di_cmp_name (const void *p1, const void *p2)
+{
+    const dep_item *di1 = *(const dep_item **) p1;
+    const dep_item *di2 = *(const dep_item **) p2;
+
+    if (di1->hash != di2->hash) {
+        return di1->hash < di2->hash ? -1 : 1;
+    }
+    if (di1->namelen != di2->namelen) {
+        return di1->namelen < di2->namelen ? -1 : 1;
+    }
+    return memcmp (di1->path, di2->path, di1->namelen);
+}
+
+/**
+ * Compare two items of a list by inode number and then by name.
+ **/
+static int
+dl_cmp_at (const dep_list *dl, size_t i, size_t j)
+{
+    const dep_item *di1 = dl_item (dl, i);
+    const dep_item *di2 = dl_item (dl, j);
+
+    return di_cmp_inode (&di1, &di2);
+}
+
+/**
+ * Move an offset down a heap of offsets until its children are not
+ * greater than it.
+ **/
+static void
+dl_sift_down (dep_list *dl, size_t root, size_t count)
+{
+    for (;;) {
+        size_t child = 2 * root + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count && dl_cmp_at (dl, child, child + 1) < 0) {
+            ++child;
+        }
+        if (dl_cmp_at (dl, root, child) >= 0) {
+            break;
+        }
+
+        uint32_t tmp = dl->items[root];
+        dl->items[root] = dl->items[child];
+        dl->items[child] = tmp;
+        root = child;
+    }
+}
+
+/**
+ * Heapsort the offsets of a list in place. Used when there is no memory
+ * for a faster qsort of pointers.
+ **/
+static void
+dl_heapsort (dep_list *dl)
+{
+    size_t i;
+
+    for (i = dl->count / 2; i > 0; i--) {
+        dl_sift_down (dl, i - 1, dl->count);
+    }
+    for (i = dl->count; i > 1; i--) {
+        uint32_t tmp = dl->items[0];
+        dl->items[0] = dl->items[i - 1];
+        dl->items[i - 1] = tmp;
+        dl_sift_down (dl, 0, i - 1);
+    }
+}
+
+/**
+ * Sort a list by inode numbers and names, if it is not sorted yet.
+ *
+ * Item pointers remain valid as the items are not moved.
+ *
+ * @param[in] dl A pointer to a list.
+ **/
+void
+dl_sort (dep_list *dl)
+{
+    assert (dl != NULL);
+
+    size_t i;
+
+    if (dl->sorted) {
+        return;
+    }
+
+    /* Offsets can not be sorted with qsort, sort pointers instead */
+    dep_item **items = malloc (dl->count * sizeof (dep_item *));
+    if (items == NULL && dl->count > 0) {
+        perror_msg ("Failed to allocate %zu items to sort", dl->count);
+        dl_heapsort (dl);
+        dl->sorted = 1;
+        return;
+    }
+
+    for (i = 0; i < dl->count; i++) {
+        items[i] = dl_item (dl, i);
+    }
+    qsort (items, dl->count, sizeof (dep_item *), di_cmp_inode);
+    for (i = 0; i < dl->count; i++) {
+        dl->items[i] = (char *) items[i] - dl->arena;
+    }
+
+    free (items);
+    dl->sorted = 1;
+}
+
+/**
+ * Find the position of the first item with inode number not less than
+ * the given one in a sorted list.
+ **/
+static size_t
+dl_lower_bound (const dep_list *dl, ino_t inode)
+{
+    size_t lo = 0, hi = dl->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (dl_item (dl, mid)->inode < inode) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Get number of items in a list.
+ *
+ * @param[in] dl A pointer to a list.
+ * @return Number of items.
+ **/
+size_t
+dl_count (const dep_list *dl)
+{
+    assert (dl != NULL);
+    return dl->count;
+}
+
+/**
+ * Get an item of a list. Items are ordered by inode numbers only if the
+ * list has been sorted, e.g. by dl_find.
+ *
+ * @param[in] dl A pointer to a list.
+ * @param[in] i  An index of the item, less than dl_count.
+ * @return A pointer to the item.
  **/
 dep_item*
-di_create (const char *path, ino_t inode, mode_t type)
+dl_get (const dep_list *dl, size_t i)
 {
-    size_t pathlen = strlen (path) + 1;
+    assert (dl != NULL);
+    assert (!dl->frozen);
+    assert (i < dl->count);
+    return dl_item (dl, i);
+}
 
-    dep_item *di = calloc (1, offsetof (dep_item, path) + pathlen);
-    if (di == NULL) {
-        perror_msg ("Failed to create a new dep-list item");
-        return NULL;
+/**
+ * Find all items with the given inode number.
+ *
+ * Directory may contain several hard links to a file, so there may be
+ * more than one item with the same inode number.
+ *
+ * @param[in]  dl    A pointer to a list. Will be sorted if it is not.
+ * @param[in]  inode An inode number to look for.
+ * @param[out] n     Number of the found items.
+ * @return Index of the first found item.
+ **/
+size_t
+dl_find (dep_list *dl, ino_t inode, size_t *n)
+{
+    assert (dl != NULL);
+    assert (n != NULL);
+
+    dl_sort (dl);
+
+    size_t first = dl_lower_bound (dl, inode);
+    size_t last = first;
+    while (last < dl->count && dl_item (dl, last)->inode == inode) {
+        ++last;
     }
 
-    strlcpy (di->path, path, pathlen);
-    di->inode = inode;
-    di->type = type;
-    return di;
+    *n = last - first;
+    return first;
 }
 
 /**
- * Insert new item into list.
+ * Remove all items from a list keeping the allocated memory.
+ *
+ * @param[in] dl A pointer to a list.
+ **/
+static void
+dl_clear (dep_list *dl)
+{
+    dl->count = 0;
+    dl->sorted = 1;
+    dl->arena_used = 0;
+    dl->arena_dead = 0;
+}
+
+/**
+ * Pack items of a list to a new arena dropping removed ones.
+ *
+ * Items are placed in the list order. Pointers to items are invalidated.
+ * The list is left untouched if memory can not be allocated.
+ *
+ * @param[in] dl A pointer to a list.
+ **/
+static void
+dl_repack (dep_list *dl)
+{
+    size_t i, used = 0;
+    size_t size = dl->arena_used - dl->arena_dead;
+
+    char *arena = malloc (size > 0 ? size : 1);
+    if (arena == NULL) {
+        perror_msg ("Failed to allocate %zu bytes to repack dep-list", size);
+        return;
+    }
+
+    for (i = 0; i < dl->count; i++) {
+        dep_item *di = dl_item (dl, i);
+        size_t disize = DI_SIZE (di->namelen);
+
+        assert (used + disize <= size);
+        memcpy (arena + used, di, disize);
+        dl->items[i] = used;
+        used += disize;
+    }
+
+    free (dl->arena);
+    dl->arena = arena;
+    dl->arena_size = size;
+    dl->arena_used = used;
+    dl->arena_dead = 0;
+}
+
+/**
+ * Release unused memory of a list.
+ *
+ * Pointers to items are invalidated.
  *
  * @param[in] dl A pointer to a list.
- * @param[in] di A pointer to a list item to be inserted.
- * @return A pointer to a new node or NULL in the case of error.
  **/
-dep_node*
-dl_insert (dep_list* dl, dep_item* di)
+static void
+dl_trim (dep_list *dl)
 {
-    dep_node *dn = dn_create (di);
-    if (dn == NULL) {
-        perror_msg ("Failed to create a new dep-list node");
+    void *ptr;
+
+    if (dl->count > 0 && dl->count < dl->alloc) {
+        ptr = realloc (dl->items, dl->count * sizeof (uint32_t));
+        if (ptr != NULL) {
+            dl->items = ptr;
+            dl->alloc = dl->count;
+        }
+    }
+
+    if (dl->arena_used > 0 && dl->arena_used < dl->arena_size) {
+        ptr = realloc (dl->arena, dl->arena_used);
+        if (ptr != NULL) {
+            dl->arena = ptr;
+            dl->arena_size = dl->arena_used;
+        }
+    }
+}
+
+/**
+ * Append an unsigned number to a buffer in the variable length format.
+ *
+ * @param[in] buf A pointer to a buffer.
+ * @param[in] n   A number to write.
+ * @return A pointer to the next byte of the buffer.
+ **/
+static unsigned char*
+dl_put_varint (unsigned char *buf, uint64_t n)
+{
+    while (n >= 0x80) {
+        *buf++ = (unsigned char) (n | 0x80);
+        n >>= 7;
+    }
+    *buf++ = (unsigned char) n;
+    return buf;
+}
+
+/**
+ * Read an unsigned number in the variable length format from a buffer.
+ *
+ * @param[in]  buf A pointer to a buffer.
+ * @param[in]  end A pointer to the end of the buffer.
+ * @param[out] n   The read number.
+ * @return A pointer to the next byte of the buffer or NULL if the buffer
+ *     is malformed.
+ **/
+static const unsigned char*
+dl_get_varint (const unsigned char *buf, const unsigned char *end, uint64_t *n)
+{
+    int shift = 0;
+
+    *n = 0;
+    while (buf < end && shift < 64) {
+        *n |= (uint64_t) (*buf & 0x7f) << shift;
+        if (!(*buf++ & 0x80)) {
+            return buf;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+/**
+ * Pack items of a list to a compact image.
+ *
+ * Items are sorted by name and every name is stored as a length of the
+ * prefix shared with the previous one and the rest of it. Inode numbers
+ * are stored in the variable length format.
+ *
+ * @param[in]  dl   A pointer to a list.
+ * @param[out] size Size of the image in bytes.
+ * @return A pointer to the image or NULL on failure.
+ **/
+static unsigned char*
+dl_pack (const dep_list *dl, size_t *size)
+{
+    size_t i, bound = 0;
+    dep_item **items = NULL;
+
+    if (dl->count > 0) {
+        items = malloc (dl->count * sizeof (dep_item *));
+        if (items == NULL) {
+            perror_msg ("Failed to allocate %zu items to pack", dl->count);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < dl->count; i++) {
+        items[i] = dl_item (dl, i);
+        /* two lengths, a name, an inode number and a type */
+        bound += 2 * 10 + items[i]->namelen + 10 + 1;
+    }
+    if (items != NULL) {
+        qsort (items, dl->count, sizeof (dep_item *), di_cmp_path);
+    }
+
+    unsigned char *image = malloc (bound > 0 ? bound : 1);
+    if (image == NULL) {
+        perror_msg ("Failed to allocate %zu bytes to pack", bound);
+        free (items);
         return NULL;
     }
 
-    SLIST_INSERT_HEAD (&dl->head, dn, next);
+    unsigned char *ptr = image;
+    const char *prev = "";
+    for (i = 0; i < dl->count; i++) {
+        const char *path = items[i]->path;
+        size_t prefix = 0;
+        while (prev[prefix] != '\0' && prev[prefix] == path[prefix]) {
+            ++prefix;
+        }
+        size_t rest = items[i]->namelen - prefix;
+
+        ptr = dl_put_varint (ptr, prefix);
+        ptr = dl_put_varint (ptr, rest);
+        memcpy (ptr, path + prefix, rest);
+        ptr += rest;
+        ptr = dl_put_varint (ptr, items[i]->inode);
+        *ptr++ = (unsigned char) ((items[i]->type & S_IFMT) >> 12);
+        prev = path;
+    }
+    free (items);
 
-    return dn;
+    *size = ptr - image;
+    void *shrunk = realloc (image, *size > 0 ? *size : 1);
+    if (shrunk != NULL) {
+        image = shrunk;
+    }
+    return image;
 }
 
 /**
- * Remove item after specified from a list.
+ * Unpack items of a list from an image made by dl_pack.
  *
- * @param[in] dl      A pointer to a list.
- * @param[in] prev_dn A pointer to a list node prepending removed one.
- *     Should be NULL to remove first node from a list.
+ * @param[in] image A pointer to the image.
+ * @param[in] size  Size of the image in bytes.
+ * @param[in] count Number of items in the image.
+ * @return A pointer to a new list or NULL on failure. errno is set to
+ *     EINVAL if the image is malformed.
  **/
-void
-dl_remove_after (dep_list* dl, dep_node* prev_dn)
+static dep_list*
+dl_unpack (const unsigned char *image, size_t size, size_t count)
 {
-    dep_node *dn;
+    const unsigned char *ptr = image;
+    const unsigned char *end = ptr + size;
+    char path[NAME_MAX + 1];
+    size_t i, pathlen = 0;
 
-    if (prev_dn) {
-        dn = SLIST_NEXT (prev_dn, next);
-        SLIST_REMOVE_AFTER (prev_dn, next);
-    } else {
-        dn = SLIST_FIRST (&dl->head);
-        SLIST_REMOVE_HEAD (&dl->head, next);
+    dep_list *dl = dl_create ();
+    if (dl == NULL || dl_reserve (dl, count) == -1) {
+        goto error;
     }
 
-    free (dn);
+    path[0] = '\0';
+    for (i = 0; i < count; i++) {
+        uint64_t prefix, rest, inode;
+
+        ptr = dl_get_varint (ptr, end, &prefix);
+        if (ptr != NULL) {
+            ptr = dl_get_varint (ptr, end, &rest);
+        }
+        if (ptr == NULL
+            || prefix > pathlen
+            || prefix + rest > NAME_MAX
+            || (size_t) (end - ptr) < rest) {
+            goto malformed;
+        }
+        memcpy (path + prefix, ptr, rest);
+        pathlen = prefix + rest;
+        path[pathlen] = '\0';
+        ptr += rest;
+
+        ptr = dl_get_varint (ptr, end, &inode);
+        if (ptr == NULL || ptr == end) {
+            goto malformed;
+        }
+        mode_t type = (mode_t) *ptr++ << 12;
+
+        if (dl_append (dl, path, pathlen, dl_name_hash (path, pathlen),
+                       inode, type) == -1) {
+            goto error;
+        }
+    }
+
+    dl_sort (dl);
+    dl_trim (dl);
+    return dl;
+
+malformed:
+    errno = EINVAL;
+    perror_msg ("Packed dep-list is malformed");
+error:
+    if (dl != NULL) {
+        dl_free (dl);
+    }
+    return NULL;
 }
 
 /**
- * Create a shallow copy of a list.
+ * Pack a list to a compact image to save memory while it is not used.
  *
- * A shallow copy is a copy of a structure, but not the copy of the
- * contents. All data pointers (`item' in our case) of a list and its
- * shallow copy will point to the same memory.
+ * The image takes about a third of the unpacked list size for typical
+ * names. A frozen list must be unpacked with dl_thaw before use, only
+ * dl_footprint, dl_save and dl_free can be called on it.
  *
- * @param[in] dl A pointer to list to make a copy. May be NULL.
- * @return A shallow copy of the list.
- **/ 
-dep_list*
-dl_shallow_copy (const dep_list *dl)
+ * @param[in] dl A pointer to a list.
+ * @return 0 on success, -1 otherwise. The list is not changed on failure.
+ **/
+int
+dl_freeze (dep_list *dl)
 {
     assert (dl != NULL);
+    assert (!dl->frozen);
 
-    dep_list *head = dl_create ();
-    if (head == NULL) {
-        perror_msg ("Failed to allocate head during shallow copy");
-        return NULL;
+    size_t size;
+    unsigned char *image = dl_pack (dl, &size);
+    if (image == NULL) {
+        return -1;
     }
 
-    dep_node *cp = NULL;
-    dep_node *iter;
+    free (dl->items);
+    free (dl->arena);
+    dl->items = NULL;
+    dl->alloc = 0;
+    dl->arena = (char *) image;
+    dl->arena_used = size;
+    dl->arena_size = size;
+    dl->arena_dead = 0;
+    dl->frozen = 1;
+    return 0;
+}
+
+/**
+ * Unpack a list frozen with dl_freeze. Does nothing for unpacked lists.
+ *
+ * @param[in] dl A pointer to a list.
+ * @return 0 on success, -1 otherwise. The list stays frozen on failure.
+ **/
+int
+dl_thaw (dep_list *dl)
+{
+    assert (dl != NULL);
+
+    if (!dl->frozen) {
+        return 0;
+    }
+
+    dep_list *tmp = dl_unpack ((const unsigned char *) dl->arena,
+                               dl->arena_used,
+                               dl->count);
+    if (tmp == NULL) {
+        return -1;
+    }
+
+    free (dl->arena);
+    *dl = *tmp;
+    free (tmp);
+    return 0;
+}
+
+/**
+ * Write a buffer to a file completely.
+ *
+ * @param[in] fd   A file descriptor.
+ * @param[in] buf  A pointer to a buffer.
+ * @param[in] size Size of the buffer.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+dl_write (int fd, const void *buf, size_t size)
+{
+    const char *ptr = buf;
 
-    SLIST_FOREACH (iter, &dl->head, next) {
-        dep_node *dn = dn_create (iter->item);
-        if (dn == NULL) {
-                perror_msg ("Failed to allocate a new element during shallow copy");
-                dl_shallow_free (head);
-                return NULL;
+    while (size > 0) {
+        ssize_t ret = write (fd, ptr, size);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
+        ptr += ret;
+        size -= ret;
+    }
+    return 0;
+}
 
-        if (cp == NULL) {
-            SLIST_INSERT_HEAD (&head->head, dn, next);
-        } else {
-            SLIST_INSERT_AFTER (cp, dn, next);
+/**
+ * Save a list to a file. The list is stored in the packed form made by
+ * dl_freeze, preceded by a header with a magic string and the sizes.
+ *
+ * @param[in] dl A pointer to a list, may be frozen.
+ * @param[in] fd A file descriptor of a file open for writing.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+dl_save (const dep_list *dl, int fd)
+{
+    assert (dl != NULL);
+    assert (fd != -1);
+
+    unsigned char header[sizeof (DL_MAGIC) - 1 + 2 * 10];
+    unsigned char *image = (unsigned char *) dl->arena;
+    size_t size = dl->arena_used;
+    int retval;
+
+    if (!dl->frozen) {
+        image = dl_pack (dl, &size);
+        if (image == NULL) {
+            return -1;
         }
-        cp = dn;
     }
 
-    return head;
-}
-
-/**
- * Free the memory allocated for shallow copy.
- *
- * This function will free the memory used by a list structure, but
- * the list data will remain in the heap.
- *
- * @param[in] dl A pointer to a list. May be NULL.
- **/
-void
-dl_shallow_free (dep_list *dl)
-{
-    assert (dl != NULL);
+    unsigned char *ptr = header;
+    memcpy (ptr, DL_MAGIC, sizeof (DL_MAGIC) - 1);
+    ptr += sizeof (DL_MAGIC) - 1;
+    ptr = dl_put_varint (ptr, dl->count);
+    ptr = dl_put_varint (ptr, size);
+
+    retval = dl_write (fd, header, ptr - header);
+    if (retval == 0) {
+        retval = dl_write (fd, image, size);
+    }
+
+    if (!dl->frozen) {
+        free (image);
+    }
+    return retval;
+}
+
+/**
+ * Load a list saved with dl_save. The file is mapped to memory and is
+ * unpacked from there.
+ *
+ * @param[in] fd A file descriptor of a file open for reading.
+ * @return A pointer to a new list or NULL on failure. errno is set to
+ *     EINVAL if the file is not a saved list or is damaged.
+ **/
+dep_list*
+dl_load (int fd)
+{
+    assert (fd != -1);
+
+    struct stat st;
+    uint64_t count, size;
+
+    if (fstat (fd, &st) == -1) {
+        return NULL;
+    }
+    if (!S_ISREG (st.st_mode)
+        || st.st_size < (off_t) sizeof (DL_MAGIC)
+        || (uint64_t) st.st_size > SIZE_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t length = st.st_size;
+    void *map = mmap (NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    dep_list *dl = NULL;
+    const unsigned char *ptr = map;
+    const unsigned char *end = ptr + length;
 
-    dep_node *dn;
+    if (memcmp (ptr, DL_MAGIC, sizeof (DL_MAGIC) - 1) != 0) {
+        errno = EINVAL;
+        goto exit;
+    }
+    ptr += sizeof (DL_MAGIC) - 1;
 
-    while (!SLIST_EMPTY (&dl->head)) {
-        dn = SLIST_FIRST (&dl->head);
-        SLIST_REMOVE_HEAD (&dl->head, next);
-        free (dn);
+    ptr = dl_get_varint (ptr, end, &count);
+    if (ptr != NULL) {
+        ptr = dl_get_varint (ptr, end, &size);
+    }
+    /* Every item takes at least four bytes of an image */
+    if (ptr == NULL
+        || size != (uint64_t) (end - ptr)
+        || count > size / 4) {
+        errno = EINVAL;
+        goto exit;
     }
 
-    free (dl);
+    dl = dl_unpack (ptr, size, count);
+
+exit:
+    {
+        int saved_errno = errno;
+        munmap (map, length);
+        errno = saved_errno;
+    }
+    return dl;
 }
 
 /**
- * Free the memory allocated for a list item.
- *
- * This function will free the memory used by a list item.
+ * Get number of bytes taken by a list.
  *
- * @param[in] dn A pointer to a list item. May be NULL.
+ * @param[in] dl A pointer to a list.
+ * @return Number of allocated bytes.
  **/
-void
-di_free (dep_item *di)
+size_t
+dl_footprint (const dep_list *dl)
 {
-    free (di);
+    assert (dl != NULL);
+
+    return sizeof (dep_list)
+        + dl->alloc * sizeof (uint32_t)
+        + dl->arena_size;
 }
 
 /**
@@ -256,18 +1007,13 @@ dl_free (dep_list *dl)
 {
     assert (dl != NULL);
 
-    dep_node *dn;
-
-    while (!SLIST_EMPTY (&dl->head)) {
-        dn = SLIST_FIRST (&dl->head);
-        SLIST_REMOVE_HEAD (&dl->head, next);
-        di_free (dn->item);
-        free (dn);
-    }
-
+    free (dl->items);
+    free (dl->arena);
     free (dl);
 }
 
+#if !defined (DL_LISTING_IN_PLACE) && \
+    defined (HAVE_FDOPENDIR) && !defined (DIRECTORY_LISTING_REWINDS)
 /**
  * Open directory one more time by realtive path "."
  *
@@ -297,26 +1043,92 @@ reopendir (int oldd)
 
     return fd;
 }
+#endif
 
 /**
- * Create a directory listing and return it as a list.
+ * This structure represents a directory listing in progress.
+ **/
+struct dep_listing {
+    int fd;          /* a directory being read or -1 if nothing left to read */
+    int own_fd;      /* 1 if fd has been opened for this listing */
+    dir_reader *dr;  /* a reader of directory entries */
+    int own_reader;  /* 1 if the reader has been created for this listing */
+    dep_list *list;  /* entries read so far */
+};
+
+/**
+ * Stop reading a directory of a listing.
  *
- * @return A pointer to a list. May return NULL, check errno in this case.
+ * A reader passed by a caller is not touched after the listing has been
+ * read completely, so it can be freed before the listing is closed.
+ *
+ * @param[in] dls A pointer to #dep_listing.
  **/
-dep_list*
-dl_listing (int fd)
+static void
+dl_listing_finish (dep_listing *dls)
+{
+    if (dls->fd != -1) {
+        dr_stop (dls->dr);
+        if (dls->own_fd) {
+            close (dls->fd);
+        }
+        dls->fd = -1;
+    }
+    if (dls->own_reader) {
+        dr_free (dls->dr);
+        dls->own_reader = 0;
+    }
+    dls->dr = NULL;
+}
+
+/**
+ * Start a directory listing.
+ *
+ * The entries are read later with one or more dl_listing_read calls, so
+ * the caller can do other work between reads of a large directory.
+ *
+ * @param[in] fd A file descriptor of a directory.
+ * @param[in] dr A reader to read directory entries with or NULL. Readers
+ *     keep their buffers, so passing the same reader for every listing
+ *     of a directory saves an allocation per listing.
+ * @return A pointer to a listing. May return NULL, check errno in this case.
+ **/
+dep_listing*
+dl_listing_open (int fd, dir_reader *dr)
 {
     assert (fd != -1);
 
-    DIR *dir = NULL;
+    dep_listing *dls = calloc (1, sizeof (dep_listing));
+    if (dls == NULL) {
+        perror_msg ("Failed to allocate directory listing");
+        return NULL;
+    }
+    dls->fd = -1;
 
-    dep_list *head = dl_create ();
-    if (head == NULL) {
+    dls->list = dl_create ();
+    if (dls->list == NULL) {
         perror_msg ("Failed to allocate list during directory listing");
+        free (dls);
         return NULL;
     }
 
-#if defined (HAVE_FDOPENDIR) && !defined (DIRECTORY_LISTING_REWINDS)
+    if (dr == NULL) {
+        dr = dr_create (DIR_READER_BUFSIZE);
+        if (dr == NULL) {
+            goto error;
+        }
+        dls->own_reader = 1;
+    }
+    dls->dr = dr;
+
+#if defined (DL_LISTING_IN_PLACE)
+    /*
+     * Read the directory through the given descriptor. It saves a path
+     * lookup per listing and, unlike a reopen, does not trigger
+     * NOTE_OPEN/NOTE_CLOSE on the watched directory.
+     */
+    int newfd = fd;
+#elif defined (HAVE_FDOPENDIR) && !defined (DIRECTORY_LISTING_REWINDS)
     /*
      * Make a fresh copy of fd so it wont be destroyed on closedir.
      * I found out that openat(fd, ".", ...) works more reliable then
@@ -326,7 +1138,8 @@ dl_listing (int fd)
     if (newfd == -1 && errno == ENOENT) {
         /* Why do I skip ENOENT? Because the directory could be deleted at this
          * point */
-        return head;
+        dl_listing_finish (dls);
+        return dls;
     }
 #else
     int newfd = dup_cloexec (fd);
@@ -336,101 +1149,139 @@ dl_listing (int fd)
         goto error;
     }
 
-    dir = fdopendir (newfd);
-    if (dir == NULL) {
-        close (newfd);
+    if (dr_start (dr, newfd) == -1) {
+        if (newfd != fd) {
+            close (newfd);
+        }
         if (errno != ENOENT) {
             /* Why do I skip ENOENT? Because the directory could be deleted at
              * this point */
-            perror_msg ("Failed to opendir for listing");
+            perror_msg ("Failed to start directory listing");
             goto error;
         }
-    } else {
-        struct dirent *ent;
-        dep_item *item;
-        dep_node *node;
-        mode_t type;
+        dl_listing_finish (dls);
+        return dls;
+    }
 
-        while ((ent = readdir (dir)) != NULL) {
-            if (!strcmp (ent->d_name, ".") || !strcmp (ent->d_name, "..")) {
-                continue;
-            }
+    dls->fd = newfd;
+    dls->own_fd = (newfd != fd);
+    return dls;
 
-#ifdef DIRENT_HAVE_D_TYPE
-            if (ent->d_type != DT_UNKNOWN)
-                type = DTTOIF (ent->d_type);
-            else
-#endif
-                type = S_IFUNK;
+error:
+    dl_listing_finish (dls);
+    dl_free (dls->list);
+    free (dls);
+    return NULL;
+}
 
-            item = di_create (ent->d_name, ent->d_ino, type);
-            if (item == NULL) {
-                perror_msg ("Failed to allocate a new item during listing");
-                goto error;
-            }
+/**
+ * Continue a directory listing.
+ *
+ * @param[in] dls   A pointer to #dep_listing.
+ * @param[in] count Maximal number of entries to read.
+ * @return 1 if there are more entries to read, 0 if the listing is complete
+ *     and -1 on error.
+ **/
+int
+dl_listing_read (dep_listing *dls, size_t count)
+{
+    assert (dls != NULL);
 
-            node = dl_insert (head, item);
-            if (node == NULL) {
-                free (item);
-                perror_msg ("Failed to allocate a new node during listing");
-                goto error;
-            }
+    dr_entry ent;
+    int ret;
+
+    if (dls->fd == -1) {
+        return 0;
+    }
+
+    while (count > 0) {
+        ret = dr_next (dls->dr, &ent);
+        if (ret != 1) {
+            dl_listing_finish (dls);
+            return ret;
         }
 
-#ifdef DIRECTORY_LISTING_REWINDS
-        rewinddir (dir);
-#endif
-        closedir (dir);
+        if (dl_insert (dls->list, ent.name, ent.inode, ent.type) == -1) {
+            perror_msg ("Failed to extend list during listing");
+            dl_listing_finish (dls);
+            return -1;
+        }
+        --count;
     }
-    return head;
 
-error:
-    if (dir != NULL) {
-#ifdef DIRECTORY_LISTING_REWINDS
-        rewinddir (dir);
-#endif
-        closedir (dir);
+    return 1;
+}
+
+/**
+ * Finish a directory listing.
+ *
+ * @param[in] dls A pointer to #dep_listing. Freed by the function.
+ * @return A list of entries read so far. It is complete only if the last
+ *     dl_listing_read call has returned 0.
+ **/
+dep_list*
+dl_listing_close (dep_listing *dls)
+{
+    assert (dls != NULL);
+
+    dep_list *dl = dls->list;
+
+    dl_listing_finish (dls);
+    free (dls);
+    dl_sort (dl);
+    dl_trim (dl);
+    return dl;
+}
+
+/**
+ * Create a directory listing and return it as a list.
+ *
+ * @param[in] fd A file descriptor of a directory.
+ * @param[in] dr A reader to read directory entries with or NULL.
+ * @return A pointer to a list. May return NULL, check errno in this case.
+ **/
+dep_list*
+dl_listing (int fd, dir_reader *dr)
+{
+    assert (fd != -1);
+
+    dep_listing *dls = dl_listing_open (fd, dr);
+    if (dls == NULL) {
+        return NULL;
     }
-    dl_free (head);
-    return NULL;
+
+    if (dl_listing_read (dls, SIZE_MAX) == -1) {
+        dl_free (dl_listing_close (dls));
+        return NULL;
+    }
+
+    return dl_listing_close (dls);
 }
 
+/* Number of entries read from a directory at once while diffing */
+#define DL_CHUNK 512
 
 /**
- * Traverses two lists. Compares items with a supplied expression
- * and performs the passed code on a match. Removes the matched entries
- * from the both lists.
- **/
-#define EXCLUDE_SIMILAR(removed_list, added_list, match_expr, matched_code) \
-    dep_node *removed_list##_iter, *tmp;                                \
-    dep_node *removed_list##_prev = NULL;                               \
-                                                                        \
-    int productive = 0;                                                 \
-                                                                        \
-    SLIST_FOREACH_SAFE (removed_list##_iter, &removed_list->head, next, tmp) { \
-        dep_node *added_list##_iter;                                    \
-        dep_node *added_list##_prev = NULL;                             \
-                                                                        \
-        int matched = 0;                                                \
-        SLIST_FOREACH (added_list##_iter, &added_list->head, next) {    \
-            if (match_expr) {                                           \
-                matched = 1;                                            \
-                ++productive;                                           \
-                matched_code;                                           \
-                                                                        \
-                di_free (removed_list##_iter->item);                    \
-                dl_remove_after (removed_list, removed_list##_prev);    \
-                dl_remove_after (added_list, added_list##_prev);        \
-                break;                                                  \
-            }                                                           \
-            added_list##_prev = added_list##_iter;                      \
-        }                                                               \
-        if (matched == 0) {                                             \
-            removed_list##_prev = removed_list##_iter;                  \
-        }                                                               \
-    }                                                                   \
-    return (productive > 0);
+ * This structure represents a directory diff in progress.
+ *
+ * Listed entries are matched against the previous snapshot chunk by chunk,
+ * so only the entries which are not found there are kept in memory until
+ * the diff is complete.
+ **/
+struct dep_diff {
+    dep_listing *dls; /* a listing of the directory, its list holds a chunk */
+    dep_list *before; /* the previous snapshot of the directory */
+    dep_list *added;  /* listed entries not found in the previous snapshot */
+    size_t nseen;     /* number of entries found in the previous snapshot */
+};
 
+/**
+ * A set of pointers to items used while recognizing the changes.
+ **/
+typedef struct di_vector {
+    dep_item **items;
+    size_t count;
+} di_vector;
 
 #define cb_invoke(cbs, name, udata, ...) \
     do { \
@@ -440,179 +1291,489 @@ error:
     } while (0)
 
 /**
- * Detect and notify about files remained unmoved between directory scans
+ * Create a new diff context.
  *
- * This function produces symmetric diffrence of two sets. The same items will
- * be removed from the both lists. Items are compared by name and inode number.
- * 
- * @param[in] before A pointer to a list. Will contain items
- *     which were not found in the `after' list.
- * @param[in] after  A pointer to a list. Will contain items
- *     which were not found in the `before' list.
- * @param[in] cbs    A pointer to #traverse_cbs, an user-defined set of
- *     traverse callbacks.
- * @param[in] udata  A pointer to the user-defined data.
+ * @param[in] before The previous contents of the directory.
+ * @return A pointer to a diff context or NULL in the case of error.
  **/
-static int
-dl_detect_unchanged (dep_list            *before,
-                     dep_list            *after,
-                     const traverse_cbs  *cbs,
-                     void                *udata)
+static dep_diff*
+dl_diff_create (dep_list *before)
 {
-    assert (cbs != NULL);
+    size_t i;
+
+    dep_diff *dd = calloc (1, sizeof (dep_diff));
+    if (dd == NULL) {
+        perror_msg ("Failed to allocate directory diff");
+        return NULL;
+    }
+
+    dd->before = before;
+    dd->added = dl_create ();
+    if (dd->added == NULL) {
+        free (dd);
+        return NULL;
+    }
+
+    /* A previous diff may have been aborted leaving items marked */
+    for (i = 0; i < before->count; i++) {
+        dl_item (before, i)->flags &= ~DI_SEEN;
+    }
 
-    EXCLUDE_SIMILAR
-        (before, after,
-         (before_iter->item->inode == after_iter->item->inode &&
-          strcmp(before_iter->item->path, after_iter->item->path) == 0),
-         {
-             cb_invoke (cbs, unchanged, udata, before_iter->item, after_iter->item);
-         });
+    return dd;
 }
 
 /**
- * Detect and notify about moves in the watched directory.
+ * Match a chunk of listed entries against the previous snapshot.
  *
- * A move is what happens when you rename a file in a directory, and
- * a new name is unique, i.e. you didnt overwrite any existing files
- * with this one.
+ * Entries found in the snapshot under the same name and inode number are
+ * marked there. Other ones are copied to the list of added entries. The
+ * chunk is emptied on success.
  *
- * @param[in] removed  A list of the removed files in the directory.
- * @param[in] added    A list of the added files of the directory.
- * @param[in] cbs      A pointer to #traverse_cbs, an user-defined set of
- *     traverse callbacks.
- * @param[in] udata    A pointer to the user-defined data.
- * @return 0 if no files were renamed, >0 otherwise.
-**/
+ * @param[in] dd    A pointer to #dep_diff.
+ * @param[in] chunk A list of listed entries.
+ * @return 0 on success, -1 otherwise.
+ **/
 static int
-dl_detect_moves (dep_list            *removed, 
-                 dep_list            *added, 
-                 const traverse_cbs  *cbs, 
-                 void                *udata)
+dl_diff_feed (dep_diff *dd, dep_list *chunk)
 {
-    assert (cbs != NULL);
+    dep_list *before = dd->before;
+    size_t i, j, n;
+
+    for (i = 0; i < chunk->count; i++) {
+        dep_item *di = dl_item (chunk, i);
+        size_t first = dl_find (before, di->inode, &n);
+
+        for (j = first; j < first + n; j++) {
+            dep_item *was = dl_item (before, j);
+            if (!(was->flags & DI_SEEN) && di_same_name (was, di)) {
+                was->flags |= DI_SEEN;
+                ++dd->nseen;
+                /* Keep the most recent known file type */
+                if (!S_ISUNK (di->type)) {
+                    was->type = di->type;
+                }
+                break;
+            }
+        }
 
-     EXCLUDE_SIMILAR
-        (removed, added,
-         (removed_iter->item->inode == added_iter->item->inode),
-         {
-             cb_invoke (cbs, moved, udata, removed_iter->item, added_iter->item);
-         });
+        if (j == first + n
+            && dl_append (dd->added, di->path, di->namelen, di->hash,
+                          di->inode, di->type) == -1) {
+            return -1;
+        }
+    }
+
+    dl_clear (chunk);
+    return 0;
 }
 
 /**
- * Detect and notify about replacements in the watched directory.
- *
- * Consider you are watching a directory foo with the folloing files
- * insinde:
- *
- *    foo/bar
- *    foo/baz
- *
- * A replacement in a watched directory is what happens when you invoke
- *
- *    mv /foo/bar /foo/bar
+ * Start a directory diff.
  *
- * i.e. when you replace a file in a watched directory with another file
- * from the same directory.
+ * The directory is read later with one or more dl_diff_read calls and
+ * the changes are reported by dl_diff_close.
  *
- * @param[in] removed  A list of the removed files in the directory.
- * @param[in] current  A list with the current contents of the directory.
- * @param[in] cbs      A pointer to #traverse_cbs, an user-defined set of
- *     traverse callbacks.
- * @param[in] udata    A pointer to the user-defined data.
- * @return 0 if no files were renamed, >0 otherwise.
+ * @param[in] fd     A file descriptor of a directory.
+ * @param[in] dr     A reader to read directory entries with or NULL.
+ * @param[in] before The previous contents of the directory. Will be updated
+ *     to the current contents on dl_diff_close.
+ * @return A pointer to a diff. May return NULL, check errno in this case.
  **/
-static int
-dl_detect_replacements (dep_list            *removed,
-                        dep_list            *current,
-                        const traverse_cbs  *cbs,
-                        void                *udata)
+dep_diff*
+dl_diff_open (int fd, dir_reader *dr, dep_list *before)
 {
-    assert (cbs != NULL);
+    assert (fd != -1);
+    assert (before != NULL);
+    assert (!before->frozen);
+
+    dep_diff *dd = dl_diff_create (before);
+    if (dd == NULL) {
+        return NULL;
+    }
+
+    dd->dls = dl_listing_open (fd, dr);
+    if (dd->dls == NULL) {
+        dl_diff_abort (dd);
+        return NULL;
+    }
 
-    EXCLUDE_SIMILAR
-        (removed, current,
-         (strcmp (removed_iter->item->path, current_iter->item->path) == 0
-          && removed_iter->item->inode != current_iter->item->inode),
-         {
-            cb_invoke (cbs, replaced, udata, removed_iter->item);
-         });
+    return dd;
 }
 
 /**
- * Detect and notify about overwrites in the watched directory.
- *
- * Consider you are watching a directory foo with a file inside:
- *
- *    foo/bar
+ * Continue a directory diff.
  *
- * And you also have a directory tmp with a file 1:
- * 
- *    tmp/1
- *
- * You do not watching directory tmp.
+ * @param[in] dd    A pointer to #dep_diff.
+ * @param[in] count Maximal number of entries to read.
+ * @return 1 if there are more entries to read, 0 if the directory has been
+ *     read completely and -1 on error.
+ **/
+int
+dl_diff_read (dep_diff *dd, size_t count)
+{
+    assert (dd != NULL);
+    assert (dd->dls != NULL);
+
+    int ret = 1;
+
+    while (count > 0 && ret == 1) {
+        size_t chunk = count < DL_CHUNK ? count : DL_CHUNK;
+        count -= chunk;
+
+        ret = dl_listing_read (dd->dls, chunk);
+        if (ret != -1 && dl_diff_feed (dd, dd->dls->list) == -1) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Count the changes found by a directory diff read completely.
  *
- * An overwrite in a watched directory is what happens when you invoke
+ * Every added and every removed entry is counted once, so a rename
+ * counts as two changes.
  *
- *    mv /tmp/1 /foo/bar
+ * @param[in] dd A pointer to #dep_diff.
+ * @return Number of added and removed entries.
+ **/
+size_t
+dl_diff_changes (const dep_diff *dd)
+{
+    assert (dd != NULL);
+
+    return dd->added->count + (dd->before->count - dd->nseen);
+}
+
+/**
+ * Abort a directory diff. The previous snapshot is left untouched, so it
+ * is safe to abort a diff after the snapshot has been freed.
  *
- * i.e. when you overwrite a file in a watched directory with another file
- * from the another directory.
+ * @param[in] dd A pointer to #dep_diff. Freed by the function.
+ **/
+void
+dl_diff_abort (dep_diff *dd)
+{
+    assert (dd != NULL);
+
+    if (dd->dls != NULL) {
+        dl_free (dl_listing_close (dd->dls));
+    }
+    dl_free (dd->added);
+    free (dd);
+}
+
+/**
+ * Allocate room for pointers in a vector.
  *
- * @param[in] previous A list with the previous contents of the directory.
- * @param[in] current  A list with the current contents of the directory.
- * @param[in] cbs      A pointer to #traverse_cbs, an user-defined set of
- *     traverse callbacks.
- * @param[in] udata    A pointer to the user-defined data.
- * @return 0 if no files were renamed, >0 otherwise.
+ * @param[in] dv    A pointer to #di_vector.
+ * @param[in] count Number of pointers.
+ * @return 0 on success, -1 otherwise.
  **/
 static int
-dl_detect_overwrites (dep_list            *previous,
-                      dep_list            *current,
-                      const traverse_cbs  *cbs,
-                      void                *udata)
+dv_init (di_vector *dv, size_t count)
 {
-    assert (cbs != NULL);
+    dv->count = 0;
+    dv->items = malloc ((count > 0 ? count : 1) * sizeof (dep_item *));
+    return dv->items != NULL ? 0 : -1;
+}
+
+/**
+ * Remove NULL items from a vector keeping order of the other ones.
+ *
+ * @param[in] dv A pointer to #di_vector.
+ **/
+static void
+dv_compact (di_vector *dv)
+{
+    size_t i, j;
 
-    EXCLUDE_SIMILAR
-        (previous, current,
-         (strcmp (previous_iter->item->path, current_iter->item->path) == 0
-          && previous_iter->item->inode != current_iter->item->inode),
-         {
-             cb_invoke (cbs, overwritten, udata, previous_iter->item, current_iter->item);
-         });
+    for (i = 0, j = 0; i < dv->count; i++) {
+        if (dv->items[i] != NULL) {
+            dv->items[j++] = dv->items[i];
+        }
+    }
+    dv->count = j;
 }
 
+/**
+ * Merge items sorted by inode numbers into a sorted list with enough room
+ * reserved. The items must be placed in the list's arena already.
+ *
+ * @param[in] dl   A pointer to a list to merge to.
+ * @param[in] from A pointer to a vector to merge from. Is not changed.
+ **/
+static void
+dl_merge (dep_list *dl, const di_vector *from)
+{
+    assert (dl->count + from->count <= dl->alloc);
+
+    size_t i = dl->count, j = from->count, k = dl->count + from->count;
+
+    while (j > 0) {
+        if (i > 0) {
+            dep_item *di = dl_item (dl, i - 1);
+            if (di_cmp_inode (&di, &from->items[j - 1]) > 0) {
+                dl->items[--k] = dl->items[--i];
+                continue;
+            }
+        }
+        dl->items[--k] = (char *) from->items[--j] - dl->arena;
+    }
+    dl->count += from->count;
+}
 
 /**
- * Traverse a list and invoke a callback for each item.
+ * Traverse a vector and invoke a callback for each item.
  * 
- * @param[in] list  A #dep_list.
+ * @param[in] dv    A #di_vector.
  * @param[in] cb    A #single_entry_cb callback function.
  * @param[in] udata A pointer to the user-defined data.
  **/
 static void 
-dl_emit_single_cb_on (dep_list        *list,
+dl_emit_single_cb_on (const di_vector *dv,
                       single_entry_cb  cb,
                       void            *udata)
 {
-    dep_node *iter;
+    size_t i;
 
     if (cb == NULL)
         return;
 
-    SLIST_FOREACH (iter, &list->head, next) {
-        (cb) (udata, iter->item);
+    for (i = 0; i < dv->count; i++) {
+        (cb) (udata, dv->items[i]);
     }
 }
 
-
 /**
  * Recognize all the changes in the directory, invoke the appropriate callbacks.
  *
- * This is the core function of directory diffing submodule.
- * It deletes before list content on successful completion.
+ * This is the core function of directory diffing submodule. The previous
+ * snapshot is updated to the current contents of the directory before any
+ * callback is invoked. Items of removed files stay valid until all the
+ * callbacks have been invoked.
+ *
+ * The changes are recognized in the following order:
+ *
+ *  - moves: a file has been renamed to a new unique name, i.e. the same
+ *    inode number is found under the different names;
+ *
+ *  - overwrites: a file has been replaced with a file from another
+ *    directory, i.e. the same name is found with the different inode
+ *    numbers. Consider you are watching a directory foo with a file inside
+ *    (foo/bar) and invoke `mv /tmp/1 /foo/bar`;
+ *
+ *  - replacements: a file has been replaced with another file from the
+ *    same directory, i.e. a removed file's name is now taken by a moved one.
+ *    Consider you are watching a directory foo with files foo/bar and
+ *    foo/baz inside and invoke `mv /foo/bar /foo/baz`;
+ *
+ *  - additions and removals: everything else.
+ *
+ * If none of the moved, overwritten and replaced callbacks is set, the
+ * first three phases are skipped, and every change is reported as an
+ * addition or a removal. Additions are reported first in that case.
+ *
+ * @param[in] dd    A pointer to #dep_diff. Freed by the function.
+ * @param[in] cbs   A pointer to user callbacks (#traverse_callbacks).
+ * @param[in] udata A pointer to user data.
+ * @return 0 on success, -1 otherwise. The previous snapshot is not changed
+ *     on failure.
+ **/
+int
+dl_diff_close (dep_diff *dd, const traverse_cbs *cbs, void *udata)
+{
+    assert (dd != NULL);
+    assert (cbs != NULL);
+
+    dep_list *before = dd->before;
+    dep_list *added_dl = dd->added;
+    di_vector added = { NULL, 0 }, removed = { NULL, 0 };
+    di_vector moved_from = { NULL, 0 }, moved_to = { NULL, 0 };
+    di_vector over_from = { NULL, 0 }, over_to = { NULL, 0 };
+    di_vector replaced = { NULL, 0 }, targets = { NULL, 0 };
+    size_t i, j, nremoved = 0, npairs;
+    int retval = -1;
+
+    /* Moves, overwrites and replacements are not looked for if nobody
+     * is interested in them */
+    int pairing = cbs->moved != NULL
+        || cbs->overwritten != NULL
+        || cbs->replaced != NULL;
+
+    if (dd->dls != NULL) {
+        dl_free (dl_listing_close (dd->dls));
+        dd->dls = NULL;
+    }
+
+    dl_sort (before);
+    for (i = 0; i < before->count; i++) {
+        if (!(dl_item (before, i)->flags & DI_SEEN)) {
+            ++nremoved;
+        }
+    }
+    npairs = nremoved < added_dl->count ? nremoved : added_dl->count;
+    if (!pairing) {
+        npairs = 0;
+    }
+
+    /* Allocate everything in advance to not fail halfway. Pointers to the
+     * snapshot items are taken after its arena is extended */
+    if (dv_init (&added, added_dl->count) == -1
+        || dv_init (&removed, nremoved) == -1
+        || dv_init (&moved_from, npairs) == -1
+        || dv_init (&moved_to, npairs) == -1
+        || dv_init (&over_from, npairs) == -1
+        || dv_init (&over_to, npairs) == -1
+        || dv_init (&replaced, npairs) == -1
+        || dv_init (&targets, npairs) == -1
+        || dl_reserve (before, before->count - nremoved + added_dl->count) == -1
+        || dl_reserve_arena (before, added_dl->arena_used) == -1) {
+        perror_msg ("Failed to allocate directory diff lists");
+        goto exit;
+    }
+
+    /* Copy new items to the snapshot arena */
+    size_t base = before->arena_used;
+    if (added_dl->arena_used > 0) {
+        memcpy (before->arena + base, added_dl->arena, added_dl->arena_used);
+        before->arena_used += added_dl->arena_used;
+    }
+    for (i = 0; i < added_dl->count; i++) {
+        added.items[added.count++] =
+            (dep_item *) (before->arena + base + added_dl->items[i]);
+    }
+
+    /* Split the previous snapshot to kept and removed items */
+    for (i = 0, j = 0; i < before->count; i++) {
+        dep_item *di = dl_item (before, i);
+        if (di->flags & DI_SEEN) {
+            di->flags &= ~DI_SEEN;
+            before->items[j++] = before->items[i];
+        } else {
+            removed.items[removed.count++] = di;
+            before->arena_dead += DI_SIZE (di->namelen);
+        }
+    }
+    before->count = j;
+
+    /* And add new items to the snapshot */
+    qsort (added.items, added.count, sizeof (dep_item *), di_cmp_inode);
+    dl_merge (before, &added);
+
+    if (!pairing) {
+        /* Report new names first, so a renamed file is seen under both
+         * names for a moment rather than under none of them */
+        dl_emit_single_cb_on (&added, cbs->added, udata);
+        dl_emit_single_cb_on (&removed, cbs->removed, udata);
+        goto report_many;
+    }
+
+    /* Detect moves. Both vectors are sorted by inode numbers */
+    for (i = 0, j = 0; i < removed.count && j < added.count; ) {
+        ino_t from = removed.items[i]->inode;
+        ino_t to = added.items[j]->inode;
+        if (from < to) {
+            ++i;
+        } else if (from > to) {
+            ++j;
+        } else {
+            moved_from.items[moved_from.count++] = removed.items[i];
+            moved_to.items[moved_to.count++] = added.items[j];
+            removed.items[i++] = NULL;
+            added.items[j++] = NULL;
+        }
+    }
+    dv_compact (&removed);
+    dv_compact (&added);
+
+    /* Detect overwrites. Sort the rest by names */
+    qsort (removed.items, removed.count, sizeof (dep_item *), di_cmp_name);
+    qsort (added.items, added.count, sizeof (dep_item *), di_cmp_name);
+    for (i = 0, j = 0; i < removed.count && j < added.count; ) {
+        int cmp = di_cmp_name (&removed.items[i], &added.items[j]);
+        if (cmp < 0) {
+            ++i;
+        } else if (cmp > 0) {
+            ++j;
+        } else {
+            over_from.items[over_from.count++] = removed.items[i];
+            over_to.items[over_to.count++] = added.items[j];
+            removed.items[i++] = NULL;
+            added.items[j++] = NULL;
+        }
+    }
+    dv_compact (&removed);
+    dv_compact (&added);
+
+    /* Detect replacements, i.e. removed names taken by moved files */
+    for (i = 0; i < moved_to.count; i++) {
+        targets.items[targets.count++] = moved_to.items[i];
+    }
+    qsort (targets.items, targets.count, sizeof (dep_item *), di_cmp_name);
+    for (i = 0, j = 0; i < removed.count && j < targets.count; ) {
+        int cmp = di_cmp_name (&removed.items[i], &targets.items[j]);
+        if (cmp < 0) {
+            ++i;
+        } else if (cmp > 0) {
+            ++j;
+        } else {
+            replaced.items[replaced.count++] = removed.items[i];
+            removed.items[i++] = NULL;
+            ++j;
+        }
+    }
+    dv_compact (&removed);
+
+    for (i = 0; i < moved_from.count; i++) {
+        cb_invoke (cbs, moved, udata, moved_from.items[i], moved_to.items[i]);
+    }
+    for (i = 0; i < over_from.count; i++) {
+        cb_invoke (cbs, overwritten, udata, over_from.items[i], over_to.items[i]);
+    }
+    dl_emit_single_cb_on (&replaced, cbs->replaced, udata);
+
+    if (moved_from.count > 0 || replaced.count > 0) {
+        cb_invoke (cbs, names_updated, udata);
+    }
+
+    dl_emit_single_cb_on (&removed, cbs->removed, udata);
+    dl_emit_single_cb_on (&added, cbs->added, udata);
+
+report_many:
+    cb_invoke (cbs, many_added, udata, added.items, added.count);
+    cb_invoke (cbs, many_removed, udata, removed.items, removed.count);
+
+    /* Drop removed items from the arena once they take more than a half */
+    if (before->arena_dead > before->arena_used / 2) {
+        dl_repack (before);
+    }
+    retval = 0;
+
+exit:
+    free (added.items);
+    free (removed.items);
+    free (moved_from.items);
+    free (moved_to.items);
+    free (over_from.items);
+    free (over_to.items);
+    free (replaced.items);
+    free (targets.items);
+    if (retval == 0) {
+        dl_free (added_dl);
+        free (dd);
+    } else {
+        dl_diff_abort (dd);
+    }
+    return retval;
+}
+
+/**
+ * Recognize all the changes between two listings of a directory, invoke
+ * the appropriate callbacks.
+ *
+ * It deletes before list on successful completion.
  *
  * @param[in] before The previous contents of the directory.
  * @param[in] after  The current contents of the directory.
@@ -630,44 +1791,25 @@ dl_calculate (dep_list           *before,
     assert (after != NULL);
     assert (cbs != NULL);
 
-    int need_update = 0;
-
-    dep_list *now = dl_shallow_copy (after);
-    if (now == NULL) {
+    dep_diff *dd = dl_diff_create (before);
+    if (dd == NULL) {
         return -1;
     }
 
-    dl_detect_unchanged (before, now, cbs, udata);
-
-    dep_list *lst = dl_shallow_copy (now);
-
-    /*
-     * at this point dl_calculate cannot be undone on dl_shallow_copy failure
-     * as some before list items has been already deleted. Handle this with
-     * skipping replacements detection routines. It not so bad as we continue
-     * to invoke handle_removed callback on this items instead of
-     * handle_replacements
-     */
-    if (lst != NULL) { /* TODO: Check & verify the behavior */
-        need_update += dl_detect_moves (before, now, cbs, udata);
-        dl_detect_overwrites (before, now, cbs, udata);
-        need_update += dl_detect_replacements (before, lst, cbs, udata);
-        dl_shallow_free (lst);
+    if (dl_diff_feed (dd, after) == -1) {
+        dl_diff_abort (dd);
+        return -1;
     }
 
-    if (need_update) {
-        cb_invoke (cbs, names_updated, udata);
+    if (dl_diff_close (dd, cbs, udata) == -1) {
+        return -1;
     }
 
-    dl_emit_single_cb_on (before, cbs->removed, udata);
-    dl_emit_single_cb_on (now, cbs->added, udata);
-
-    cb_invoke (cbs, many_added, udata, now);
-    cb_invoke (cbs, many_removed, udata, before);
-    
-    dl_shallow_free (now);
+    /* The updated snapshot is kept in the `before' list now. Move it to
+     * `after' as the caller expects and free the rest */
+    dep_list tmp = *after;
+    *after = *before;
+    *before = tmp;
     dl_free (before);
-
     return 0;
 }
-
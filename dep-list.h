@@ -28,61 +28,46 @@
 #include <sys/types.h> /* ino_t */
 #include <sys/stat.h>  /* mode_t */
 
-#define S_IFUNK 0000000 /* mode_t extension. File type is unknown */
-#define S_ISUNK(m) (((m) & S_IFMT) == S_IFUNK)
-
-typedef struct dep_item {
-    ino_t inode;
-    mode_t type;
-    char path[];
-} dep_item;
-
-typedef struct dep_node {
-    SLIST_ENTRY(dep_node) next;
-    dep_item *item;
-} dep_node;
-
-typedef struct dep_list {
-    SLIST_HEAD(, dep_node) head;
-} dep_list;
-
-typedef void (* no_entry_cb)     (void *udata);
-typedef void (* single_entry_cb) (void *udata, dep_item *di);
-typedef void (* dual_entry_cb)   (void *udata,
-                                  dep_item *from_di,
-                                  dep_item *to_di);
-typedef void (* list_cb)         (void *udata, const dep_list *list);
-
-
-typedef struct traverse_cbs {
-    dual_entry_cb    unchanged;
-    single_entry_cb  added;
-    single_entry_cb  removed;
-    single_entry_cb  replaced;
-    dual_entry_cb    overwritten;
-    dual_entry_cb    moved;
-    list_cb          many_added;
-    list_cb          many_removed;
-    no_entry_cb      names_updated;
-} traverse_cbs;
-
-dep_item* di_create       (const char *path, ino_t inode, mode_t type);
-void      di_free         (dep_item *di);
-
-dep_list* dl_create       ();
-dep_node* dl_insert       (dep_list *dl, dep_item *di);
-void      dl_remove_after (dep_list *dl, dep_node *dn);
-void      dl_print        (const dep_list *dl);
-dep_list* dl_shallow_copy (const dep_list *dl);
-void      dl_shallow_free (dep_list *dl);
-void      dl_free         (dep_list *dl);
-dep_list* dl_listing      (int fd);
-
-int
-dl_calculate (dep_list            *before,
-              dep_list            *after,
-              const traverse_cbs  *cbs,
-              void                *udata);
+#include "deplist.h"
+#include "dir-reader.h"
+
+/*
+ * A directory is listed through its watched file descriptor rewound to the
+ * beginning, without opening it once more, if entries are read in bulk and
+ * the descriptor is readable (i.e. it is not opened with O_EVTONLY).
+ */
+#if defined (DIR_READER_BULK) && !defined (HAVE_O_EVTONLY)
+#define DL_LISTING_IN_PLACE
+#endif
+
+#define DI_SEEN 0x01 /* item is found in a directory being diffed */
+
+/*
+ * A directory snapshot. Items are packed one after another to an arena
+ * and are addressed with 32-bit offsets. The offsets are sorted by inode
+ * number and then by name, so items can be looked up by inode with binary
+ * search. Pointers to items stay valid until new items are added to a list
+ * or it is repacked at the end of a diff.
+ */
+struct dep_list {
+    uint32_t *items;      /* offsets of items in the arena */
+    size_t count;         /* number of items */
+    size_t alloc;         /* number of allocated offsets */
+    int sorted;           /* 0 if items order has been broken */
+    char *arena;          /* memory where the items are stored */
+    size_t arena_used;    /* number of used bytes, removed items included */
+    size_t arena_size;    /* number of allocated bytes */
+    size_t arena_dead;    /* number of bytes taken by removed items */
+    int frozen;           /* 1 if the arena holds an image made by dl_freeze */
+};
+
+#define dl_item(dl, i) ((dep_item *) ((dl)->arena + (dl)->items[(i)]))
+
+/* The public part of the interface is declared in deplist.h */
+void       dl_sort         (dep_list *dl);
+int        dl_freeze       (dep_list *dl);
+int        dl_thaw         (dep_list *dl);
+void       dl_print        (const dep_list *dl);
 
 
 #endif /* __DEP_LIST_H__ */
@@ -0,0 +1,944 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>   /* open, openat, fstatat */
+#include <limits.h>  /* USHRT_MAX */
+#include <stdint.h>  /* SIZE_MAX */
+#include <stdlib.h>  /* calloc, malloc, free, qsort */
+#include <string.h>  /* memcpy */
+#include <time.h>    /* time */
+#include <unistd.h>  /* close */
+
+#include "utils.h"
+#include "dep-list.h"
+#include "thread-pool.h"
+
+/**
+ * A directory of a tree snapshot.
+ *
+ * Paths are not stored in nodes, as directories may be renamed. Nodes of
+ * subdirectories are matched to the directory entries by inode numbers.
+ **/
+typedef struct dt_node {
+    dep_list *list;            /* entries, NULL if the directory is not listed */
+    ino_t inode;               /* inode number of the directory */
+    time_t mtime;              /* modification time seen on the last listing */
+    time_t ctime;              /* status change time seen on the last listing */
+    time_t listed;             /* time the last listing has been started at */
+    struct dt_node **children; /* subdirectories sorted by inode numbers */
+    size_t nchildren;          /* number of subdirectories */
+} dt_node;
+
+struct dep_tree {
+    int fd;          /* the root directory */
+    dev_t dev;       /* a file system the tree resides on */
+    dt_node *root;   /* a node of the root directory */
+    size_t ndirs;    /* number of listed directories */
+    size_t nlisted;  /* number of directories read by the last walk */
+};
+
+/**
+ * A directory visited by a walk. The tree is walked level by level:
+ * directories of a level are read in parallel and the changes are then
+ * reported sequentially in the walker thread.
+ **/
+typedef struct dt_task {
+    dep_tree *dt;    /* a tree being walked */
+    dt_node *node;   /* a directory to visit */
+    char *path;      /* a path relative to the root, empty for the root */
+    size_t pathlen;  /* length of the path */
+    int fresh;       /* 1 if the directory has not been listed before */
+    int listed;      /* 1 if the directory has been read by the walk */
+    dep_diff *dd;    /* changes found in a directory read again */
+    int error;       /* errno of a failed visit or 0 */
+} dt_task;
+
+typedef struct dt_tasks {
+    dt_task *items;  /* tasks of a tree level */
+    size_t count;    /* number of tasks */
+    size_t alloc;    /* number of allocated tasks */
+} dt_tasks;
+
+/**
+ * A state of changes reporting for a single directory.
+ **/
+typedef struct dt_context {
+    dt_task *task;           /* a directory being reported */
+    const traverse_cbs *cbs; /* user callbacks */
+    void *udata;             /* user data */
+    int failed;              /* 1 if some changes could not be reported */
+} dt_context;
+
+/**
+ * Free a node with all its subdirectories.
+ *
+ * @param[in] node A pointer to #dt_node.
+ * @return Number of listed directories freed.
+ **/
+static size_t
+dt_node_free (dt_node *node)
+{
+    size_t i, ndirs = 0;
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < node->nchildren; i++) {
+        ndirs += dt_node_free (node->children[i]);
+    }
+    if (node->list != NULL) {
+        dl_free (node->list);
+        ++ndirs;
+    }
+    free (node->children);
+    free (node);
+    return ndirs;
+}
+
+static int
+dt_node_cmp (const void *a, const void *b)
+{
+    ino_t ia = (*(dt_node * const *) a)->inode;
+    ino_t ib = (*(dt_node * const *) b)->inode;
+    return ia < ib ? -1 : ia > ib;
+}
+
+/**
+ * Find a subdirectory node by an inode number.
+ *
+ * @param[in] node  A pointer to #dt_node.
+ * @param[in] inode An inode number of the subdirectory.
+ * @return An index of the subdirectory or node->nchildren if not found.
+ **/
+static size_t
+dt_node_find (const dt_node *node, ino_t inode)
+{
+    size_t lo = 0, hi = node->nchildren;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (node->children[mid]->inode < inode) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < node->nchildren && node->children[lo]->inode == inode) {
+        return lo;
+    }
+    return node->nchildren;
+}
+
+/**
+ * Make a copy of a directory entry named by a path relative to the root.
+ *
+ * @param[in] prefix    A path of the directory relative to the root.
+ * @param[in] prefixlen Length of the path, 0 for the root.
+ * @param[in] di        A directory entry.
+ * @return A pointer to a new #dep_item or NULL on failure.
+ **/
+static dep_item*
+dt_item (const char *prefix, size_t prefixlen, const dep_item *di)
+{
+    size_t len = prefixlen > 0 ? prefixlen + 1 + di->namelen : di->namelen;
+    if (len > USHRT_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    dep_item *item = malloc (sizeof (dep_item) + len + 1);
+    if (item == NULL) {
+        return NULL;
+    }
+
+    char *p = item->path;
+    if (prefixlen > 0) {
+        memcpy (p, prefix, prefixlen);
+        p += prefixlen;
+        *p++ = '/';
+    }
+    memcpy (p, di->path, di->namelen + 1);
+
+    item->inode = di->inode;
+    item->type = di->type;
+    item->namelen = len;
+    item->flags = 0;
+    item->hash = dl_name_hash (item->path, len);
+    return item;
+}
+
+/**
+ * Report a directory entry with a single entry callback.
+ *
+ * @param[in] ctx       A pointer to #dt_context.
+ * @param[in] cb        A callback to invoke.
+ * @param[in] prefix    A path of the directory relative to the root.
+ * @param[in] prefixlen Length of the path.
+ * @param[in] di        A directory entry.
+ **/
+static void
+dt_emit (dt_context *ctx,
+         single_entry_cb cb,
+         const char *prefix,
+         size_t prefixlen,
+         const dep_item *di)
+{
+    if (cb == NULL) {
+        return;
+    }
+
+    dep_item *item = dt_item (prefix, prefixlen, di);
+    if (item == NULL) {
+        perror_msg ("Failed to report %s in %s", di->path, prefix);
+        ctx->failed = 1;
+        return;
+    }
+    cb (ctx->udata, item);
+    free (item);
+}
+
+/**
+ * Report everything below a directory of the snapshot with a callback.
+ *
+ * @param[in] ctx       A pointer to #dt_context.
+ * @param[in] cb        A callback to invoke on every entry.
+ * @param[in] node      A directory node or NULL.
+ * @param[in] prefix    A path of the directory relative to the root.
+ * @param[in] prefixlen Length of the path.
+ * @param[in] post      1 to report contents of subdirectories before the
+ *     subdirectories themselves (removals), 0 to report them after.
+ **/
+static void
+dt_emit_subtree (dt_context *ctx,
+                 single_entry_cb cb,
+                 const dt_node *node,
+                 const char *prefix,
+                 size_t prefixlen,
+                 int post)
+{
+    size_t i;
+
+    if (cb == NULL || node == NULL || node->list == NULL) {
+        return;
+    }
+
+    for (i = 0; i < node->list->count; i++) {
+        dep_item *di = dl_item (node->list, i);
+        size_t k = S_ISDIR (di->type) ? dt_node_find (node, di->inode)
+                                      : node->nchildren;
+
+        if (k == node->nchildren) {
+            dt_emit (ctx, cb, prefix, prefixlen, di);
+            continue;
+        }
+
+        dep_item *item = dt_item (prefix, prefixlen, di);
+        if (item == NULL) {
+            perror_msg ("Failed to report %s in %s", di->path, prefix);
+            ctx->failed = 1;
+            continue;
+        }
+        if (!post) {
+            cb (ctx->udata, item);
+        }
+        dt_emit_subtree (ctx, cb, node->children[k],
+                         item->path, item->namelen, post);
+        if (post) {
+            cb (ctx->udata, item);
+        }
+        free (item);
+    }
+}
+
+/**
+ * Report removal of the contents of a removed subdirectory.
+ *
+ * @param[in] ctx A pointer to #dt_context.
+ * @param[in] di  A removed entry of the directory being reported.
+ * @param[in] cb  A callback to invoke on every entry.
+ **/
+static void
+dt_emit_removed_subtree (dt_context *ctx, const dep_item *di, single_entry_cb cb)
+{
+    const dt_task *t = ctx->task;
+
+    if (!S_ISDIR (di->type)) {
+        return;
+    }
+
+    size_t k = dt_node_find (t->node, di->inode);
+    if (k == t->node->nchildren) {
+        return;
+    }
+
+    dep_item *item = dt_item (t->path, t->pathlen, di);
+    if (item == NULL) {
+        perror_msg ("Failed to report %s in %s", di->path, t->path);
+        ctx->failed = 1;
+        return;
+    }
+    dt_emit_subtree (ctx, cb, t->node->children[k],
+                     item->path, item->namelen, 1);
+    free (item);
+}
+
+/**
+ * Determine a file type of a new directory entry if it is not known yet.
+ *
+ * @param[in] ctx A pointer to #dt_context.
+ * @param[in] di  A new entry of the directory being reported.
+ **/
+static void
+dt_fix_type (dt_context *ctx, dep_item *di)
+{
+    const dt_task *t = ctx->task;
+    struct stat st;
+
+    if (!S_ISUNK (di->type)) {
+        return;
+    }
+
+    dep_item *item = dt_item (t->path, t->pathlen, di);
+    if (item != NULL
+        && fstatat (t->dt->fd, item->path, &st, AT_SYMLINK_NOFOLLOW) != -1) {
+        di->type = st.st_mode & S_IFMT;
+    }
+    free (item);
+}
+
+static void
+dt_added (void *udata, dep_item *di)
+{
+    dt_context *ctx = udata;
+
+    /* Contents of a new directory are reported on the next level */
+    dt_fix_type (ctx, di);
+    dt_emit (ctx, ctx->cbs->added, ctx->task->path, ctx->task->pathlen, di);
+}
+
+static void
+dt_removed (void *udata, dep_item *di)
+{
+    dt_context *ctx = udata;
+
+    dt_emit_removed_subtree (ctx, di, ctx->cbs->removed);
+    dt_emit (ctx, ctx->cbs->removed, ctx->task->path, ctx->task->pathlen, di);
+}
+
+static void
+dt_replaced (void *udata, dep_item *di)
+{
+    dt_context *ctx = udata;
+    const traverse_cbs *cbs = ctx->cbs;
+
+    dt_emit_removed_subtree (ctx, di, cbs->removed);
+    dt_emit (ctx,
+             cbs->replaced != NULL ? cbs->replaced : cbs->removed,
+             ctx->task->path,
+             ctx->task->pathlen,
+             di);
+}
+
+/**
+ * Report a pair of entries with a dual entry callback.
+ *
+ * @param[in] ctx     A pointer to #dt_context.
+ * @param[in] cb      A callback to invoke.
+ * @param[in] from_di A removed entry.
+ * @param[in] to_di   A new entry.
+ **/
+static void
+dt_emit_pair (dt_context *ctx,
+              dual_entry_cb cb,
+              const dep_item *from_di,
+              const dep_item *to_di)
+{
+    const dt_task *t = ctx->task;
+
+    dep_item *from = dt_item (t->path, t->pathlen, from_di);
+    dep_item *to = dt_item (t->path, t->pathlen, to_di);
+    if (from == NULL || to == NULL) {
+        perror_msg ("Failed to report %s in %s", to_di->path, t->path);
+        ctx->failed = 1;
+    } else {
+        cb (ctx->udata, from, to);
+    }
+    free (from);
+    free (to);
+}
+
+static void
+dt_overwritten (void *udata, dep_item *from_di, dep_item *to_di)
+{
+    dt_context *ctx = udata;
+    const traverse_cbs *cbs = ctx->cbs;
+
+    dt_fix_type (ctx, to_di);
+    dt_emit_removed_subtree (ctx, from_di, cbs->removed);
+
+    if (cbs->overwritten != NULL) {
+        dt_emit_pair (ctx, cbs->overwritten, from_di, to_di);
+    } else {
+        dt_emit (ctx, cbs->removed, ctx->task->path, ctx->task->pathlen,
+                 from_di);
+        dt_emit (ctx, cbs->added, ctx->task->path, ctx->task->pathlen,
+                 to_di);
+    }
+}
+
+static void
+dt_moved (void *udata, dep_item *from_di, dep_item *to_di)
+{
+    dt_context *ctx = udata;
+    const traverse_cbs *cbs = ctx->cbs;
+    const dt_task *t = ctx->task;
+
+    dt_fix_type (ctx, to_di);
+
+    if (cbs->moved != NULL) {
+        /* A moved directory keeps its node, so its contents are moved
+         * implicitly */
+        dt_emit_pair (ctx, cbs->moved, from_di, to_di);
+        return;
+    }
+
+    dt_emit_removed_subtree (ctx, from_di, cbs->removed);
+    dt_emit (ctx, cbs->removed, t->path, t->pathlen, from_di);
+    dt_emit (ctx, cbs->added, t->path, t->pathlen, to_di);
+
+    if (S_ISDIR (to_di->type)) {
+        size_t k = dt_node_find (t->node, to_di->inode);
+        dep_item *item = dt_item (t->path, t->pathlen, to_di);
+        if (item == NULL) {
+            perror_msg ("Failed to report %s in %s", to_di->path, t->path);
+            ctx->failed = 1;
+        } else if (k < t->node->nchildren) {
+            dt_emit_subtree (ctx, cbs->added, t->node->children[k],
+                             item->path, item->namelen, 0);
+        }
+        free (item);
+    }
+}
+
+static void
+dt_names_updated (void *udata)
+{
+    dt_context *ctx = udata;
+
+    if (ctx->cbs->names_updated != NULL) {
+        ctx->cbs->names_updated (ctx->udata);
+    }
+}
+
+/* Pairing is always requested to keep nodes of renamed directories */
+static const traverse_cbs dt_cbs = {
+    dt_added,
+    dt_removed,
+    dt_replaced,
+    dt_overwritten,
+    dt_moved,
+    NULL,
+    NULL,
+    dt_names_updated,
+};
+
+/**
+ * Read a directory of a task. Runs in parallel with other tasks of the
+ * level, so it touches nothing but the task and its node.
+ *
+ * @param[in] arg A pointer to #dt_task.
+ **/
+static void
+dt_task_run (void *arg)
+{
+    dt_task *t = arg;
+    dt_node *node = t->node;
+    struct stat st;
+    size_t i;
+
+    int openflags = O_RDONLY | O_NONBLOCK | O_NOFOLLOW;
+#ifdef O_DIRECTORY
+    openflags |= O_DIRECTORY;
+#endif
+#ifdef O_CLOEXEC
+    openflags |= O_CLOEXEC;
+#endif
+
+    int fd = openat (t->dt->fd, t->pathlen > 0 ? t->path : ".", openflags);
+    if (fd == -1) {
+        t->error = errno;
+        return;
+    }
+
+    if (fstat (fd, &st) == -1) {
+        t->error = errno;
+        goto exit;
+    }
+    if (!S_ISDIR (st.st_mode)) {
+        t->error = ENOTDIR;
+        goto exit;
+    }
+    if (st.st_dev != t->dt->dev) {
+        goto exit;
+    }
+
+    /* A directory is not read again if its stamps are the same and the
+     * previous listing has been started after the last change, i.e. not
+     * within the same second the directory has been changed */
+    time_t now = time (NULL);
+    if (!t->fresh
+        && st.st_ino == node->inode
+        && st.st_mtime == node->mtime
+        && st.st_ctime == node->ctime
+        && node->mtime < node->listed
+        && node->ctime < node->listed) {
+        goto exit;
+    }
+
+    if (t->fresh) {
+        dep_list *list = dl_listing (fd, NULL);
+        if (list == NULL) {
+            t->error = errno;
+            goto exit;
+        }
+        for (i = 0; i < list->count; i++) {
+            dep_item *di = dl_item (list, i);
+            struct stat dst;
+            if (S_ISUNK (di->type)
+                && fstatat (fd, di->path, &dst, AT_SYMLINK_NOFOLLOW) != -1) {
+                di->type = dst.st_mode & S_IFMT;
+            }
+        }
+        node->list = list;
+    } else {
+        t->dd = dl_diff_open (fd, NULL, node->list);
+        if (t->dd == NULL || dl_diff_read (t->dd, SIZE_MAX) == -1) {
+            t->error = errno;
+            if (t->dd != NULL) {
+                dl_diff_abort (t->dd);
+                t->dd = NULL;
+            }
+            goto exit;
+        }
+    }
+
+    node->inode = st.st_ino;
+    node->mtime = st.st_mtime;
+    node->ctime = st.st_ctime;
+    node->listed = now;
+    t->listed = 1;
+
+exit:
+    close (fd);
+}
+
+/**
+ * Update subdirectory nodes of a visited directory and schedule visits
+ * of the subdirectories. Nodes of the gone subdirectories are freed.
+ *
+ * @param[in] t    A pointer to #dt_task.
+ * @param[in] next Tasks of the next level.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+dt_adopt (dt_task *t, dt_tasks *next)
+{
+    dt_node *node = t->node;
+    dep_list *dl = node->list;
+    size_t i, k, count = 0;
+    int failed = 0;
+
+    for (i = 0; i < dl->count; i++) {
+        if (S_ISDIR (dl_item (dl, i)->type)) {
+            ++count;
+        }
+    }
+
+    dt_node **children = malloc ((count > 0 ? count : 1) * sizeof (dt_node *));
+    char *taken = calloc (node->nchildren + 1, 1);
+    if (children == NULL || taken == NULL) {
+        goto fail;
+    }
+
+    if (next->count + count > next->alloc) {
+        size_t alloc = next->alloc > 0 ? next->alloc : 16;
+        while (alloc < next->count + count) {
+            alloc *= 2;
+        }
+        dt_task *items = realloc (next->items, alloc * sizeof (dt_task));
+        if (items == NULL) {
+            goto fail;
+        }
+        next->items = items;
+        next->alloc = alloc;
+    }
+
+    for (i = 0, count = 0; i < dl->count; i++) {
+        dep_item *di = dl_item (dl, i);
+        if (!S_ISDIR (di->type)) {
+            continue;
+        }
+
+        dt_node *child = NULL;
+        k = dt_node_find (node, di->inode);
+        if (k < node->nchildren && !taken[k]) {
+            taken[k] = 1;
+            child = node->children[k];
+        } else {
+            child = calloc (1, sizeof (dt_node));
+            if (child == NULL) {
+                failed = 1;
+                continue;
+            }
+            child->inode = di->inode;
+        }
+        children[count++] = child;
+
+        dt_task *ct = &next->items[next->count];
+        memset (ct, 0, sizeof (dt_task));
+        ct->pathlen = t->pathlen > 0
+            ? t->pathlen + 1 + di->namelen : di->namelen;
+        ct->path = malloc (ct->pathlen + 1);
+        if (ct->path == NULL) {
+            failed = 1;
+            continue;
+        }
+        if (t->pathlen > 0) {
+            memcpy (ct->path, t->path, t->pathlen);
+            ct->path[t->pathlen] = '/';
+            memcpy (ct->path + t->pathlen + 1, di->path, di->namelen + 1);
+        } else {
+            memcpy (ct->path, di->path, di->namelen + 1);
+        }
+        ct->dt = t->dt;
+        ct->node = child;
+        ct->fresh = (child->list == NULL);
+        ++next->count;
+    }
+
+    for (k = 0; k < node->nchildren; k++) {
+        if (!taken[k]) {
+            t->dt->ndirs -= dt_node_free (node->children[k]);
+        }
+    }
+    free (taken);
+    free (node->children);
+
+    qsort (children, count, sizeof (dt_node *), dt_node_cmp);
+    node->children = children;
+    node->nchildren = count;
+
+    if (failed) {
+        perror_msg ("Failed to descend into subdirectories of %s",
+                    t->pathlen > 0 ? t->path : ".");
+        return -1;
+    }
+    return 0;
+
+fail:
+    perror_msg ("Failed to descend into %s", t->pathlen > 0 ? t->path : ".");
+    free (children);
+    free (taken);
+    return -1;
+}
+
+/**
+ * Report changes found in a directory of a task and schedule visits of
+ * its subdirectories.
+ *
+ * @param[in] t     A pointer to #dt_task.
+ * @param[in] cbs   User callbacks or NULL if changes are not reported.
+ * @param[in] udata A pointer to user data.
+ * @param[in] next  Tasks of the next level.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+dt_visit (dt_task *t, const traverse_cbs *cbs, void *udata, dt_tasks *next)
+{
+    dep_tree *dt = t->dt;
+    dt_node *node = t->node;
+    dt_context ctx = { t, cbs, udata, 0 };
+    size_t i;
+
+    if (t->error != 0) {
+        errno = t->error;
+        if (node == dt->root) {
+            perror_msg ("Failed to read the root directory");
+            return -1;
+        }
+        /* A vanished directory is reported by its parent on the next
+         * diff. Other failures leave the subtree as it was */
+        if (t->error != ENOENT && t->error != ENOTDIR) {
+            perror_msg ("Failed to read directory %s", t->path);
+        }
+        return 0;
+    }
+
+    if (node->list == NULL) {
+        /* Resides on another file system */
+        return 0;
+    }
+
+    if (t->listed) {
+        ++dt->nlisted;
+    }
+
+    if (t->fresh) {
+        ++dt->ndirs;
+        if (cbs != NULL) {
+            for (i = 0; i < node->list->count; i++) {
+                dt_emit (&ctx, cbs->added, t->path, t->pathlen,
+                         dl_item (node->list, i));
+            }
+        }
+    } else if (t->dd != NULL) {
+        dep_diff *dd = t->dd;
+        t->dd = NULL;
+        if (dl_diff_close (dd, &dt_cbs, &ctx) == -1) {
+            /* Force the directory to be read again next time */
+            node->listed = 0;
+            return -1;
+        }
+    }
+
+    if (dt_adopt (t, next) == -1) {
+        return -1;
+    }
+    return ctx.failed ? -1 : 0;
+}
+
+/**
+ * Walk a tree level by level, reading and reporting changed directories.
+ *
+ * @param[in] dt    A pointer to #dep_tree.
+ * @param[in] cbs   User callbacks or NULL if changes are not reported.
+ * @param[in] udata A pointer to user data.
+ * @return 0 on success, -1 if some of the changes could not be tracked.
+ **/
+static int
+dt_walk (dep_tree *dt, const traverse_cbs *cbs, void *udata)
+{
+    dt_tasks level = { NULL, 0, 0 };
+    int retval = 0;
+    size_t i;
+
+    level.items = calloc (1, sizeof (dt_task));
+    if (level.items == NULL) {
+        perror_msg ("Failed to allocate a tree walk");
+        return -1;
+    }
+    level.items[0].dt = dt;
+    level.items[0].node = dt->root;
+    level.items[0].path = strdup ("");
+    level.items[0].fresh = (dt->root->list == NULL);
+    level.count = level.alloc = 1;
+    if (level.items[0].path == NULL) {
+        perror_msg ("Failed to allocate a tree walk");
+        free (level.items);
+        return -1;
+    }
+
+    dt->nlisted = 0;
+
+    while (level.count > 0) {
+        dt_tasks next = { NULL, 0, 0 };
+
+        void **args = malloc (level.count * sizeof (void *));
+        if (args != NULL) {
+            for (i = 0; i < level.count; i++) {
+                args[i] = &level.items[i];
+            }
+            pool_run (dt_task_run, args, level.count);
+            free (args);
+        } else {
+            for (i = 0; i < level.count; i++) {
+                dt_task_run (&level.items[i]);
+            }
+        }
+
+        for (i = 0; i < level.count; i++) {
+            dt_task *t = &level.items[i];
+            if (dt_visit (t, cbs, udata, &next) == -1) {
+                retval = -1;
+            }
+            if (t->dd != NULL) {
+                dl_diff_abort (t->dd);
+            }
+            free (t->path);
+        }
+
+        free (level.items);
+        level = next;
+    }
+
+    return retval;
+}
+
+/**
+ * Take a snapshot of a directory tree.
+ *
+ * Directories are read in parallel, one level of the tree at a time.
+ * Unreadable subdirectories are left out of the snapshot and are
+ * reported by dt_diff as new ones once they can be read.
+ *
+ * @param[in] path A path to the root directory of the tree.
+ * @return A pointer to a new #dep_tree or NULL on failure.
+ **/
+dep_tree*
+dt_snapshot (const char *path)
+{
+    assert (path != NULL);
+
+    struct stat st;
+
+    dep_tree *dt = calloc (1, sizeof (dep_tree));
+    if (dt == NULL) {
+        perror_msg ("Failed to allocate a tree snapshot");
+        return NULL;
+    }
+
+    int openflags = O_RDONLY | O_NONBLOCK;
+#ifdef O_DIRECTORY
+    openflags |= O_DIRECTORY;
+#endif
+#ifdef O_CLOEXEC
+    openflags |= O_CLOEXEC;
+#endif
+
+    dt->fd = open (path, openflags);
+    if (dt->fd == -1) {
+        free (dt);
+        return NULL;
+    }
+
+#ifndef O_CLOEXEC
+    if (set_cloexec_flag (dt->fd, 1) == -1) {
+        goto fail;
+    }
+#endif
+
+    if (fstat (dt->fd, &st) == -1) {
+        goto fail;
+    }
+    if (!S_ISDIR (st.st_mode)) {
+        errno = ENOTDIR;
+        goto fail;
+    }
+    dt->dev = st.st_dev;
+
+    dt->root = calloc (1, sizeof (dt_node));
+    if (dt->root == NULL) {
+        goto fail;
+    }
+
+    if (dt_walk (dt, NULL, NULL) == -1 && dt->root->list == NULL) {
+        goto fail;
+    }
+    return dt;
+
+fail:
+    {
+        int saved_errno = errno;
+        dt_free (dt);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+/**
+ * Find changes made in a tree since the snapshot has been taken or
+ * diffed last time and update the snapshot.
+ *
+ * Every change is reported with the same callbacks as dl_calculate uses,
+ * but items are named by paths relative to the root of the tree.
+ * Subdirectories are reported before their contents on addition and
+ * after them on removal. If the moved, overwritten or replaced callbacks
+ * are not set, the changes are reported as removals and additions of the
+ * whole subtrees involved. The many_added and many_removed callbacks are
+ * not invoked.
+ *
+ * A directory is read again only if its inode, modification or status
+ * change time has changed, or it has been changed within the same second
+ * it has been read. Unchanged directories are still descended into, as
+ * changes in a subdirectory do not touch stamps of its parents.
+ *
+ * @param[in] dt    A pointer to #dep_tree.
+ * @param[in] cbs   A pointer to user callbacks (#traverse_cbs).
+ * @param[in] udata A pointer to user data.
+ * @return 0 on success, -1 if some of the changes have not been reported.
+ **/
+int
+dt_diff (dep_tree *dt, const traverse_cbs *cbs, void *udata)
+{
+    assert (dt != NULL);
+    assert (cbs != NULL);
+
+    return dt_walk (dt, cbs, udata);
+}
+
+/**
+ * Get statistics of a tree snapshot.
+ *
+ * @param[in]  dt      A pointer to #dep_tree.
+ * @param[out] ndirs   Number of directories in the snapshot. May be NULL.
+ * @param[out] nlisted Number of directories read by the last dt_snapshot
+ *     or dt_diff call. May be NULL.
+ **/
+void
+dt_stats (const dep_tree *dt, size_t *ndirs, size_t *nlisted)
+{
+    assert (dt != NULL);
+
+    if (ndirs != NULL) {
+        *ndirs = dt->ndirs;
+    }
+    if (nlisted != NULL) {
+        *nlisted = dt->nlisted;
+    }
+}
+
+/**
+ * Free a tree snapshot.
+ *
+ * @param[in] dt A pointer to #dep_tree.
+ **/
+void
+dt_free (dep_tree *dt)
+{
+    if (dt == NULL) {
+        return;
+    }
+
+    dt_node_free (dt->root);
+    if (dt->fd != -1) {
+        close (dt->fd);
+    }
+    free (dt);
+}
@@ -0,0 +1,153 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __DEPLIST_H__
+#define __DEPLIST_H__
+
+/* The public interface of libdeplist, the directory snapshot and diff
+   engine of libinotify-kqueue. It does not depend on kqueue(2) and is
+   built on every system. */
+
+#include <sys/types.h> /* ino_t, size_t */
+#include <sys/stat.h>  /* mode_t */
+#include <stdint.h>    /* uint32_t */
+
+#ifdef __cplusplus
+  #define DL_EXPORT extern "C"
+#else
+  #define DL_EXPORT
+#endif
+
+/* Version of the interface. Incremented on incompatible changes. */
+#define DEPLIST_VERSION 1
+
+/* mode_t extension. File type is unknown. */
+#define S_IFUNK 0000000
+#define S_ISUNK(m) (((m) & S_IFMT) == S_IFUNK)
+
+
+/* A directory entry. PATH is a name for entries of a directory listing
+   and a path relative to the root for entries of a directory tree. */
+typedef struct dep_item {
+    ino_t inode;
+    mode_t type;            /* S_IFMT bits, S_IFUNK if not known */
+    uint32_t hash;          /* dl_name_hash of the name */
+    unsigned short namelen; /* length of the name */
+    unsigned char flags;    /* internal to directory diffing */
+    char path[];
+} dep_item;
+
+/* A directory listing, i.e. a snapshot of a directory. */
+typedef struct dep_list dep_list;
+
+/* A directory listing which can be made in several steps. */
+typedef struct dep_listing dep_listing;
+
+/* A directory diff calculated while listing in several steps. */
+typedef struct dep_diff dep_diff;
+
+/* A snapshot of a whole directory tree. */
+typedef struct dep_tree dep_tree;
+
+/* A reader of directory entries which can be reused for many listings. */
+typedef struct dir_reader dir_reader;
+
+
+/* Callbacks reporting directory changes. Items passed to the callbacks
+   are valid until the callbacks return. Any callback may be NULL. */
+typedef void (* no_entry_cb)     (void *udata);
+typedef void (* single_entry_cb) (void *udata, dep_item *di);
+typedef void (* dual_entry_cb)   (void *udata,
+                                  dep_item *from_di,
+                                  dep_item *to_di);
+typedef void (* list_cb)         (void *udata,
+                                  dep_item *const *items,
+                                  size_t count);
+
+typedef struct traverse_cbs {
+    single_entry_cb  added;         /* a new entry */
+    single_entry_cb  removed;       /* a removed entry */
+    single_entry_cb  replaced;      /* a name taken by a renamed entry */
+    dual_entry_cb    overwritten;   /* a name taken by a foreign entry */
+    dual_entry_cb    moved;         /* a renamed entry */
+    list_cb          many_added;    /* all the added entries at once */
+    list_cb          many_removed;  /* all the removed entries at once */
+    no_entry_cb      names_updated; /* renames have been reported */
+} traverse_cbs;
+
+
+/* Directory listings. */
+DL_EXPORT dep_list* dl_create    (void);
+DL_EXPORT int       dl_insert    (dep_list *dl,
+                                  const char *path,
+                                  ino_t inode,
+                                  mode_t type);
+DL_EXPORT size_t    dl_count     (const dep_list *dl);
+DL_EXPORT dep_item* dl_get       (const dep_list *dl, size_t i);
+DL_EXPORT size_t    dl_find      (dep_list *dl, ino_t inode, size_t *n);
+DL_EXPORT uint32_t  dl_name_hash (const char *name, size_t len);
+DL_EXPORT size_t    dl_footprint (const dep_list *dl);
+DL_EXPORT void      dl_free      (dep_list *dl);
+
+/* Save a listing to the file FD in a compact form and load it back. */
+DL_EXPORT int       dl_save      (const dep_list *dl, int fd);
+DL_EXPORT dep_list* dl_load      (int fd);
+
+/* List the directory FD. DR may be NULL. */
+DL_EXPORT dep_list*    dl_listing       (int fd, dir_reader *dr);
+DL_EXPORT dep_listing* dl_listing_open  (int fd, dir_reader *dr);
+DL_EXPORT int          dl_listing_read  (dep_listing *dls, size_t count);
+DL_EXPORT dep_list*    dl_listing_close (dep_listing *dls);
+
+/* Diff the directory FD against BEFORE and update BEFORE. */
+DL_EXPORT dep_diff* dl_diff_open  (int fd, dir_reader *dr, dep_list *before);
+DL_EXPORT int       dl_diff_read  (dep_diff *dd, size_t count);
+DL_EXPORT int       dl_diff_close (dep_diff *dd,
+                                   const traverse_cbs *cbs,
+                                   void *udata);
+DL_EXPORT void      dl_diff_abort (dep_diff *dd);
+/* Number of added plus removed entries, once the directory is read. */
+DL_EXPORT size_t    dl_diff_changes (const dep_diff *dd);
+
+/* Diff two listings. BEFORE is freed, AFTER becomes the result. */
+DL_EXPORT int dl_calculate (dep_list *before,
+                            dep_list *after,
+                            const traverse_cbs *cbs,
+                            void *udata);
+
+/* Directory readers. BUFSIZE 0 means the default size. */
+DL_EXPORT dir_reader* dr_create (size_t bufsize);
+DL_EXPORT void        dr_free   (dir_reader *dr);
+
+/* Directory trees. Directories on other file systems are not descended
+   into. */
+DL_EXPORT dep_tree* dt_snapshot (const char *path);
+DL_EXPORT int       dt_diff     (dep_tree *dt,
+                                 const traverse_cbs *cbs,
+                                 void *udata);
+DL_EXPORT void      dt_stats    (const dep_tree *dt,
+                                 size_t *ndirs,
+                                 size_t *nlisted);
+DL_EXPORT void      dt_free     (dep_tree *dt);
+
+
+#endif /* __DEPLIST_H__ */
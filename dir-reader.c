@@ -0,0 +1,269 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE /* getdents64 */
+#endif
+
+#include "compat.h"
+
+#include <assert.h>
+#include <errno.h>   /* errno */
+#include <stdlib.h>  /* calloc, malloc, free */
+#include <unistd.h>  /* lseek, close */
+#include <dirent.h>  /* getdents, readdir */
+
+#include "utils.h"
+#include "dir-reader.h"
+
+#if defined (HAVE_GETDENTS64)
+#  define dr_getdents(fd, buf, size) getdents64 (fd, buf, size)
+typedef struct dirent64 dr_dirent;
+#elif defined (HAVE_GETDENTS)
+#  define dr_getdents(fd, buf, size) getdents (fd, buf, size)
+typedef struct dirent dr_dirent;
+#else
+typedef struct dirent dr_dirent;
+#endif
+
+/**
+ * This structure represents a reader of directory entries.
+ *
+ * Where the system provides getdents64 (Linux) or getdents (BSD), entries
+ * are read in bulk to a buffer which is kept between listings. readdir
+ * is used otherwise.
+ **/
+struct dir_reader {
+    int fd;          /* a directory being read or -1 */
+    const name_filter *filter; /* names to skip or NULL */
+#ifdef DIR_READER_BULK
+    char *buf;       /* a buffer for directory entries */
+    size_t size;     /* size of the buffer */
+    size_t pos;      /* offset of the next entry in the buffer */
+    size_t len;      /* number of bytes read to the buffer */
+#else
+    DIR *dir;        /* a directory stream */
+#endif
+};
+
+/**
+ * Create a new directory reader.
+ *
+ * @param[in] bufsize Size of a buffer to read entries to, 0 for default.
+ * @return A pointer to a new reader or NULL in the case of error.
+ **/
+dir_reader*
+dr_create (size_t bufsize)
+{
+    dir_reader *dr = calloc (1, sizeof (dir_reader));
+    if (dr == NULL) {
+        perror_msg ("Failed to allocate directory reader");
+        return NULL;
+    }
+
+    dr->fd = -1;
+#ifdef DIR_READER_BULK
+    dr->size = bufsize > 0 ? bufsize : DIR_READER_BUFSIZE;
+    dr->buf = malloc (dr->size);
+    if (dr->buf == NULL) {
+        perror_msg ("Failed to allocate %zu bytes for directory reader",
+                    dr->size);
+        free (dr);
+        return NULL;
+    }
+#endif
+    return dr;
+}
+
+/**
+ * Set a filter of entry names. Entries filtered out are skipped by dr_next.
+ *
+ * @param[in] dr A pointer to #dir_reader.
+ * @param[in] nf A pointer to #name_filter or NULL to read all the entries.
+ *     Not owned by the reader.
+ **/
+void
+dr_set_filter (dir_reader *dr, const name_filter *nf)
+{
+    assert (dr != NULL);
+    dr->filter = nf;
+}
+
+/**
+ * Start reading a directory from the beginning.
+ *
+ * The file descriptor is rewound but is not owned by the reader, i.e. it
+ * is not closed on dr_stop.
+ *
+ * @param[in] dr A pointer to #dir_reader.
+ * @param[in] fd A file descriptor of a directory.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+dr_start (dir_reader *dr, int fd)
+{
+    assert (dr != NULL);
+    assert (fd != -1);
+
+    dr_stop (dr);
+
+    if (lseek (fd, 0, SEEK_SET) == -1) {
+        perror_msg ("Failed to rewind directory %d", fd);
+        return -1;
+    }
+
+#ifdef DIR_READER_BULK
+    dr->pos = 0;
+    dr->len = 0;
+#else
+    /* Make a copy of fd so it wont be destroyed on closedir */
+    int newfd = dup_cloexec (fd);
+    if (newfd == -1) {
+        perror_msg ("Failed to duplicate directory %d", fd);
+        return -1;
+    }
+
+    dr->dir = fdopendir (newfd);
+    if (dr->dir == NULL) {
+        perror_msg ("Failed to opendir %d", fd);
+        close (newfd);
+        return -1;
+    }
+#endif
+
+    dr->fd = fd;
+    return 0;
+}
+
+/**
+ * Read the next directory entry. "." and ".." are skipped, as well as
+ * the entries filtered out by the filter set with dr_set_filter.
+ *
+ * @param[in]  dr A pointer to #dir_reader.
+ * @param[out] de A pointer to the entry to fill.
+ * @return 1 if an entry has been read, 0 if there are no more entries
+ *     and -1 on error.
+ **/
+int
+dr_next (dir_reader *dr, dr_entry *de)
+{
+    assert (dr != NULL);
+    assert (dr->fd != -1);
+    assert (de != NULL);
+
+    dr_dirent *ent;
+
+    for (;;) {
+#ifdef DIR_READER_BULK
+        if (dr->pos >= dr->len) {
+            ssize_t len = dr_getdents (dr->fd, dr->buf, dr->size);
+            if (len == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                /* The directory could be deleted at this point */
+                if (errno == ENOENT) {
+                    return 0;
+                }
+                perror_msg ("Failed to read entries of directory %d", dr->fd);
+                return -1;
+            }
+            if (len == 0) {
+                return 0;
+            }
+            dr->pos = 0;
+            dr->len = len;
+        }
+
+        ent = (dr_dirent *) (dr->buf + dr->pos);
+        dr->pos += ent->d_reclen;
+#else
+        errno = 0;
+        ent = readdir (dr->dir);
+        if (ent == NULL) {
+            if (errno != 0 && errno != ENOENT) {
+                perror_msg ("Failed to read entries of directory %d", dr->fd);
+                return -1;
+            }
+            return 0;
+        }
+#endif
+
+        /* Skip deleted entries, "." and ".." */
+        if (ent->d_ino == 0
+            || (ent->d_name[0] == '.'
+                && (ent->d_name[1] == '\0'
+                    || (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))) {
+            continue;
+        }
+
+        if (dr->filter != NULL && nf_skips (dr->filter, ent->d_name)) {
+            continue;
+        }
+
+        de->name = ent->d_name;
+        de->inode = ent->d_ino;
+#ifdef DIRENT_HAVE_D_TYPE
+        if (ent->d_type != DT_UNKNOWN)
+            de->type = DTTOIF (ent->d_type);
+        else
+#endif
+            de->type = S_IFUNK;
+        return 1;
+    }
+}
+
+/**
+ * Stop reading a directory. The buffer is kept for the next listing.
+ *
+ * @param[in] dr A pointer to #dir_reader.
+ **/
+void
+dr_stop (dir_reader *dr)
+{
+    assert (dr != NULL);
+
+#ifndef DIR_READER_BULK
+    if (dr->dir != NULL) {
+        closedir (dr->dir);
+        dr->dir = NULL;
+    }
+#endif
+    dr->fd = -1;
+}
+
+/**
+ * Free a directory reader.
+ *
+ * @param[in] dr A pointer to #dir_reader.
+ **/
+void
+dr_free (dir_reader *dr)
+{
+    assert (dr != NULL);
+
+    dr_stop (dr);
+#ifdef DIR_READER_BULK
+    free (dr->buf);
+#endif
+    free (dr);
+}
@@ -0,0 +1,55 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __DIR_READER_H__
+#define __DIR_READER_H__
+
+#include "compat.h"
+
+#include <sys/types.h> /* ino_t, size_t */
+#include <sys/stat.h>  /* mode_t */
+
+#include "deplist.h"  /* S_IFUNK, dir_reader */
+#include "name-filter.h"
+
+/* Entries are read in bulk to a buffer, not through a directory stream */
+#if defined (HAVE_GETDENTS64) || defined (HAVE_GETDENTS)
+#define DIR_READER_BULK
+#endif
+
+/* Default size of a buffer directory entries are read to */
+#define DIR_READER_BUFSIZE (32 * 1024)
+
+typedef struct dr_entry {
+    const char *name;  /* valid until the next dr_next call */
+    ino_t inode;
+    mode_t type;       /* S_IFUNK if not provided by the file system */
+} dr_entry;
+
+dir_reader* dr_create (size_t bufsize);
+void        dr_set_filter (dir_reader *dr, const name_filter *nf);
+int         dr_start  (dir_reader *dr, int fd);
+int         dr_next   (dir_reader *dr, dr_entry *de);
+void        dr_stop   (dir_reader *dr);
+void        dr_free   (dir_reader *dr);
+
+#endif /* __DIR_READER_H__ */
@@ -28,17 +28,58 @@
 #include <assert.h>    /* assert */
 #include <errno.h>     /* errno */
 #include <fcntl.h>     /* AT_FDCWD */
-#include <stdlib.h>    /* calloc, free */
-#include <string.h>    /* strcmp */
+#include <pthread.h>
+#include <stdio.h>     /* snprintf, rename */
+#include <stdlib.h>    /* calloc, free, mkstemp */
+#include <string.h>    /* strlen, strdup, memcpy, memset */
 #include <unistd.h>    /* close */
 
 #include "sys/inotify.h"
 
 #include "inotify-watch.h"
+#include "thread-pool.h"
 #include "utils.h"
 #include "watch-set.h"
 #include "watch.h"
 
+static pthread_mutex_t snapshots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t snapshots_bytes = 0; /* memory taken by all the listings */
+static size_t snapshots_limit = 0; /* 0 means unlimited */
+
+/* Size of the directory reader buffers of subdirectories of recursive
+ * watches. Such subdirectories are many and mostly small */
+#define IWATCH_CHILD_BUFSIZE (4 * 1024)
+
+/**
+ * Compare two watches of subdirectories by inode numbers.
+ *
+ * @param[in] iw1 A pointer to the first #i_watch.
+ * @param[in] iw2 A pointer to the second #i_watch.
+ * @return An integer less than, equal to, or greater than zero.
+ **/
+static int
+iwatch_children_cmp (i_watch *iw1, i_watch *iw2)
+{
+    return ((iw1->inode > iw2->inode) - (iw1->inode < iw2->inode));
+}
+
+RB_GENERATE(iwatch_children, i_watch, sibling, iwatch_children_cmp);
+
+/**
+ * Find a watch of a subdirectory of a recursive watch.
+ *
+ * @param[in] iw    A pointer to #i_watch.
+ * @param[in] inode An inode number of the subdirectory.
+ * @return A pointer to #i_watch of the subdirectory or NULL if not found.
+ **/
+static i_watch*
+iwatch_find_child (i_watch *iw, ino_t inode)
+{
+    i_watch key;
+    key.inode = inode;
+    return RB_FIND (iwatch_children, &iw->children, &key);
+}
+
 /**
  * Preform minimal initialization required for opening watch descriptor
  *
@@ -57,6 +98,146 @@ iwatch_open (const char *path, uint32_t flags)
     return fd;
 }
 
+/**
+ * Make a path of a file to save a snapshot of a directory listing to.
+ * Snapshots are named by device and inode numbers of the directories.
+ *
+ * @param[in] dir  A directory to keep snapshots in.
+ * @param[in] dev  A device number of the watched directory.
+ * @param[in] ino  An inode number of the watched directory.
+ * @param[in] temp 1 to make a mkstemp(3) template of a temporary file.
+ * @return A path to free or NULL on failure.
+ **/
+static char*
+iwatch_snapshot_path (const char *dir, dev_t dev, ino_t ino, int temp)
+{
+    size_t len = strlen (dir) + 2 * 16 + sizeof ("/-.dl.XXXXXX");
+    char *path = malloc (len);
+    if (path == NULL) {
+        perror_msg ("Failed to allocate a snapshot path");
+        return NULL;
+    }
+
+    snprintf (path, len, "%s/%llx-%llx.dl%s",
+              dir,
+              (unsigned long long) dev,
+              (unsigned long long) ino,
+              temp ? ".XXXXXX" : "");
+    return path;
+}
+
+/**
+ * Diff a fresh listing of a directory against a snapshot saved by
+ * iwatch_snapshot_save and report the changes.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ **/
+static void
+iwatch_snapshot_restore (i_watch *iw)
+{
+    char *path = iwatch_snapshot_path (iw->wrk->snapshot_dir,
+                                       iw->dev,
+                                       iw->inode,
+                                       0);
+    if (path == NULL) {
+        return;
+    }
+
+    int openflags = O_RDONLY;
+#ifdef O_CLOEXEC
+    openflags |= O_CLOEXEC;
+#endif
+    int fd = open (path, openflags);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            perror_msg ("Failed to open snapshot %s", path);
+        }
+        free (path);
+        return;
+    }
+
+    dep_list *stored = dl_load (fd);
+    close (fd);
+    if (stored == NULL) {
+        perror_msg ("Failed to load snapshot %s", path);
+        free (path);
+        return;
+    }
+    free (path);
+
+    produce_offline_changes (iw, stored);
+}
+
+/**
+ * Save a directory listing to a snapshot directory, so changes made
+ * after the watch is gone can be reported when it is added again.
+ *
+ * The listing is written to a temporary file first and then renamed.
+ * A snapshot of a listing which is not kept up to date is removed.
+ *
+ * @param[in] iw  A pointer to #i_watch.
+ * @param[in] dir A directory to keep snapshots in.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+iwatch_snapshot_save (i_watch *iw, const char *dir)
+{
+    assert (iw != NULL);
+    assert (dir != NULL);
+
+    if (iw->deps == NULL) {
+        return 0;
+    }
+
+    int retval = -1;
+    char *path = iwatch_snapshot_path (dir, iw->dev, iw->inode, 0);
+    char *temp = iwatch_snapshot_path (dir, iw->dev, iw->inode, 1);
+    if (path == NULL || temp == NULL) {
+        goto exit;
+    }
+
+    if (iw->deps_stale) {
+        if (unlink (path) == -1 && errno != ENOENT) {
+            perror_msg ("Failed to remove stale snapshot %s", path);
+            goto exit;
+        }
+        retval = 0;
+        goto exit;
+    }
+
+    /* The snapshot directory may be writable by others, so the temporary
+     * file must be a new one rather than anything found at its path */
+    int fd = mkstemp (temp);
+    if (fd == -1) {
+        perror_msg ("Failed to create snapshot %s", temp);
+        goto exit;
+    }
+    if (set_cloexec_flag (fd, 1) == -1) {
+        perror_msg ("Failed to set close-on-exec flag on %s", temp);
+        close (fd);
+        unlink (temp);
+        goto exit;
+    }
+
+    if (dl_save (iw->deps, fd) == -1) {
+        perror_msg ("Failed to save snapshot %s", temp);
+        close (fd);
+        unlink (temp);
+        goto exit;
+    }
+    if (close (fd) == -1 || rename (temp, path) == -1) {
+        perror_msg ("Failed to save snapshot %s", path);
+        unlink (temp);
+        goto exit;
+    }
+    retval = 0;
+
+exit:
+    free (path);
+    free (temp);
+    return retval;
+}
+
 /**
  * Initialize inotify watch.
  *
@@ -86,6 +267,23 @@ iwatch_init (worker *wrk, int fd, uint32_t flags)
     }
 
     iw->deps = NULL;
+    iw->reader = NULL;
+    iw->deps_bytes = 0;
+    iw->deps_stale = 0;
+    iw->resync = IW_RESYNC_NONE;
+    iw->summary_threshold = 0;
+    iw->filter = NULL;
+    iw->filter_next = NULL;
+    iw->flags_next = 0;
+    iw->flags_changed = 0;
+    iw->parent = NULL;
+    iw->name = NULL;
+    iw->links = 0;
+    RB_INIT (&iw->children);
+    iw->queued = 0;
+    iw->walked = 0;
+    iw->announce = 0;
+    iw->detached_from = NULL;
     iw->wrk = wrk;
     iw->wd = fd;
     iw->flags = flags;
@@ -96,7 +294,20 @@ iwatch_init (worker *wrk, int fd, uint32_t flags)
     watch_set_init (&iw->watches);
 
     if (S_ISDIR (st.st_mode)) {
-        iw->deps = dl_listing (fd);
+        iw->reader = dr_create (DIR_READER_BUFSIZE);
+        if (iw->reader == NULL) {
+            iwatch_free (iw);
+            return NULL;
+        }
+
+        /* Nothing depends on the contents of the directory yet, so the
+         * listing is postponed until the flags are changed */
+        if (iwatch_diff_level (iw) == IW_DIFF_NONE) {
+            iw->deps = dl_create ();
+            iw->deps_stale = 1;
+        } else {
+            iw->deps = dl_listing (fd, iw->reader);
+        }
         if (iw->deps == NULL) {
             perror_msg ("Directory listing of %d failed", fd);
             iwatch_free (iw);
@@ -111,13 +322,25 @@ iwatch_init (worker *wrk, int fd, uint32_t flags)
     }
 
     watch_set_insert (&iw->watches, parent);
+    /* The descriptor may be replaced with one shared by another worker */
+    iw->wd = parent->fd;
 
     if (S_ISDIR (st.st_mode)) {
 
-        dep_node *iter;
-        SLIST_FOREACH (iter, &iw->deps->head, next) {
-            iwatch_add_subwatch (iw, iter->item);
+        size_t i;
+        for (i = 0; i < iw->deps->count; i++) {
+            iwatch_add_subwatch (iw, dl_item (iw->deps, i));
         }
+
+        /* Report changes made while the directory has not been watched */
+        if (wrk->snapshot_dir != NULL && !iw->deps_stale) {
+            iwatch_snapshot_restore (iw);
+        }
+        iw->walked = 1;
+        iwatch_snapshot_used (iw);
+
+        /* Watch the whole tree before returning to a user */
+        iwatch_walk (wrk);
     }
     return iw;
 }
@@ -132,13 +355,109 @@ iwatch_free (i_watch *iw)
 {
     assert (iw != NULL);
 
+    i_watch *child, *tmp;
+    RB_FOREACH_SAFE (child, iwatch_children, &iw->children, tmp) {
+        RB_REMOVE (iwatch_children, &iw->children, child);
+        iwatch_free (child);
+    }
+    if (iw->queued) {
+        TAILQ_REMOVE (&iw->wrk->unwalked, iw, unwalked);
+    }
+
+    /* Subdirectories moved out of the tree can not come back anymore */
+    if (iw->parent == NULL && iw->detached_from == NULL) {
+        for (child = TAILQ_FIRST (&iw->wrk->detached); child; child = tmp) {
+            tmp = TAILQ_NEXT (child, unwalked);
+            if (child->detached_from == iw) {
+                TAILQ_REMOVE (&iw->wrk->detached, child, unwalked);
+                iwatch_free (child);
+            }
+        }
+    }
+
     watch_set_free (&iw->watches);
+    if (iw->deps_bytes > 0) {
+        TAILQ_REMOVE (&iw->wrk->snapshots, iw, lru);
+        pthread_mutex_lock (&snapshots_mutex);
+        snapshots_bytes -= iw->deps_bytes;
+        pthread_mutex_unlock (&snapshots_mutex);
+    }
     if (iw->deps != NULL) {
         dl_free (iw->deps);
     }
+    if (iw->reader != NULL) {
+        dr_free (iw->reader);
+    }
+    nf_free (iw->filter);
+    nf_free (iw->filter_next);
+    free (iw->name);
     free (iw);
 }
 
+/**
+ * Start watching a subdirectory of a recursive watch.
+ *
+ * The subdirectory is listed later by iwatch_walk.
+ *
+ * @param[in] iw A pointer to #i_watch of the parent directory.
+ * @param[in] di A dependency item of the subdirectory.
+ * @param[in] fd A file descriptor of the subdirectory. Owned by the
+ *     function after the call.
+ * @param[in] st A pointer to stat information of the subdirectory.
+ **/
+static void
+iwatch_add_child (i_watch *iw, const dep_item *di, int fd, struct stat *st)
+{
+    i_watch *child = calloc (1, sizeof (i_watch));
+    if (child == NULL) {
+        perror_msg ("Failed to allocate inotify watch");
+        close (fd);
+        return;
+    }
+
+    child->name = strdup (di->path);
+    if (child->name == NULL) {
+        perror_msg ("Failed to allocate name of subdirectory %s", di->path);
+        free (child);
+        close (fd);
+        return;
+    }
+
+    child->wrk = iw->wrk;
+    child->wd = fd;
+    child->flags = iw->flags;
+    child->inode = st->st_ino;
+    child->dev = st->st_dev;
+    child->parent = iw;
+    child->links = 1;
+    child->announce = iw->walked || iw->announce;
+    RB_INIT (&child->children);
+    watch_set_init (&child->watches);
+
+    /* Name filters of the tree apply to the subdirectory too */
+    child->reader = dr_create (IWATCH_CHILD_BUFSIZE);
+    if (child->reader == NULL) {
+        iwatch_free (child);
+        close (fd);
+        return;
+    }
+    dr_set_filter (child->reader, iwatch_root (iw)->filter);
+
+    watch *w = watch_init (child, WATCH_USER, fd, st);
+    if (w == NULL) {
+        iwatch_free (child);
+        close (fd);
+        return;
+    }
+
+    watch_set_insert (&child->watches, w);
+    child->wd = w->fd;
+
+    RB_INSERT (iwatch_children, &iw->children, child);
+    TAILQ_INSERT_TAIL (&iw->wrk->unwalked, child, unwalked);
+    child->queued = 1;
+}
+
 /**
  * Start watching a file or a directory.
  *
@@ -157,6 +476,17 @@ iwatch_add_subwatch (i_watch *iw, dep_item *di)
         return NULL;
     }
 
+    int recursive = iw->flags & IN_RECURSIVE;
+    i_watch *child;
+    if (recursive && (child = iwatch_find_child (iw, di->inode)) != NULL) {
+        /* A directory has got a new name while the old one is still
+         * listed. The old name is to be removed */
+        ++child->links;
+        di->type = S_IFDIR;
+        iwatch_rename_subwatch (iw, di);
+        return NULL;
+    }
+
     watch *w = watch_set_find (&iw->watches, di->inode);
     if (w != NULL) {
         di->type = w->flags & S_IFMT;
@@ -165,7 +495,9 @@ iwatch_add_subwatch (i_watch *iw, dep_item *di)
 
     /* Don`t open a watches with empty kqueue filter flags */
     watch_flags_t wf = (di->type & S_IFMT) | WF_ISSUBWATCH;
-    if (!S_ISUNK (di->type) && inotify_to_kqueue (iw->flags, wf) == 0) {
+    if (!S_ISUNK (di->type)
+        && !(recursive && S_ISDIR (di->type))
+        && inotify_to_kqueue (iw->flags, wf) == 0) {
         return NULL;
     }
 
@@ -193,6 +525,7 @@ iwatch_add_subwatch (i_watch *iw, dep_item *di)
             /* Race detected. Use new inode number and try to find watch again */
             perror_msg ("%s has been replaced after directory listing", di->path);
             di->inode = st.st_ino;
+            iw->deps->sorted = 0;
             w = watch_set_find (&iw->watches, di->inode);
             if (w != NULL) {
                 close (fd);
@@ -201,6 +534,18 @@ iwatch_add_subwatch (i_watch *iw, dep_item *di)
         }
     }
 
+    /* Subdirectories of recursive watches get watches of their own */
+    if (recursive && S_ISDIR (st.st_mode)) {
+        child = iwatch_find_child (iw, st.st_ino);
+        if (child != NULL) {
+            close (fd);
+            ++child->links;
+        } else {
+            iwatch_add_child (iw, di, fd, &st);
+        }
+        return NULL;
+    }
+
     w = watch_init (iw, WATCH_DEPENDENCY, fd, &st);
     if (w == NULL) {
         close (fd);
@@ -236,6 +581,26 @@ iwatch_del_subwatch (i_watch *iw, const dep_item *di)
     assert (iw != NULL);
     assert (di != NULL);
 
+    if (iw->flags & IN_RECURSIVE) {
+        i_watch *child = iwatch_find_child (iw, di->inode);
+        if (child != NULL) {
+            assert (child->links > 0);
+            if (--child->links == 0) {
+                RB_REMOVE (iwatch_children, &iw->children, child);
+                if (child->queued) {
+                    iwatch_free (child);
+                } else {
+                    /* The subdirectory may have been moved to another
+                     * directory of the tree. Keep it till the walk */
+                    child->detached_from = iwatch_root (iw);
+                    child->parent = NULL;
+                    TAILQ_INSERT_TAIL (&iw->wrk->detached, child, unwalked);
+                }
+            }
+            return;
+        }
+    }
+
     watch *w = watch_set_find (&iw->watches, di->inode);
     if (w != NULL) {
         assert (w->refcount > 0);
@@ -247,11 +612,448 @@ iwatch_del_subwatch (i_watch *iw, const dep_item *di)
     }
 }
 
+/**
+ * Follow a rename of a subdirectory of a recursive watch.
+ *
+ * @param[in] iw A pointer to the #i_watch.
+ * @param[in] di A dependency list item with the new name.
+ **/
+void
+iwatch_rename_subwatch (i_watch *iw, const dep_item *di)
+{
+    assert (iw != NULL);
+    assert (di != NULL);
+
+    if (!(iw->flags & IN_RECURSIVE)) {
+        return;
+    }
+
+    i_watch *child = iwatch_find_child (iw, di->inode);
+    if (child == NULL) {
+        return;
+    }
+
+    char *name = strdup (di->path);
+    if (name == NULL) {
+        perror_msg ("Failed to allocate name of subdirectory %s", di->path);
+        return;
+    }
+    free (child->name);
+    child->name = name;
+}
+
+/**
+ * Get the topmost watch of a recursive watch.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ * @return A pointer to #i_watch created with inotify_add_watch.
+ **/
+i_watch*
+iwatch_root (i_watch *iw)
+{
+    assert (iw != NULL);
+
+    while (iw->parent != NULL) {
+        iw = iw->parent;
+    }
+    return iw;
+}
+
+/**
+ * Make a path of a directory entry relative to the topmost watch.
+ *
+ * @param[in]  iw   A pointer to #i_watch of the directory.
+ * @param[in]  name A name of the entry.
+ * @param[out] len  Length of the path.
+ * @return A newly allocated path or NULL on failure.
+ **/
+char*
+iwatch_path (i_watch *iw, const char *name, size_t *len)
+{
+    assert (iw != NULL);
+    assert (name != NULL);
+    assert (len != NULL);
+
+    size_t name_len = strlen (name);
+    size_t total = name_len;
+    i_watch *p;
+
+    for (p = iw; p->parent != NULL; p = p->parent) {
+        total += strlen (p->name) + 1;
+    }
+
+    char *path = malloc (total + 1);
+    if (path == NULL) {
+        perror_msg ("Failed to allocate path of %s", name);
+        return NULL;
+    }
+
+    char *end = path + total;
+    *end = '\0';
+    end -= name_len;
+    memcpy (end, name, name_len);
+    for (p = iw; p->parent != NULL; p = p->parent) {
+        size_t plen = strlen (p->name);
+        *--end = '/';
+        end -= plen;
+        memcpy (end, p->name, plen);
+    }
+
+    *len = total;
+    return path;
+}
+
+/**
+ * Append entries of a directory listing to a buffer of inotify_dirent
+ * records. Listings of subdirectories of a recursive watch follow.
+ *
+ * @param[in]     iw    A pointer to #i_watch.
+ * @param[in,out] buf   A pointer to the buffer.
+ * @param[in,out] size  Number of bytes used in the buffer.
+ * @param[in,out] alloc Number of bytes allocated for the buffer.
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+iwatch_listing_append (i_watch *iw, char **buf, size_t *size, size_t *alloc)
+{
+    assert (iw != NULL);
+
+    /* A subdirectory waits for the walk, its entries will be reported
+     * as created */
+    if (iw->deps == NULL) {
+        return 0;
+    }
+
+    dep_list *dl = iw->deps;
+    dep_list *fresh = NULL;
+    int retval = -1;
+
+    if (iw->deps_stale) {
+        /* The listing is not kept up to date, so take a fresh one */
+        fresh = dl_listing (iw->wd, iw->reader);
+        if (fresh == NULL) {
+            perror_msg ("Directory listing of %d failed", iw->wd);
+            return -1;
+        }
+        dl = fresh;
+    } else if (iwatch_snapshot_thaw (iw) == -1) {
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < dl->count; i++) {
+        const dep_item *di = dl_item (dl, i);
+        const char *name = di->path;
+        size_t name_len = di->namelen;
+        char *path = NULL;
+
+        if (iw->parent != NULL) {
+            path = iwatch_path (iw, di->path, &name_len);
+            if (path == NULL) {
+                goto exit;
+            }
+            name = path;
+        }
+
+        /* Keep the records 8-byte aligned */
+        size_t len = (name_len + 8) & ~(size_t) 7;
+        size_t reclen = sizeof (struct inotify_dirent) + len;
+
+        if (*size + reclen > *alloc) {
+            size_t to_allocate = *alloc * 2;
+            if (to_allocate < *size + reclen) {
+                to_allocate = *size + reclen;
+            }
+            void *ptr = realloc (*buf, to_allocate);
+            if (ptr == NULL) {
+                perror_msg ("Failed to extend listing to %zu bytes",
+                            to_allocate);
+                free (path);
+                goto exit;
+            }
+            *buf = ptr;
+            *alloc = to_allocate;
+        }
+
+        struct inotify_dirent *de = (struct inotify_dirent *) (*buf + *size);
+        memset (de, 0, reclen);
+        de->ino = di->inode;
+        de->type = di->type & S_IFMT;
+        de->len = len;
+        memcpy (de->name, name, name_len);
+        *size += reclen;
+
+        free (path);
+    }
+
+    i_watch *child;
+    RB_FOREACH (child, iwatch_children, &iw->children) {
+        if (iwatch_listing_append (child, buf, size, alloc) == -1) {
+            goto exit;
+        }
+    }
+    retval = 0;
+
+exit:
+    if (fresh != NULL) {
+        dl_free (fresh);
+    }
+    return retval;
+}
+
+/**
+ * Copy the directory listing of an inotify watch to a flat buffer of
+ * inotify_dirent records.
+ *
+ * Entries of a recursive watch are named relative to the watched
+ * directory, so the buffer describes the whole tree.
+ *
+ * @param[in]  iw   A pointer to #i_watch created with inotify_add_watch.
+ * @param[out] size Number of bytes in the buffer.
+ * @return A newly allocated buffer or NULL on failure.
+ **/
+void*
+iwatch_listing (i_watch *iw, size_t *size)
+{
+    assert (iw != NULL);
+    assert (size != NULL);
+
+    if (iw->deps == NULL) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    size_t alloc = sizeof (struct inotify_dirent) * 16;
+    size_t used = 0;
+    char *buf = malloc (alloc);
+    if (buf == NULL) {
+        perror_msg ("Failed to allocate listing of watch %d", iw->wd);
+        return NULL;
+    }
+
+    if (iwatch_listing_append (iw, &buf, &used, &alloc) == -1) {
+        free (buf);
+        return NULL;
+    }
+
+    *size = used;
+    return buf;
+}
+
+/**
+ * List a directory queued for the walk. Invoked from the helper threads.
+ *
+ * @param[in] arg A pointer to #i_watch.
+ **/
+static void
+iwatch_list_task (void *arg)
+{
+    i_watch *iw = (i_watch *) arg;
+    iw->deps = dl_listing (iw->wd, iw->reader);
+}
+
+/**
+ * Put subdirectories moved within their trees back in place of the watches
+ * made for their new names.
+ *
+ * A subdirectory moved between two directories of a recursive watch is
+ * removed from one of them and added to another in any order, so by the
+ * walk a new watch is queued for it and the old one is detached. The old
+ * watch keeps its subtree watched and listed, so the entries are not
+ * reported as created once more.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+iwatch_reattach (worker *wrk)
+{
+    i_watch *iw, *tmp, *old;
+
+    if (TAILQ_EMPTY (&wrk->detached)) {
+        return;
+    }
+
+    for (iw = TAILQ_FIRST (&wrk->unwalked); iw != NULL; iw = tmp) {
+        tmp = TAILQ_NEXT (iw, unwalked);
+
+        i_watch *root = iwatch_root (iw);
+        TAILQ_FOREACH (old, &wrk->detached, unwalked) {
+            if (old->detached_from == root
+                && old->inode == iw->inode
+                && old->dev == iw->dev) {
+                break;
+            }
+        }
+        if (old == NULL) {
+            continue;
+        }
+
+        TAILQ_REMOVE (&wrk->detached, old, unwalked);
+        RB_REMOVE (iwatch_children, &iw->parent->children, iw);
+
+        free (old->name);
+        old->name = iw->name;
+        iw->name = NULL;
+        old->parent = iw->parent;
+        old->links = iw->links;
+        old->detached_from = NULL;
+        RB_INSERT (iwatch_children, &old->parent->children, old);
+
+        /* The flags may have been changed while detached */
+        if (old->flags != iw->flags) {
+            iwatch_update_flags (old, iw->flags);
+        }
+        iwatch_free (iw);
+    }
+}
+
+/**
+ * Watch the subtrees of directories found by recursive watches.
+ *
+ * Directories queued by iwatch_add_subwatch are listed level by level,
+ * directories of the same level in parallel on the helper pool, and their
+ * entries are watched in turn. Entries of directories created after the
+ * watch has been set up are reported as created, so files which appeared
+ * before the directory has been watched are not missed. Subdirectories
+ * moved within their trees are reattached instead (see iwatch_reattach),
+ * and the ones removed are freed.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+void
+iwatch_walk (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    i_watch **level = NULL;
+    size_t nalloc = 0;
+
+    while (!TAILQ_EMPTY (&wrk->unwalked)) {
+        i_watch *iw, *tmp, *single;
+        i_watch **batch = level;
+        size_t n = 0, i, j;
+
+        iwatch_reattach (wrk);
+
+        /* Subtrees of detached subdirectories wait for them to be
+         * reattached or freed */
+        TAILQ_FOREACH (iw, &wrk->unwalked, unwalked) {
+            if (iwatch_root (iw)->detached_from == NULL) {
+                ++n;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+        if (n > nalloc) {
+            void *ptr = realloc (level, n * sizeof (i_watch *));
+            if (ptr != NULL) {
+                level = batch = ptr;
+                nalloc = n;
+            } else {
+                /* List the directories one by one */
+                perror_msg ("Failed to allocate %zu directories to list", n);
+                batch = &single;
+                n = 1;
+            }
+        }
+
+        for (i = 0, iw = TAILQ_FIRST (&wrk->unwalked); i < n; iw = tmp) {
+            tmp = TAILQ_NEXT (iw, unwalked);
+            if (iwatch_root (iw)->detached_from == NULL) {
+                TAILQ_REMOVE (&wrk->unwalked, iw, unwalked);
+                iw->queued = 0;
+                batch[i++] = iw;
+            }
+        }
+
+        pool_run (iwatch_list_task, (void **) batch, n);
+
+        for (i = 0; i < n; i++) {
+            iw = batch[i];
+            if (iw->deps == NULL) {
+                perror_msg ("Directory listing of %d failed", iw->wd);
+                iw->deps = dl_create ();
+                if (iw->deps == NULL) {
+                    RB_REMOVE (iwatch_children, &iw->parent->children, iw);
+                    iwatch_free (iw);
+                    continue;
+                }
+            }
+
+            for (j = 0; j < iw->deps->count; j++) {
+                dep_item *di = dl_item (iw->deps, j);
+                iwatch_add_subwatch (iw, di);
+                if (iw->announce) {
+                    enqueue_event (iw, IN_CREATE, di);
+                }
+            }
+            iw->walked = 1;
+            iwatch_snapshot_used (iw);
+        }
+    }
+
+    free (level);
+
+    /* Subdirectories not found elsewhere in their trees are gone */
+    i_watch *iw;
+    while ((iw = TAILQ_FIRST (&wrk->detached)) != NULL) {
+        TAILQ_REMOVE (&wrk->detached, iw, unwalked);
+        iwatch_free (iw);
+    }
+}
+
+/**
+ * Check if a change of inotify watch flags requires to watch subfiles
+ * of a type which have not been watched before.
+ *
+ * @param[in] old_flags Previous inotify watch flags.
+ * @param[in] flags     New inotify watch flags.
+ * @param[in] type      A file type (S_IFMT part of mode_t).
+ * @return 1 if subfiles of the type should be opened now, 0 otherwise.
+ **/
+static int
+iwatch_gains_type (uint32_t old_flags, uint32_t flags, mode_t type)
+{
+    watch_flags_t wf = type | WF_ISSUBWATCH;
+    return inotify_to_kqueue (old_flags, wf) == 0
+        && inotify_to_kqueue (flags, wf) != 0;
+}
+
+/**
+ * Postpone an update of inotify watch flags till the end of the batch
+ * of kqueue events.
+ *
+ * Used while the watched tree is being diffed, as subwatches of entries
+ * not reported by the diff yet must not be added ahead of it.
+ *
+ * @param[in] iw    A pointer to #i_watch created with inotify_add_watch.
+ * @param[in] flags A combination of the inotify watch flags.
+ **/
+void
+iwatch_defer_flags (i_watch *iw, uint32_t flags)
+{
+    assert (iw != NULL);
+
+    /* IN_MASK_ADD extends the flags to set, but the result is merged with
+     * the current flags only if the earlier update asked for it too */
+    if (iw->flags_changed && flags & IN_MASK_ADD) {
+        flags = (flags | iw->flags_next) & ~IN_MASK_ADD;
+        flags |= iw->flags_next & IN_MASK_ADD;
+    }
+
+    iw->flags_next = flags;
+    iw->flags_changed = 1;
+    iw->wrk->flags_changed = 1;
+}
+
 /**
  * Update inotify watch flags.
  *
  * When called for a directory watch, update also the flags of all the
- * dependent (child) watches.
+ * dependent (child) watches. Only watches which kqueue filter flags are
+ * changed are touched, and subfiles are opened only if the new flags
+ * require to watch a new type of subfiles.
  *
  * @param[in] iw    A pointer to #i_watch.
  * @param[in] flags A combination of the inotify watch flags.
@@ -266,35 +1068,378 @@ iwatch_update_flags (i_watch *iw, uint32_t flags)
         flags |= iw->flags;
     }
 
+    /* A watch can not become recursive or stop being recursive */
+    flags = (flags & ~IN_RECURSIVE) | (iw->flags & IN_RECURSIVE);
+
+    uint32_t old_flags = iw->flags;
     iw->flags = flags;
 
+    watch *batch[WATCH_BATCH];
+    uint32_t fflags[WATCH_BATCH];
+    size_t nbatch = 0;
+
     watch *w, *tmpw;
     /* update kwatches or close those we dont need to watch */
     RB_FOREACH_SAFE (w, watch_set, &iw->watches, tmpw) {
-        uint32_t fflags = inotify_to_kqueue (flags, w->flags);
-        if (fflags == 0) {
+        uint32_t was = inotify_to_kqueue (old_flags, w->flags);
+        uint32_t now = inotify_to_kqueue (flags, w->flags);
+        if (now == was) {
+            continue;
+        }
+
+        if (now == 0) {
             watch_set_delete (&iw->watches, w);
         } else {
-            watch_register_event (w, fflags);
+            batch[nbatch] = w;
+            fflags[nbatch] = now;
+            if (++nbatch == WATCH_BATCH) {
+                watch_register_events (batch, fflags, nbatch);
+                nbatch = 0;
+            }
         }
     }
+    watch_register_events (batch, fflags, nbatch);
 
-    if (iw->deps != NULL) {
-        /* create list of unwatched subfiles */
-        dep_list *dl = dl_shallow_copy (iw->deps);
-        dep_node *iter, *tmpdn, *prev = NULL;
-        SLIST_FOREACH_SAFE (iter, &iw->deps->head, next, tmpdn) {
-            if (watch_set_find (&iw->watches, iter->item->inode)) {
-                dl_remove_after (dl, prev);
-            } else {
-                prev = iter;
-            }
+    i_watch *child;
+    RB_FOREACH (child, iwatch_children, &iw->children) {
+        iwatch_update_flags (child, flags);
+    }
+
+    if (iw->deps == NULL) {
+        return;
+    }
+
+    if (iw->deps_stale && iwatch_diff_level (iw) != IW_DIFF_NONE) {
+        dep_list *deps = dl_listing (iw->wd, iw->reader);
+        if (deps == NULL) {
+            perror_msg ("Directory listing of %d failed", iw->wd);
+            return;
+        }
+        dl_free (iw->deps);
+        iw->deps = deps;
+        iw->deps_stale = 0;
+        iwatch_snapshot_used (iw);
+    }
+
+    int gains_reg = iwatch_gains_type (old_flags, flags, S_IFREG);
+    int gains_dir = iwatch_gains_type (old_flags, flags, S_IFDIR);
+    int gains_lnk = iwatch_gains_type (old_flags, flags, S_IFLNK);
+    if (!(gains_reg || gains_dir || gains_lnk)
+        || iwatch_snapshot_thaw (iw) == -1) {
+        return;
+    }
+
+    /* create list of unwatched subfiles of the gained types. Subfiles of
+     * unknown types are retried as well */
+    dep_item **unwatched = malloc (iw->deps->count * sizeof (dep_item *));
+    if (unwatched == NULL && iw->deps->count > 0) {
+        perror_msg ("Failed to allocate list of unwatched subfiles");
+        return;
+    }
+
+    size_t i, n = 0;
+    for (i = 0; i < iw->deps->count; i++) {
+        dep_item *di = dl_item (iw->deps, i);
+        if ((S_ISUNK (di->type)
+             || (gains_reg && S_ISREG (di->type))
+             || (gains_dir && S_ISDIR (di->type))
+             || (gains_lnk && S_ISLNK (di->type)))
+            && !watch_set_find (&iw->watches, di->inode)
+            && !iwatch_find_child (iw, di->inode)) {
+            unwatched[n++] = di;
+        }
+    }
+
+    /* And finally try to watch that list */
+    for (i = 0; i < n; i++) {
+        iwatch_add_subwatch (iw, unwatched[i]);
+    }
+    free (unwatched);
+}
+
+/**
+ * Determine how much of a directory diff is needed to serve the inotify
+ * watch flags.
+ *
+ * Moves and overwrites are recognized only for watches interested in
+ * entry events. Watches that need subwatches only (e.g. IN_MODIFY on a
+ * directory) just follow additions and removals of the entries.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ * @return A #iwatch_diff_level_t value.
+ **/
+iwatch_diff_level_t
+iwatch_diff_level (i_watch *iw)
+{
+    assert (iw != NULL);
+
+    if (iw->flags & (IN_CREATE | IN_DELETE | IN_MOVE)) {
+        return IW_DIFF_FULL;
+    }
+
+    /* Subdirectories of recursive watches are always followed */
+    if (iw->flags & IN_RECURSIVE) {
+        return IW_DIFF_MEMBERSHIP;
+    }
+
+    if (inotify_to_kqueue (iw->flags, S_IFREG | WF_ISSUBWATCH) != 0
+        || inotify_to_kqueue (iw->flags, S_IFDIR | WF_ISSUBWATCH) != 0
+        || inotify_to_kqueue (iw->flags, S_IFLNK | WF_ISSUBWATCH) != 0) {
+        return IW_DIFF_MEMBERSHIP;
+    }
+
+    return IW_DIFF_NONE;
+}
+
+/**
+ * Add a pattern to the name filter of a directory watch.
+ *
+ * The filter is not used right away, as listings of the directory may be
+ * in flight. It is installed by the worker at the end of the current batch
+ * of kqueue events.
+ *
+ * @param[in] iw      A pointer to #i_watch.
+ * @param[in] kind    NF_EXCLUDE or NF_INCLUDE.
+ * @param[in] pattern A glob pattern or NULL to remove all the patterns.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+iwatch_add_filter (i_watch *iw, int kind, const char *pattern)
+{
+    assert (iw != NULL);
+
+    if (iw->reader == NULL) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    name_filter *nf = iw->filter_next;
+    if (pattern == NULL || nf == NULL) {
+        if (pattern == NULL || iw->filter == NULL) {
+            nf = nf_create ();
+        } else {
+            nf = nf_copy (iw->filter);
+        }
+        if (nf == NULL) {
+            perror_msg ("Failed to allocate name filter");
+            return -1;
+        }
+    }
+
+    if (pattern != NULL && nf_add (nf, kind, pattern) == -1) {
+        if (errno != EINVAL) {
+            perror_msg ("Failed to add pattern %s", pattern);
+        }
+        if (nf != iw->filter_next) {
+            nf_free (nf);
+        }
+        return -1;
+    }
+
+    if (nf != iw->filter_next) {
+        nf_free (iw->filter_next);
+        iw->filter_next = nf;
+    }
+    iw->wrk->filters_changed = 1;
+    return 0;
+}
+
+/**
+ * Set the upper limit of memory taken by directory listings of all the
+ * inotify watches of a process.
+ *
+ * Listings of the least recently changed directories are frozen (packed)
+ * when the limit is exceeded.
+ *
+ * @param[in] limit Number of bytes. 0 means no limit.
+ **/
+void
+iwatch_set_snapshot_limit (size_t limit)
+{
+    pthread_mutex_lock (&snapshots_mutex);
+    snapshots_limit = limit;
+    pthread_mutex_unlock (&snapshots_mutex);
+}
+
+/**
+ * Get the upper limit of memory taken by directory listings.
+ *
+ * @return Number of bytes. 0 means no limit.
+ **/
+size_t
+iwatch_get_snapshot_limit (void)
+{
+    size_t limit;
+
+    pthread_mutex_lock (&snapshots_mutex);
+    limit = snapshots_limit;
+    pthread_mutex_unlock (&snapshots_mutex);
+    return limit;
+}
+
+/**
+ * Account memory taken by a directory listing and mark it as the most
+ * recently changed one.
+ *
+ * Must be called after every change of the listing.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ **/
+void
+iwatch_snapshot_used (i_watch *iw)
+{
+    assert (iw != NULL);
+    assert (iw->deps != NULL);
+
+    size_t bytes = dl_footprint (iw->deps);
+
+    if (iw->deps_bytes > 0) {
+        TAILQ_REMOVE (&iw->wrk->snapshots, iw, lru);
+    }
+    TAILQ_INSERT_TAIL (&iw->wrk->snapshots, iw, lru);
+
+    pthread_mutex_lock (&snapshots_mutex);
+    snapshots_bytes += bytes - iw->deps_bytes;
+    pthread_mutex_unlock (&snapshots_mutex);
+    iw->deps_bytes = bytes;
+}
+
+/**
+ * Unpack a directory listing frozen by iwatch_evict_cold.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ * @return 0 on success, -1 if the listing stays frozen.
+ **/
+int
+iwatch_snapshot_thaw (i_watch *iw)
+{
+    assert (iw != NULL);
+    assert (iw->deps != NULL);
+
+    if (!iw->deps->frozen) {
+        return 0;
+    }
+
+    if (dl_thaw (iw->deps) == -1) {
+        perror_msg ("Failed to unpack a listing of watch %d", iw->wd);
+        return -1;
+    }
+    iwatch_snapshot_used (iw);
+    return 0;
+}
+
+/**
+ * Freeze directory listings of the least recently changed directories
+ * until memory taken by the listings fits the limit.
+ *
+ * Listings of directories with watched subfiles are left intact as they
+ * are looked up on every subfile event.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+void
+iwatch_evict_cold (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    i_watch *iw;
+    size_t used, limit;
+
+    pthread_mutex_lock (&snapshots_mutex);
+    used = snapshots_bytes;
+    limit = snapshots_limit;
+    pthread_mutex_unlock (&snapshots_mutex);
+
+    if (limit == 0 || used <= limit) {
+        return;
+    }
+
+    TAILQ_FOREACH (iw, &wrk->snapshots, lru) {
+        if (iw->deps->frozen
+            || RB_MIN (watch_set, &iw->watches)
+               != RB_MAX (watch_set, &iw->watches)) {
+            continue;
+        }
+
+        if (dl_freeze (iw->deps) == -1) {
+            break;
         }
 
-        /* And finally try to watch that list */
-        SLIST_FOREACH (iter, &dl->head, next) {
-            iwatch_add_subwatch (iw, iter->item);
+        size_t bytes = dl_footprint (iw->deps);
+        pthread_mutex_lock (&snapshots_mutex);
+        snapshots_bytes += bytes - iw->deps_bytes;
+        used = snapshots_bytes;
+        pthread_mutex_unlock (&snapshots_mutex);
+        iw->deps_bytes = bytes;
+
+        if (used <= limit) {
+            break;
+        }
+    }
+}
+
+/**
+ * Mark a directory watch to re-derive its events at the end of the batch
+ * of kqueue events, after some of them have been lost.
+ *
+ * @param[in] iw        A pointer to #i_watch.
+ * @param[in] level     Events to re-derive.
+ * @param[in] recursive Mark subdirectories of a recursive watch too.
+ **/
+void
+iwatch_resync_later (i_watch *iw, iwatch_resync_t level, int recursive)
+{
+    assert (iw != NULL);
+
+    /* Events of a file are not derived from a listing */
+    if (iw->deps == NULL) {
+        return;
+    }
+
+    if (iw->resync < level) {
+        iw->resync = level;
+    }
+    iw->wrk->resync_pending = 1;
+
+    if (recursive) {
+        i_watch *child;
+        RB_FOREACH (child, iwatch_children, &iw->children) {
+            iwatch_resync_later (child, level, recursive);
+        }
+    }
+}
+
+/**
+ * Find a directory marked with iwatch_resync_later in a watched tree.
+ *
+ * @param[in]  iw    A pointer to #i_watch created with inotify_add_watch.
+ * @param[out] count Incremented by number of the marked directories,
+ *     may be NULL.
+ * @return A pointer to the first marked #i_watch or NULL.
+ **/
+i_watch*
+iwatch_next_resync (i_watch *iw, size_t *count)
+{
+    assert (iw != NULL);
+
+    i_watch *found = NULL;
+    if (iw->resync != IW_RESYNC_NONE) {
+        found = iw;
+        if (count == NULL) {
+            return found;
+        }
+        ++*count;
+    }
+
+    i_watch *child;
+    RB_FOREACH (child, iwatch_children, &iw->children) {
+        i_watch *next = iwatch_next_resync (child, count);
+        if (found == NULL) {
+            found = next;
+        }
+        if (found != NULL && count == NULL) {
+            break;
         }
-        dl_shallow_free (dl);
     }
+    return found;
 }
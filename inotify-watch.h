@@ -27,11 +27,29 @@
 
 typedef struct i_watch i_watch;
 
+/* Amount of work required to keep a directory listing in sync */
+typedef enum {
+    IW_DIFF_NONE = 0,    /* no entry events and no subwatches are needed */
+    IW_DIFF_MEMBERSHIP,  /* only additions and removals are of interest */
+    IW_DIFF_FULL,        /* moves and overwrites must be recognized too */
+} iwatch_diff_level_t;
+
+/* Events to re-derive after some of them have been lost */
+typedef enum {
+    IW_RESYNC_NONE = 0,  /* everything has been reported */
+    IW_RESYNC_DIFF,      /* changes of the directory may be unreported */
+    IW_RESYNC_FULL,      /* entry events have been lost, report all entries */
+} iwatch_resync_t;
+
 #include "dep-list.h"
+#include "name-filter.h"
 #include "watch-set.h"
 #include "watch.h"
 #include "worker.h"
 
+/* Subdirectory watches of a recursive watch, ordered by inode numbers */
+typedef RB_HEAD(iwatch_children, i_watch) iwatch_children;
+
 struct i_watch {
     int wd;                    /* watch descriptor */
     worker *wrk;               /* pointer to a parent worker structure */
@@ -40,17 +58,66 @@ struct i_watch {
     ino_t inode;               /* inode number of watched inode */
     dev_t dev;                 /* device number of watched inode */
     dep_list *deps;            /* dependence list of inotify watch */
+    dir_reader *reader;        /* reader of directory entries for listings */
+    size_t deps_bytes;         /* memory taken by deps, 0 if not accounted */
+    int deps_stale;            /* deps are not kept up to date */
+    iwatch_resync_t resync;    /* events to re-derive at the end of batch */
+    size_t summary_threshold;  /* number of changes in a diff to summarize,
+                                * 0 if unlimited */
+    name_filter *filter;       /* names of subfiles to ignore or NULL, kept
+                                * by topmost watches for the whole tree */
+    name_filter *filter_next;  /* a filter to install at the end of batch */
+    uint32_t flags_next;       /* flags to set at the end of batch */
+    int flags_changed;         /* flags_next is set */
     watch_set watches;         /* kqueue watches of inotify watch */
     SLIST_ENTRY(i_watch) next; /* pointer to the next inotify watch in list */
+    TAILQ_ENTRY(i_watch) lru;  /* position in the worker`s list of snapshots */
+
+    /* Recursive (IN_RECURSIVE) watches only */
+    i_watch *parent;           /* a watch of the parent directory or NULL */
+    char *name;                /* a name in the parent directory */
+    size_t links;              /* number of names in the parent directory */
+    iwatch_children children;  /* watches of subdirectories */
+    RB_ENTRY(i_watch) sibling; /* links in the parent`s children tree */
+    int queued;                /* waits in the queue of the walk */
+    int walked;                /* subdirectories are watched already */
+    int announce;              /* report found entries as created on walk */
+    i_watch *detached_from;    /* the topmost watch the subdirectory has been
+                                * removed from during the batch or NULL */
+    TAILQ_ENTRY(i_watch) unwalked; /* position in the queue of the walk or
+                                    * in the list of detached watches */
 };
 
+RB_PROTOTYPE(iwatch_children, i_watch, sibling, iwatch_children_cmp);
+
 int      iwatch_open (const char *path, uint32_t flags);
 i_watch *iwatch_init (worker *wrk, int fd, uint32_t flags);
 void     iwatch_free (i_watch *iw);
 
+i_watch *iwatch_root (i_watch *iw);
+char    *iwatch_path (i_watch *iw, const char *name, size_t *len);
+void     iwatch_walk (worker *wrk);
+void    *iwatch_listing (i_watch *iw, size_t *size);
+
 void     iwatch_update_flags    (i_watch *iw, uint32_t flags);
+void     iwatch_defer_flags     (i_watch *iw, uint32_t flags);
+iwatch_diff_level_t iwatch_diff_level (i_watch *iw);
+int      iwatch_add_filter      (i_watch *iw, int kind, const char *pattern);
+
+void     iwatch_set_snapshot_limit (size_t limit);
+size_t   iwatch_get_snapshot_limit (void);
+void     iwatch_snapshot_used   (i_watch *iw);
+int      iwatch_snapshot_thaw   (i_watch *iw);
+int      iwatch_snapshot_save   (i_watch *iw, const char *dir);
+void     iwatch_evict_cold      (worker *wrk);
+
+void     iwatch_resync_later    (i_watch *iw,
+                                 iwatch_resync_t level,
+                                 int recursive);
+i_watch *iwatch_next_resync     (i_watch *iw, size_t *count);
 
 watch*   iwatch_add_subwatch    (i_watch *iw, dep_item *di);
 void     iwatch_del_subwatch    (i_watch *iw, const dep_item *di);
+void     iwatch_rename_subwatch (i_watch *iw, const dep_item *di);
 
 #endif /* __INOTIFY_WATCH_H__ */
@@ -0,0 +1,280 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include "compat.h"
+
+#include <assert.h>
+#include <errno.h>   /* errno */
+#include <fnmatch.h> /* fnmatch */
+#include <stdlib.h>  /* calloc, realloc, free */
+#include <string.h>  /* strlen, strchr, strcspn, strncmp, memcmp */
+
+#include "name-filter.h"
+
+typedef enum {
+    NF_LITERAL = 0,  /* the whole name, e.g. "node_modules" */
+    NF_PREFIX,       /* a name prefix, e.g. ".#*" */
+    NF_SUFFIX,       /* a name suffix, e.g. "*.o" */
+    NF_GLOB,         /* anything else, matched with fnmatch(3) */
+} nf_rule_type;
+
+typedef struct nf_rule {
+    nf_rule_type type;
+    size_t len;      /* length of text */
+    char *text;      /* a name, a prefix or a suffix without '*', a glob */
+} nf_rule;
+
+/**
+ * This structure represents the rules of one kind. Literals and prefixes
+ * are not tried for names which first byte does not start any of them.
+ **/
+typedef struct nf_set {
+    nf_rule *rules;
+    size_t count;
+    uint32_t first[256 / 32]; /* bitmap of first bytes of literals/prefixes */
+    int any_first;            /* there are rules matching any first byte */
+} nf_set;
+
+struct name_filter {
+    nf_set sets[2];  /* indexed with NF_EXCLUDE and NF_INCLUDE */
+};
+
+/**
+ * Create an empty name filter which keeps all the names.
+ *
+ * @return A pointer to a new #name_filter or NULL on failure.
+ **/
+name_filter*
+nf_create (void)
+{
+    return calloc (1, sizeof (name_filter));
+}
+
+/**
+ * Add a rule to a set.
+ *
+ * @param[in] set  A pointer to #nf_set.
+ * @param[in] type A type of the rule.
+ * @param[in] text A text of the rule. Copied.
+ * @param[in] len  Length of the text.
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+nf_set_add (nf_set *set, nf_rule_type type, const char *text, size_t len)
+{
+    nf_rule *rules = realloc (set->rules, (set->count + 1) * sizeof (nf_rule));
+    if (rules == NULL) {
+        return -1;
+    }
+    set->rules = rules;
+
+    nf_rule *rule = &set->rules[set->count];
+    rule->text = malloc (len + 1);
+    if (rule->text == NULL) {
+        return -1;
+    }
+    memcpy (rule->text, text, len);
+    rule->text[len] = '\0';
+    rule->type = type;
+    rule->len = len;
+    ++set->count;
+
+    if ((type == NF_LITERAL || type == NF_PREFIX) && len > 0) {
+        unsigned char c = text[0];
+        set->first[c / 32] |= 1u << (c % 32);
+    } else {
+        set->any_first = 1;
+    }
+    return 0;
+}
+
+/**
+ * Make a copy of a name filter.
+ *
+ * @param[in] nf A pointer to #name_filter.
+ * @return A pointer to a new #name_filter or NULL on failure.
+ **/
+name_filter*
+nf_copy (const name_filter *nf)
+{
+    assert (nf != NULL);
+
+    name_filter *copy = nf_create ();
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    int kind;
+    size_t i;
+    for (kind = NF_EXCLUDE; kind <= NF_INCLUDE; kind++) {
+        const nf_set *set = &nf->sets[kind];
+        for (i = 0; i < set->count; i++) {
+            const nf_rule *rule = &set->rules[i];
+            if (nf_set_add (&copy->sets[kind],
+                            rule->type,
+                            rule->text,
+                            rule->len) == -1) {
+                nf_free (copy);
+                return NULL;
+            }
+        }
+    }
+    return copy;
+}
+
+/**
+ * Add a glob pattern to a name filter.
+ *
+ * Patterns consisting of a name with a single leading or trailing '*'
+ * are matched without fnmatch(3).
+ *
+ * @param[in] nf      A pointer to #name_filter.
+ * @param[in] kind    NF_EXCLUDE or NF_INCLUDE.
+ * @param[in] pattern A glob pattern. Must not be empty or contain '/'.
+ * @return 0 on success, -1 on failure. errno is set to EINVAL if the
+ *     pattern is not valid.
+ **/
+int
+nf_add (name_filter *nf, int kind, const char *pattern)
+{
+    assert (nf != NULL);
+    assert (pattern != NULL);
+
+    if ((kind != NF_EXCLUDE && kind != NF_INCLUDE)
+        || pattern[0] == '\0'
+        || strchr (pattern, '/') != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t len = strlen (pattern);
+    size_t nmeta = strcspn (pattern + 1, "*?[\\") + 1;
+    nf_set *set = &nf->sets[kind];
+
+    if (strcspn (pattern, "*?[\\") == len) {
+        return nf_set_add (set, NF_LITERAL, pattern, len);
+    }
+    if (pattern[len - 1] == '*' && strcspn (pattern, "*?[\\") == len - 1) {
+        return nf_set_add (set, NF_PREFIX, pattern, len - 1);
+    }
+    if (pattern[0] == '*' && nmeta == len) {
+        return nf_set_add (set, NF_SUFFIX, pattern + 1, len - 1);
+    }
+    return nf_set_add (set, NF_GLOB, pattern, len);
+}
+
+/**
+ * Check if a name matches any rule of a set.
+ *
+ * @param[in]     set  A pointer to #nf_set.
+ * @param[in]     name A name to match.
+ * @param[in,out] len  Length of the name, computed on demand if SIZE_MAX.
+ * @return 1 if the name matches, 0 otherwise.
+ **/
+static int
+nf_set_match (const nf_set *set, const char *name, size_t *len)
+{
+    unsigned char c = name[0];
+    if (!set->any_first && !(set->first[c / 32] & (1u << (c % 32)))) {
+        return 0;
+    }
+
+    size_t i;
+    for (i = 0; i < set->count; i++) {
+        const nf_rule *rule = &set->rules[i];
+
+        if (rule->type == NF_PREFIX) {
+            if (strncmp (name, rule->text, rule->len) == 0) {
+                return 1;
+            }
+            continue;
+        }
+        if (rule->type == NF_GLOB) {
+            if (fnmatch (rule->text, name, 0) == 0) {
+                return 1;
+            }
+            continue;
+        }
+
+        if (*len == SIZE_MAX) {
+            *len = strlen (name);
+        }
+        if (rule->type == NF_LITERAL) {
+            if (*len == rule->len && memcmp (name, rule->text, *len) == 0) {
+                return 1;
+            }
+        } else if (*len >= rule->len
+                   && memcmp (name + *len - rule->len,
+                              rule->text,
+                              rule->len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check if a name is filtered out.
+ *
+ * @param[in] nf   A pointer to #name_filter. NULL keeps all the names.
+ * @param[in] name A directory entry name.
+ * @return 1 if the name should be skipped, 0 otherwise.
+ **/
+int
+nf_skips (const name_filter *nf, const char *name)
+{
+    assert (name != NULL);
+
+    if (nf == NULL) {
+        return 0;
+    }
+
+    size_t len = SIZE_MAX;
+    if (nf_set_match (&nf->sets[NF_EXCLUDE], name, &len)) {
+        return 1;
+    }
+    return nf->sets[NF_INCLUDE].count > 0
+        && !nf_set_match (&nf->sets[NF_INCLUDE], name, &len);
+}
+
+/**
+ * Free a name filter.
+ *
+ * @param[in] nf A pointer to #name_filter.
+ **/
+void
+nf_free (name_filter *nf)
+{
+    if (nf == NULL) {
+        return;
+    }
+
+    int kind;
+    size_t i;
+    for (kind = NF_EXCLUDE; kind <= NF_INCLUDE; kind++) {
+        for (i = 0; i < nf->sets[kind].count; i++) {
+            free (nf->sets[kind].rules[i].text);
+        }
+        free (nf->sets[kind].rules);
+    }
+    free (nf);
+}
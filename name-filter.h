@@ -0,0 +1,45 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __NAME_FILTER_H__
+#define __NAME_FILTER_H__
+
+#include "compat.h"
+
+#include <sys/types.h> /* size_t */
+
+/* Kinds of name filter rules */
+#define NF_EXCLUDE 0  /* names matching the pattern are filtered out */
+#define NF_INCLUDE 1  /* only names matching some of the patterns are kept */
+
+/* A set of glob patterns matched against directory entry names.
+ * A name is filtered out if it matches an exclude pattern, or if there
+ * are include patterns and it matches none of them. */
+typedef struct name_filter name_filter;
+
+name_filter* nf_create (void);
+name_filter* nf_copy   (const name_filter *nf);
+int          nf_add    (name_filter *nf, int kind, const char *pattern);
+int          nf_skips  (const name_filter *nf, const char *name);
+void         nf_free   (name_filter *nf);
+
+#endif /* __NAME_FILTER_H__ */
@@ -0,0 +1,190 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include "compat.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>  /* calloc, realloc, free */
+#include <unistd.h>  /* close */
+
+#include "utils.h"
+#include "shared-fd.h"
+
+struct shared_fd {
+    dev_t dev;                /* device number of the file */
+    ino_t inode;              /* inode number of the file */
+    int fd;                   /* the shared file descriptor */
+    size_t nowners;           /* number of workers using the descriptor */
+    const void **owners;      /* workers using the descriptor */
+    RB_ENTRY(shared_fd) link; /* RB tree links */
+};
+
+/**
+ * Compare two shared descriptors by device and inode numbers.
+ **/
+static int
+sfd_cmp (shared_fd *sf1, shared_fd *sf2)
+{
+    if (sf1->dev != sf2->dev) {
+        return (sf1->dev > sf2->dev) - (sf1->dev < sf2->dev);
+    }
+    return (sf1->inode > sf2->inode) - (sf1->inode < sf2->inode);
+}
+
+static RB_HEAD(sfd_tree, shared_fd) sfd_root = RB_INITIALIZER (&sfd_root);
+static pthread_mutex_t sfd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+RB_GENERATE(sfd_tree, shared_fd, link, sfd_cmp);
+
+/**
+ * Find a descriptor of a file opened by another worker and start using it.
+ *
+ * @param[in]  st    A stat structure of the file.
+ * @param[in]  owner A worker which is going to use the descriptor.
+ * @param[out] fd    The shared file descriptor.
+ * @return A pointer to the shared descriptor or NULL if the file is not
+ *     opened by other workers or the worker already uses the descriptor.
+ **/
+shared_fd*
+sfd_find (const struct stat *st, const void *owner, int *fd)
+{
+    assert (st != NULL);
+    assert (owner != NULL);
+    assert (fd != NULL);
+
+    shared_fd find = { .dev = st->st_dev, .inode = st->st_ino };
+    size_t i;
+
+    pthread_mutex_lock (&sfd_mutex);
+
+    shared_fd *sf = RB_FIND (sfd_tree, &sfd_root, &find);
+    if (sf != NULL) {
+        for (i = 0; i < sf->nowners; i++) {
+            if (sf->owners[i] == owner) {
+                sf = NULL;
+                goto out;
+            }
+        }
+
+        void *ptr = realloc (sf->owners, (sf->nowners + 1) * sizeof (void *));
+        if (ptr == NULL) {
+            perror_msg ("Failed to share descriptor %d", sf->fd);
+            sf = NULL;
+            goto out;
+        }
+        sf->owners = ptr;
+        sf->owners[sf->nowners++] = owner;
+        *fd = sf->fd;
+    }
+
+out:
+    pthread_mutex_unlock (&sfd_mutex);
+    return sf;
+}
+
+/**
+ * Offer a descriptor of a file to other workers.
+ *
+ * @param[in] st    A stat structure of the file.
+ * @param[in] fd    A file descriptor. Is closed on the last sfd_release
+ *     call if the function succeeds.
+ * @param[in] owner A worker which uses the descriptor.
+ * @return A pointer to the shared descriptor or NULL if the file is
+ *     already shared with another descriptor or on failure.
+ **/
+shared_fd*
+sfd_insert (const struct stat *st, int fd, const void *owner)
+{
+    assert (st != NULL);
+    assert (fd != -1);
+    assert (owner != NULL);
+
+    shared_fd *sf = calloc (1, sizeof (shared_fd));
+    if (sf == NULL) {
+        perror_msg ("Failed to allocate shared descriptor");
+        return NULL;
+    }
+
+    sf->owners = malloc (sizeof (void *));
+    if (sf->owners == NULL) {
+        perror_msg ("Failed to allocate shared descriptor");
+        free (sf);
+        return NULL;
+    }
+
+    sf->dev = st->st_dev;
+    sf->inode = st->st_ino;
+    sf->fd = fd;
+    sf->owners[0] = owner;
+    sf->nowners = 1;
+
+    pthread_mutex_lock (&sfd_mutex);
+    shared_fd *exists = RB_INSERT (sfd_tree, &sfd_root, sf);
+    pthread_mutex_unlock (&sfd_mutex);
+
+    if (exists != NULL) {
+        free (sf->owners);
+        free (sf);
+        return NULL;
+    }
+    return sf;
+}
+
+/**
+ * Stop using a shared descriptor. The descriptor is closed when the last
+ * worker stops using it.
+ *
+ * @param[in] sf    A pointer to the shared descriptor.
+ * @param[in] owner A worker which used the descriptor.
+ **/
+void
+sfd_release (shared_fd *sf, const void *owner)
+{
+    assert (sf != NULL);
+    assert (owner != NULL);
+
+    size_t i;
+
+    pthread_mutex_lock (&sfd_mutex);
+
+    for (i = 0; i < sf->nowners; i++) {
+        if (sf->owners[i] == owner) {
+            sf->owners[i] = sf->owners[--sf->nowners];
+            break;
+        }
+    }
+
+    if (sf->nowners == 0) {
+        RB_REMOVE (sfd_tree, &sfd_root, sf);
+    } else {
+        sf = NULL;
+    }
+
+    pthread_mutex_unlock (&sfd_mutex);
+
+    if (sf != NULL) {
+        close (sf->fd);
+        free (sf->owners);
+        free (sf);
+    }
+}
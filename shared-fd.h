@@ -0,0 +1,40 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __SHARED_FD_H__
+#define __SHARED_FD_H__
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>  /* stat */
+
+/* A file descriptor of a watched file shared by all the workers of
+ * a process. Every worker registers its own kevent for the descriptor,
+ * so one worker may use a shared descriptor only once. */
+typedef struct shared_fd shared_fd;
+
+shared_fd* sfd_find    (const struct stat *st, const void *owner, int *fd);
+shared_fd* sfd_insert  (const struct stat *st, int fd, const void *owner);
+void       sfd_release (shared_fd *sf, const void *owner);
+
+#endif /* __SHARED_FD_H__ */
@@ -1,6 +1,7 @@
 #ifndef __BSD_INOTIFY_H__
 #define __BSD_INOTIFY_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef __THROW
@@ -93,4 +94,136 @@ INO_EXPORT int inotify_add_watch (int fd, const char *name, uint32_t mask) __THR
 INO_EXPORT int inotify_rm_watch (int fd, int wd) __THROW;
 
 
+/*
+ * libinotify-kqueue specific parameters. Not available in Linux.
+ */
+
+/* Watch the whole directory tree with a single watch descriptor. Events
+   of nested entries carry names relative to the watched directory. Can
+   only be set when the watch is created. */
+#define IN_RECURSIVE	 0x08000000
+
+/* Flag for the parameter of inotify_init1. The instance produces struct
+   inotify_event_ext records instead of struct inotify_event. */
+#define IN_EXTENDED	 0x10000000
+
+/* Extended event record. NAME is padded with NULs to a multiple of 8. */
+struct inotify_event_ext
+{
+    int wd;            /* Watch descriptor.  */
+    uint32_t mask;     /* Watch mask.  */
+    uint32_t cookie;   /* Cookie to synchronize two events.  */
+    uint32_t len;      /* Length (including NULLs) of name.  */
+    uint64_t seq;      /* Number of the event in the instance, from 1.  */
+    uint64_t received; /* Monotonic time the change was noticed, in ns.  */
+    uint64_t sent;     /* Monotonic time the event was sent, in ns.  */
+    uint64_t ino;      /* Inode number of the file.  */
+    uint64_t dev;      /* Device number of the file.  */
+    int64_t size;      /* Size of a file after IN_MODIFY or -1.  */
+    int64_t old_size;  /* Size of the file before IN_MODIFY or -1.  */
+    char name[];       /* Name.  */
+};
+
+/* Send the new and the previous sizes of regular files with IN_MODIFY
+   (in the SIZE and OLD_SIZE fields of struct inotify_event_ext). Only
+   available for IN_EXTENDED instances. */
+#define IN_TRACK_SIZE	 0x00400000
+
+/* Upper limit of memory taken by directory listings of all the instances
+   in bytes. Listings of the least recently changed directories are packed
+   when exceeded. 0 (default) means no limit. FD must be -1. */
+#define IN_SNAPSHOT_MEMLIMIT	0
+
+/* Read-only counters of directory diffs made by the instance FD: diffs
+   recognizing moves (IN_CREATE, IN_DELETE or IN_MOVE watched), diffs
+   following additions and removals only (just subfile events watched),
+   and directory changes ignored (no entry events watched at all). */
+#define IN_STAT_DIFFS_FULL		1
+#define IN_STAT_DIFFS_MEMBERSHIP	2
+#define IN_STAT_DIFFS_SKIPPED		3
+
+/* Per-watch parameter: a directory diff finding more added and removed
+   entries than VALUE is reported with IN_SUMMARY records instead of the
+   individual events. 0 (default) means no limit. */
+#define IN_SUMMARY_THRESHOLD		4
+
+/* Events of the instance FD may be held back for up to VALUE milliseconds
+   to be read in fewer, larger batches: fewer wakeups of the reader at the
+   cost of latency. 0 (default) sends the events as soon as they are
+   produced. */
+#define IN_BATCH_DELAY		5
+
+/* Events held back (see IN_BATCH_DELAY) are sent at once as soon as they
+   take VALUE bytes. 0 (default) means no limit. */
+#define IN_BATCH_BYTES		6
+
+/* Event reported instead of the entry events of a large directory diff
+   (see IN_SUMMARY_THRESHOLD), one record per kind of events: IN_CREATE,
+   IN_DELETE, IN_MOVED_FROM or IN_MOVED_TO is set along with IN_SUMMARY,
+   and COOKIE holds the number of such events. IN_Q_OVERFLOW is set too,
+   as the directory has to be rescanned. */
+#define IN_SUMMARY	 0x00800000
+
+/* Kinds of name filter patterns. Subfiles of a watched directory which
+   names match an exclude pattern, or do not match any of include patterns
+   if there are some, are neither watched nor reported. */
+#define IN_FILTER_EXCLUDE	0
+#define IN_FILTER_INCLUDE	1
+
+/* Add the fnmatch(3) PATTERN of kind KIND to the directory watch WD of the
+   inotify-kqueue instance FD. A NULL PATTERN removes all the patterns. */
+INO_EXPORT int libinotify_filter_watch (int fd, int wd, int kind,
+					const char *pattern) __THROW;
+
+/* Save listings of the directories watched by the inotify-kqueue instance
+   FD to the directory DIR, diff directories watched later against their
+   listings found in DIR reporting the changes, and save the listings again
+   when FD is closed. A NULL DIR stops using the snapshots. */
+INO_EXPORT int libinotify_checkpoint (int fd, const char *dir) __THROW;
+
+/* Marker event queued by libinotify_get_listing. Events of WD read before
+   the marker are reflected in the listing, events read after it are changes
+   made to the listing. */
+#define IN_LISTED	 0x00100000
+
+/* Marker event queued before the events of a directory are re-derived
+   after some of them have been lost. The events up to the next IN_LISTED
+   of the same directory bring it up to date. If IN_Q_OVERFLOW is set too,
+   the entries of the directory known so far must be forgotten, as all of
+   them are reported with IN_CREATE. */
+#define IN_RESYNC	 0x00200000
+
+/* An entry of a directory listing. Entries are packed one after another,
+   LEN bytes of the NUL-padded name follow each of them. */
+struct inotify_dirent
+{
+    uint64_t ino;    /* Inode number.  */
+    uint32_t type;   /* S_IFMT bits, 0 if not known.  */
+    uint32_t len;    /* Length (including NULLs) of name.  */
+    char name[];     /* Name relative to the watched directory.  */
+};
+
+/* Store a listing of the directory watch WD of the inotify-kqueue instance
+   FD in a newly allocated buffer ENTRIES of SIZE bytes and queue IN_LISTED
+   to WD. The buffer must be released with free(3). */
+INO_EXPORT int libinotify_get_listing (int fd, int wd, void **entries,
+				       size_t *size) __THROW;
+
+/* Report all the entries of the directory watch WD of the inotify-kqueue
+   instance FD once more, bracketed with IN_RESYNC and IN_LISTED. */
+INO_EXPORT int libinotify_resync (int fd, int wd) __THROW;
+
+/* Set parameter PARAM of the inotify-kqueue instance FD to VALUE. */
+INO_EXPORT int libinotify_set_param (int fd, int param, intptr_t value) __THROW;
+
+/* Set parameter PARAM of the watch WD of the inotify-kqueue instance FD
+   to VALUE. */
+INO_EXPORT int libinotify_set_watch_param (int fd, int wd, int param,
+					   intptr_t value) __THROW;
+
+/* Store the value of parameter PARAM of the inotify-kqueue instance FD
+   in VALUE. */
+INO_EXPORT int libinotify_get_param (int fd, int param, intptr_t *value) __THROW;
+
+
 #endif /* __BSD_INOTIFY_H__ */
@@ -0,0 +1,110 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "dep_list_test.hh"
+#include "deplist.h"
+
+dep_list_test::dep_list_test (journal &j)
+: test ("Directory listing snapshots", j)
+{
+}
+
+void dep_list_test::setup ()
+{
+    cleanup ();
+
+    system ("mkdir dlt-working");
+    system ("touch dlt-working/foo dlt-working/bar");
+    system ("mkdir dlt-working/baz");
+}
+
+void dep_list_test::run ()
+{
+    int dirfd = open ("dlt-working", O_RDONLY);
+    dep_list *dl = dl_listing (dirfd, NULL);
+    close (dirfd);
+    should ("directory is listed", dl != NULL && dl_count (dl) == 3);
+    if (dl == NULL) {
+        return;
+    }
+
+    int fd = open ("dlt-snapshot", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    should ("listing is saved", dl_save (dl, fd) == 0);
+    close (fd);
+
+    fd = open ("dlt-snapshot", O_RDONLY);
+    dep_list *loaded = dl_load (fd);
+    close (fd);
+    should ("listing is loaded back", loaded != NULL);
+
+    bool same = loaded != NULL && dl_count (loaded) == dl_count (dl);
+    for (size_t i = 0; same && i < dl_count (dl); i++) {
+        dep_item *di = dl_get (dl, i);
+        size_t n, k = dl_find (loaded, di->inode, &n);
+        same = n == 1
+            && strcmp (dl_get (loaded, k)->path, di->path) == 0
+            && (dl_get (loaded, k)->type & S_IFMT) == (di->type & S_IFMT);
+    }
+    should ("loaded listing has the same names, inodes and types", same);
+
+    truncate ("dlt-snapshot", 12);
+    fd = open ("dlt-snapshot", O_RDONLY);
+    dep_list *broken = dl_load (fd);
+    close (fd);
+    should ("truncated snapshot is rejected",
+            broken == NULL && errno == EINVAL);
+
+    fd = open ("dlt-working/foo", O_RDONLY);
+    broken = dl_load (fd);
+    close (fd);
+    should ("empty file is rejected", broken == NULL && errno == EINVAL);
+
+    system ("rm dlt-working/foo");
+    system ("touch dlt-working/qux");
+    system ("mv dlt-working/bar dlt-working/bar2");
+    dirfd = open ("dlt-working", O_RDONLY);
+    dep_diff *dd = dl_diff_open (dirfd, NULL, dl);
+    should ("added and removed entries are counted before the diff is closed",
+            dd != NULL
+            && dl_diff_read (dd, SIZE_MAX) == 0
+            && dl_diff_changes (dd) == 4);
+    if (dd != NULL) {
+        dl_diff_abort (dd);
+    }
+    close (dirfd);
+
+    if (loaded != NULL) {
+        dl_free (loaded);
+    }
+    dl_free (dl);
+}
+
+void dep_list_test::cleanup ()
+{
+    system ("rm -rf dlt-working dlt-snapshot");
+}
@@ -0,0 +1,122 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <unistd.h>
+#include <set>
+#include <string>
+#include "dep_tree_test.hh"
+#include "deplist.h"
+
+typedef std::set<std::string> changes;
+
+static void
+tree_added (void *udata, dep_item *di)
+{
+    ((changes *) udata)->insert (std::string ("+") + di->path);
+}
+
+static void
+tree_removed (void *udata, dep_item *di)
+{
+    ((changes *) udata)->insert (std::string ("-") + di->path);
+}
+
+static void
+tree_moved (void *udata, dep_item *from_di, dep_item *to_di)
+{
+    ((changes *) udata)->insert (std::string (from_di->path) + ">" + to_di->path);
+}
+
+dep_tree_test::dep_tree_test (journal &j)
+: test ("Directory tree snapshots", j)
+{
+}
+
+void dep_tree_test::setup ()
+{
+    cleanup ();
+
+    system ("mkdir -p dtt-working/a/b dtt-working/c");
+    system ("touch dtt-working/a/1 dtt-working/a/b/2 dtt-working/c/3");
+}
+
+void dep_tree_test::run ()
+{
+    traverse_cbs cbs = {
+        tree_added,
+        tree_removed,
+        NULL, /* replaced */
+        NULL, /* overwritten */
+        tree_moved,
+        NULL, /* many_added */
+        NULL, /* many_removed */
+        NULL, /* names_updated */
+    };
+    changes received;
+    size_t ndirs = 0, nlisted = 0;
+
+    /* Let the stamps of the directories get older than the listing */
+    sleep (2);
+
+    dep_tree *dt = dt_snapshot ("dtt-working");
+    should ("tree snapshot is taken successfully", dt != NULL);
+    if (dt == NULL) {
+        return;
+    }
+
+    dt_stats (dt, &ndirs, &nlisted);
+    should ("snapshot lists every directory of a tree",
+            ndirs == 4 && nlisted == 4);
+
+    dt_diff (dt, &cbs, &received);
+    dt_stats (dt, &ndirs, &nlisted);
+    should ("no changes are found in an untouched tree", received.empty ());
+    should ("unchanged directories are not read again", nlisted == 0);
+
+    system ("touch dtt-working/a/b/new");
+    system ("mkdir -p dtt-working/d/e && touch dtt-working/d/e/4");
+    system ("mv dtt-working/a/b dtt-working/a/bb");
+    system ("rm -rf dtt-working/c");
+
+    received.clear ();
+    dt_diff (dt, &cbs, &received);
+    should ("file created deep in a tree is reported with a relative path",
+            received.count ("+a/bb/new") == 1);
+    should ("contents of a new subtree are reported",
+            received.count ("+d") && received.count ("+d/e")
+            && received.count ("+d/e/4"));
+    should ("contents of a removed subtree are reported",
+            received.count ("-c") && received.count ("-c/3"));
+    should ("renamed directory is reported once without its contents",
+            received.count ("a/b>a/bb") && !received.count ("+a/bb/2"));
+    should ("nothing else is reported", received.size () == 7);
+
+    dt_stats (dt, &ndirs, &nlisted);
+    should ("snapshot follows the changes", ndirs == 5);
+
+    dt_free (dt);
+}
+
+void dep_tree_test::cleanup ()
+{
+    system ("rm -rf dtt-working");
+}
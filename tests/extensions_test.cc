@@ -0,0 +1,633 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>  /* open */
+#include <poll.h>
+#include <stdio.h> /* FILENAME_MAX */
+#include <stdlib.h> /* free */
+#include <sys/stat.h>
+#include <unistd.h> /* close, read */
+#include "extensions_test.hh"
+
+#define IE_EXT_BUFSIZE \
+    ((sizeof (struct inotify_event_ext) + FILENAME_MAX) * 20)
+
+/* Number of files created at once to be reported with IN_SUMMARY */
+#define SUMMARY_FILES 200
+
+/* Read the events of the changes made so far to BUF */
+static ssize_t
+read_events (int fd, char *buf, size_t size)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    /* Let all the events of the changes be queued */
+    sleep (1);
+    if (poll (&pfd, 1, 2000) <= 0) {
+        return -1;
+    }
+    return read (fd, buf, size);
+}
+
+/* Checks of the parameters and flags libinotify-kqueue adds to inotify */
+extensions_test::extensions_test (journal &j)
+: test ("libinotify-kqueue extensions", j)
+{
+}
+
+void extensions_test::setup ()
+{
+    cleanup ();
+
+    system ("mkdir -p exts-tree/a/b");
+    system ("mkdir exts-tree/c");
+    system ("touch exts-tree/a/b/old");
+
+    system ("mkdir exts-filter");
+
+    system ("mkdir exts-snapshots");
+    system ("mkdir exts-saved");
+    system ("touch exts-saved/old");
+
+    system ("mkdir exts-listed");
+    system ("touch exts-listed/one");
+    system ("touch exts-listed/two");
+
+    system ("mkdir exts-resync");
+    system ("touch exts-resync/a");
+    system ("touch exts-resync/b");
+
+    system ("mkdir exts-extended");
+
+    system ("mkdir exts-sizes");
+    system ("touch exts-sizes/log");
+
+    system ("mkdir exts-from");
+    system ("mkdir exts-to");
+    system ("touch exts-from/f");
+
+    system ("mkdir exts-summary");
+
+    system ("mkdir exts-batch");
+}
+
+void extensions_test::run ()
+{
+    recursive ();
+    filters ();
+    checkpoint ();
+    listing ();
+    resync ();
+    extended ();
+    track_size ();
+    extended_moves ();
+    summary ();
+    batching ();
+}
+
+void extensions_test::recursive ()
+{
+    consumer cons;
+    events received;
+    events::iterator iter_from, iter_to;
+
+    cons.input.setup ("exts-tree",
+                      IN_CREATE | IN_DELETE
+                      | IN_MOVED_FROM | IN_MOVED_TO | IN_RECURSIVE);
+    cons.output.wait ();
+
+    int wid = cons.output.added_watch_id ();
+    should ("recursive watch is added successfully", wid != -1);
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch exts-tree/a/b/new");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a file created in a nested directory",
+            contains (received, event ("a/b/new", wid, IN_CREATE)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("mv exts-tree/a/b exts-tree/c/b");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+
+    iter_from = std::find_if (received.begin (), received.end (),
+                              event_matcher (event ("a/b", wid,
+                                                    IN_MOVED_FROM)));
+    iter_to = std::find_if (received.begin (), received.end (),
+                            event_matcher (event ("c/b", wid, IN_MOVED_TO)));
+
+    if (should ("receive IN_MOVED_FROM and IN_MOVED_TO for a directory moved "
+                "between subdirectories",
+                iter_from != received.end () && iter_to != received.end())) {
+        should ("both events for a move between subdirectories have "
+                "the same cookie",
+                iter_from->cookie == iter_to->cookie);
+    }
+    should ("do not receive IN_CREATE for entries of a directory moved "
+            "within the tree",
+            !contains (received, event ("c/b/new", wid, IN_CREATE)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch exts-tree/c/b/newer");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a file created in a moved directory "
+            "under its new name",
+            contains (received, event ("c/b/newer", wid, IN_CREATE)));
+
+
+    should ("name filter is added to a recursive watch",
+            libinotify_filter_watch (cons.get_fd (), wid,
+                                     IN_FILTER_EXCLUDE, "*.tmp") == 0);
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch exts-tree/a/x.tmp exts-tree/c/b/x.tmp exts-tree/a/x");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("do not receive IN_CREATE for excluded names in subdirectories",
+            !contains (received, event ("a/x.tmp", wid, IN_CREATE))
+            && !contains (received, event ("c/b/x.tmp", wid, IN_CREATE)));
+    should ("receive IN_CREATE for other names in subdirectories",
+            contains (received, event ("a/x", wid, IN_CREATE)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("rm -rf exts-tree/c");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_DELETE for a removed subtree",
+            contains (received, event ("c", wid, IN_DELETE)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("mkdir exts-tree/c && touch exts-tree/c/x");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a directory created in place of "
+            "a removed subtree",
+            contains (received, event ("c", wid, IN_CREATE)));
+    should ("receive IN_CREATE for a file in a directory created in place "
+            "of a removed subtree",
+            contains (received, event ("c/x", wid, IN_CREATE)));
+
+    cons.input.interrupt ();
+}
+
+void extensions_test::filters ()
+{
+    consumer cons;
+    events received;
+
+    cons.input.setup ("exts-filter", IN_CREATE | IN_DELETE);
+    cons.output.wait ();
+    int wid = cons.output.added_watch_id ();
+
+    should ("exclude pattern is added to a directory watch",
+            libinotify_filter_watch (cons.get_fd (), wid,
+                                     IN_FILTER_EXCLUDE, "*.o") == 0);
+
+    errno = 0;
+    should ("fail with EINVAL on adding a pattern of an unknown kind",
+            libinotify_filter_watch (cons.get_fd (), wid, 2, "*.c") == -1
+            && errno == EINVAL);
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch exts-filter/x.c exts-filter/x.o");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a name not matching exclude patterns",
+            contains (received, event ("x.c", wid, IN_CREATE)));
+    should ("do not receive IN_CREATE for a name matching an exclude pattern",
+            !contains (received, event ("x.o", wid, IN_CREATE)));
+
+
+    should ("patterns are removed from a directory watch",
+            libinotify_filter_watch (cons.get_fd (), wid,
+                                     IN_FILTER_EXCLUDE, NULL) == 0);
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch exts-filter/y.o");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a name excluded before patterns "
+            "are removed",
+            contains (received, event ("y.o", wid, IN_CREATE)));
+
+    cons.input.interrupt ();
+}
+
+void extensions_test::checkpoint ()
+{
+    consumer cons;
+    events received;
+
+    int fd = inotify_init ();
+    int wd = inotify_add_watch (fd, "exts-saved", IN_CREATE | IN_DELETE);
+    should ("listings of watched directories are saved to a snapshot "
+            "directory",
+            wd != -1 && libinotify_checkpoint (fd, "exts-snapshots") == 0);
+    /* Do not save the listing once more when the instance is closed */
+    should ("snapshots are not used after a checkpoint with NULL",
+            libinotify_checkpoint (fd, NULL) == 0);
+    close (fd);
+
+    system ("touch exts-saved/new");
+    system ("rm exts-saved/old");
+
+    should ("snapshot directory is set before watches are added",
+            libinotify_checkpoint (cons.get_fd (), "exts-snapshots") == 0);
+
+    cons.input.setup ("exts-saved", IN_CREATE | IN_DELETE);
+    cons.output.wait ();
+    int wid = cons.output.added_watch_id ();
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a file created since the checkpoint",
+            contains (received, event ("new", wid, IN_CREATE)));
+    should ("receive IN_DELETE for a file removed since the checkpoint",
+            contains (received, event ("old", wid, IN_DELETE)));
+
+    cons.input.interrupt ();
+}
+
+void extensions_test::listing ()
+{
+    consumer cons;
+    events received;
+    void *entries = NULL;
+    size_t size = 0;
+
+    cons.input.setup ("exts-listed", IN_CREATE | IN_DELETE);
+    cons.output.wait ();
+    int wid = cons.output.added_watch_id ();
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    int retval = libinotify_get_listing (cons.get_fd (), wid, &entries, &size);
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+
+    bool has_one = false, has_two = false;
+    size_t offset = 0;
+    while (retval == 0 && offset < size) {
+        struct inotify_dirent *ent
+            = (struct inotify_dirent *) ((char *) entries + offset);
+        has_one = has_one || std::string (ent->name) == "one";
+        has_two = has_two || std::string (ent->name) == "two";
+        offset += sizeof (struct inotify_dirent) + ent->len;
+    }
+    free (entries);
+
+    should ("directory listing is obtained", retval == 0);
+    should ("directory listing contains all the entries",
+            has_one && has_two);
+    should ("receive IN_LISTED after a directory listing is obtained",
+            contains (received, event ("", wid, IN_LISTED)));
+
+    cons.input.interrupt ();
+}
+
+void extensions_test::resync ()
+{
+    consumer cons;
+    events received;
+
+    cons.input.setup ("exts-resync", IN_CREATE | IN_DELETE);
+    cons.output.wait ();
+    int wid = cons.output.added_watch_id ();
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    int retval = libinotify_resync (cons.get_fd (), wid);
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("resync of a directory watch is requested", retval == 0);
+    should ("receive IN_RESYNC on resync of a directory",
+            contains (received, event ("", wid, IN_RESYNC)));
+    should ("receive IN_CREATE for all the entries on resync of a directory",
+            contains (received, event ("a", wid, IN_CREATE))
+            && contains (received, event ("b", wid, IN_CREATE)));
+    should ("receive IN_LISTED at the end of resync of a directory",
+            contains (received, event ("", wid, IN_LISTED)));
+
+
+    cons.input.setup ("exts-resync/a", IN_ATTRIB);
+    cons.output.wait ();
+    int file_wid = cons.output.added_watch_id ();
+
+    errno = 0;
+    should ("fail with ENOTDIR on resync of a file watch",
+            libinotify_resync (cons.get_fd (), file_wid) == -1
+            && errno == ENOTDIR);
+
+    cons.input.interrupt ();
+}
+
+void extensions_test::extended ()
+{
+    char buf[IE_EXT_BUFSIZE];
+    struct stat st;
+
+    int fd = inotify_init1 (IN_EXTENDED);
+    int wd = inotify_add_watch (fd, "exts-extended", IN_CREATE);
+    should ("watch is added to an instance with extended records",
+            fd != -1 && wd != -1);
+
+    system ("touch exts-extended/x exts-extended/y");
+
+    ssize_t len = read_events (fd, buf, sizeof (buf));
+
+    bool seq_ok = true, times_ok = true, ino_ok = false;
+    int created = 0;
+    uint64_t seq = 0;
+    ssize_t i = 0;
+    while (i < len) {
+        struct inotify_event_ext *ie = (struct inotify_event_ext *) &buf[i];
+        seq_ok = seq_ok && ie->seq == seq + 1;
+        seq = ie->seq;
+        times_ok = times_ok && ie->received != 0 && ie->received <= ie->sent;
+        if (ie->wd == wd && ie->mask & IN_CREATE) {
+            ++created;
+            if (std::string (ie->name) == "x"
+                && stat ("exts-extended/x", &st) == 0) {
+                ino_ok = ie->ino == (uint64_t) st.st_ino;
+            }
+        }
+        i += sizeof (struct inotify_event_ext) + ie->len;
+    }
+    close (fd);
+
+    should ("receive extended records for all the changes", created == 2);
+    should ("extended records are numbered one by one from 1",
+            created > 0 && seq_ok);
+    should ("extended records are sent after the changes are noticed",
+            created > 0 && times_ok);
+    should ("extended records carry inode numbers of the files", ino_ok);
+}
+
+void extensions_test::track_size ()
+{
+    char buf[IE_EXT_BUFSIZE];
+
+    int fd = inotify_init1 (IN_EXTENDED);
+    int wd = inotify_add_watch (fd, "exts-sizes", IN_MODIFY | IN_TRACK_SIZE);
+    should ("watch with IN_TRACK_SIZE is added to an instance with "
+            "extended records",
+            fd != -1 && wd != -1);
+
+    system ("echo Hello >> exts-sizes/log");
+
+    ssize_t len = read_events (fd, buf, sizeof (buf));
+
+    struct inotify_event_ext *modified = NULL;
+    ssize_t i = 0;
+    while (i < len) {
+        struct inotify_event_ext *ie = (struct inotify_event_ext *) &buf[i];
+        if (ie->wd == wd && ie->mask & IN_MODIFY
+            && std::string (ie->name) == "log") {
+            modified = ie;
+        }
+        i += sizeof (struct inotify_event_ext) + ie->len;
+    }
+    close (fd);
+
+    should ("receive IN_MODIFY with the new size of a file",
+            modified != NULL && modified->size == 6);
+    should ("receive IN_MODIFY with the previous size of a file",
+            modified != NULL && modified->old_size == 0);
+
+
+    consumer cons;
+    cons.input.setup ("exts-sizes", IN_MODIFY | IN_TRACK_SIZE);
+    cons.output.wait ();
+    should ("fail with EINVAL on adding a watch with IN_TRACK_SIZE to "
+            "an instance without extended records",
+            cons.output.added_watch_id () == -1
+            && cons.output.added_watch_error () == EINVAL);
+
+    cons.input.interrupt ();
+}
+
+void extensions_test::extended_moves ()
+{
+    char buf[IE_EXT_BUFSIZE];
+
+    int fd = inotify_init1 (IN_EXTENDED);
+    int wd_from = inotify_add_watch (fd, "exts-from",
+                                     IN_MOVED_FROM | IN_MOVED_TO);
+    int wd_to = inotify_add_watch (fd, "exts-to",
+                                   IN_MOVED_FROM | IN_MOVED_TO);
+    should ("watches are added to an instance with extended records",
+            fd != -1 && wd_from != -1 && wd_to != -1);
+
+    system ("mv exts-from/f exts-to/g");
+
+    ssize_t len = read_events (fd, buf, sizeof (buf));
+
+    struct inotify_event_ext *from = NULL, *to = NULL;
+    ssize_t i = 0;
+    while (i < len) {
+        struct inotify_event_ext *ie = (struct inotify_event_ext *) &buf[i];
+        if (ie->wd == wd_from && ie->mask & IN_MOVED_FROM) {
+            from = ie;
+        } else if (ie->wd == wd_to && ie->mask & IN_MOVED_TO) {
+            to = ie;
+        }
+        i += sizeof (struct inotify_event_ext) + ie->len;
+    }
+    close (fd);
+
+    if (should ("receive extended IN_MOVED_FROM and IN_MOVED_TO for a move "
+                "between directories",
+                from != NULL && to != NULL)) {
+        should ("both extended records of a move have the same cookie",
+                from->cookie != 0 && from->cookie == to->cookie);
+        should ("extended IN_MOVED_FROM is numbered before IN_MOVED_TO",
+                from->seq < to->seq);
+        should ("both extended records of a move carry the same inode",
+                from->ino == to->ino && from->dev == to->dev);
+    }
+}
+
+void extensions_test::summary ()
+{
+    consumer cons;
+    events received;
+
+    cons.input.setup ("exts-summary", IN_CREATE | IN_DELETE);
+    cons.output.wait ();
+    int wid = cons.output.added_watch_id ();
+
+    should ("summary threshold is set for a directory watch",
+            libinotify_set_watch_param (cons.get_fd (), wid,
+                                        IN_SUMMARY_THRESHOLD, 5) == 0);
+
+    errno = 0;
+    should ("fail with EINVAL on setting a negative summary threshold",
+            libinotify_set_watch_param (cons.get_fd (), wid,
+                                        IN_SUMMARY_THRESHOLD, -1) == -1
+            && errno == EINVAL);
+
+    errno = 0;
+    should ("fail with EINVAL on setting an unknown watch parameter",
+            libinotify_set_watch_param (cons.get_fd (), wid,
+                                        IN_BATCH_DELAY, 1) == -1
+            && errno == EINVAL);
+
+    /* A single command creates the files faster than they are noticed
+     * one by one, so the directory is diffed with many of them at once */
+    std::string command = "cd exts-summary && touch";
+    for (int i = 0; i < SUMMARY_FILES; i++) {
+        char name[16];
+        snprintf (name, sizeof (name), " %d", i);
+        command += name;
+    }
+
+    cons.output.reset ();
+    cons.input.receive (3);
+
+    system (command.c_str ());
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+
+    bool summarized = false;
+    int created = 0;
+    for (events::iterator iter = received.begin ();
+         iter != received.end ();
+         ++iter) {
+        if (iter->watch != wid || !(iter->flags & IN_CREATE)) {
+            continue;
+        }
+        if (iter->flags & IN_SUMMARY) {
+            summarized = summarized || iter->cookie > 5;
+        } else {
+            ++created;
+        }
+    }
+    should ("receive IN_SUMMARY with IN_CREATE for many files created "
+            "at once",
+            summarized);
+    should ("do not receive IN_CREATE for every file created at once with "
+            "a summary threshold set",
+            created < SUMMARY_FILES);
+
+    cons.input.interrupt ();
+}
+
+void extensions_test::batching ()
+{
+    char buf[IE_EXT_BUFSIZE];
+    intptr_t value = 0;
+
+    int fd = inotify_init ();
+    int wd = inotify_add_watch (fd, "exts-batch", IN_CREATE);
+    should ("batch delay is set for an instance",
+            wd != -1 && libinotify_set_param (fd, IN_BATCH_DELAY, 500) == 0);
+    should ("batch delay set for an instance is read back",
+            libinotify_get_param (fd, IN_BATCH_DELAY, &value) == 0
+            && value == 500);
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    system ("touch exts-batch/a");
+
+    should ("events are held back for the batch delay",
+            poll (&pfd, 1, 100) == 0);
+    should ("events held back are sent after the batch delay",
+            poll (&pfd, 1, 2000) == 1 && read (fd, buf, sizeof (buf)) > 0);
+
+
+    should ("batch size is set for an instance",
+            libinotify_set_param (fd, IN_BATCH_BYTES, 1) == 0);
+
+    system ("touch exts-batch/b");
+
+    should ("events are sent at once when they take the batch size",
+            poll (&pfd, 1, 300) == 1 && read (fd, buf, sizeof (buf)) > 0);
+    close (fd);
+
+
+    int file_fd = open ("exts-batch/a", O_RDONLY);
+    errno = 0;
+    should ("fail with EINVAL on setting a parameter of a file which is not "
+            "an inotify instance",
+            libinotify_set_param (file_fd, IN_BATCH_DELAY, 500) == -1
+            && errno == EINVAL);
+    if (file_fd != -1) {
+        close (file_fd);
+    }
+}
+
+void extensions_test::cleanup ()
+{
+    system ("rm -rf exts-tree");
+    system ("rm -rf exts-filter");
+    system ("rm -rf exts-snapshots");
+    system ("rm -rf exts-saved");
+    system ("rm -rf exts-listed");
+    system ("rm -rf exts-resync");
+    system ("rm -rf exts-extended");
+    system ("rm -rf exts-sizes");
+    system ("rm -rf exts-from");
+    system ("rm -rf exts-to");
+    system ("rm -rf exts-summary");
+    system ("rm -rf exts-batch");
+}
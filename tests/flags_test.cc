@@ -0,0 +1,82 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <sys/stat.h>
+#include "flags_test.hh"
+
+extern "C" {
+#include "watch-flags.h"
+}
+
+/* Lower flags are checked in all the combinations, upper ones one by one */
+#define LOWER_BITS 12
+
+flags_test::flags_test (journal &j)
+: test ("Flags translation", j)
+{
+}
+
+void flags_test::setup ()
+{
+    watch_flags_init ();
+}
+
+void flags_test::run ()
+{
+    unsigned long i2k_mismatches = 0;
+    unsigned long k2i_mismatches = 0;
+
+    for (unsigned int type = 0; type <= S_IFMT; type += S_IFMT & -S_IFMT) {
+        for (unsigned int extra = 0; extra < 8; extra++) {
+            watch_flags_t wf = type;
+            if (extra & 1) wf |= WF_ISSUBWATCH;
+            if (extra & 2) wf |= WF_DELETED;
+            if (extra & 4) wf |= WF_MODIFIED;
+
+            /* The first round goes without upper flags */
+            for (int bit = LOWER_BITS - 1; bit < 32; bit++) {
+                uint32_t upper = bit < LOWER_BITS ? 0 : 1u << bit;
+
+                for (uint32_t lower = 0; lower < (1u << LOWER_BITS); lower++) {
+                    uint32_t flags = upper | lower;
+                    if (inotify_to_kqueue (flags, wf)
+                        != inotify_to_kqueue_ref (flags, wf)) {
+                        ++i2k_mismatches;
+                    }
+                    if (kqueue_to_inotify (flags, wf)
+                        != kqueue_to_inotify_ref (flags, wf)) {
+                        ++k2i_mismatches;
+                    }
+                }
+            }
+        }
+    }
+
+    should ("inotify_to_kqueue matches the reference for all the masks "
+            "and watch types", i2k_mismatches == 0);
+    should ("kqueue_to_inotify matches the reference for all the filter "
+            "flags and watch types", k2i_mismatches == 0);
+}
+
+void flags_test::cleanup ()
+{
+}
@@ -0,0 +1,95 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+
+#include <errno.h>
+#include "name_filter_test.hh"
+
+extern "C" {
+#include "name-filter.h"
+}
+
+name_filter_test::name_filter_test (journal &j)
+: test ("Name filters", j)
+{
+}
+
+void name_filter_test::setup ()
+{
+}
+
+void name_filter_test::run ()
+{
+    name_filter *nf = nf_create ();
+
+    should ("empty filter keeps all the names",
+            nf_skips (nf, "foo") == 0 && nf_skips (NULL, "foo") == 0);
+
+    should ("empty patterns are rejected",
+            nf_add (nf, NF_EXCLUDE, "") == -1 && errno == EINVAL);
+    should ("patterns with slashes are rejected",
+            nf_add (nf, NF_EXCLUDE, "foo/bar") == -1 && errno == EINVAL);
+
+    nf_add (nf, NF_EXCLUDE, ".git");
+    nf_add (nf, NF_EXCLUDE, "*.o");
+    nf_add (nf, NF_EXCLUDE, ".#*");
+    nf_add (nf, NF_EXCLUDE, "core.[0-9]*");
+
+    should ("literal exclude skips the exact name",
+            nf_skips (nf, ".git") == 1);
+    should ("literal exclude keeps longer and shorter names",
+            nf_skips (nf, ".gitignore") == 0 && nf_skips (nf, ".gi") == 0);
+    should ("suffix exclude skips matching names",
+            nf_skips (nf, "main.o") == 1 && nf_skips (nf, ".o") == 1);
+    should ("suffix exclude keeps other names",
+            nf_skips (nf, "main.c") == 0 && nf_skips (nf, "o") == 0);
+    should ("prefix exclude skips matching names",
+            nf_skips (nf, ".#main.c") == 1);
+    should ("glob exclude skips matching names",
+            nf_skips (nf, "core.1234") == 1 && nf_skips (nf, "core.x") == 0);
+
+    name_filter *copy = nf_copy (nf);
+    nf_add (copy, NF_INCLUDE, "*.c");
+    nf_add (copy, NF_INCLUDE, "Makefile");
+
+    should ("include keeps matching names",
+            nf_skips (copy, "main.c") == 0 && nf_skips (copy, "Makefile") == 0);
+    should ("include skips other names",
+            nf_skips (copy, "main.h") == 1 && nf_skips (copy, "README") == 1);
+    should ("exclude wins over include",
+            nf_skips (copy, ".#main.c") == 1);
+    should ("copy does not change the original",
+            nf_skips (nf, "main.h") == 0);
+
+    name_filter *all = nf_create ();
+    nf_add (all, NF_EXCLUDE, "*");
+    should ("star alone skips everything",
+            nf_skips (all, "foo") == 1 && nf_skips (all, ".bar") == 1);
+
+    nf_free (all);
+    nf_free (copy);
+    nf_free (nf);
+}
+
+void name_filter_test::cleanup ()
+{
+}
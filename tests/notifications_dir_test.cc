@@ -21,6 +21,8 @@
 *******************************************************************************/
 
 #include <algorithm>
+#include <fcntl.h>  /* open */
+#include <unistd.h> /* write, close */
 #include "notifications_dir_test.hh"
 
 notifications_dir_test::notifications_dir_test (journal &j)
@@ -42,6 +44,9 @@ void notifications_dir_test::setup ()
     system ("mkdir ntfsdt-bugs");
     system ("touch ntfsdt-bugs/1");
     system ("touch ntfsdt-bugs/2");
+
+    system ("mkdir ntfsdt-unlink");
+    system ("touch ntfsdt-unlink/log");
 }
 
 void notifications_dir_test::run ()
@@ -343,6 +348,118 @@ void notifications_dir_test::run ()
             contains (received, event ("", wid, IN_IGNORED)));
 
 
+    cons.input.setup ("ntfsdt-unlink",
+                      IN_MODIFY | IN_DELETE | IN_EXCL_UNLINK);
+    cons.output.wait ();
+    wid = cons.output.added_watch_id ();
+
+    int fd = open ("ntfsdt-unlink/log", O_WRONLY);
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("rm ntfsdt-unlink/log");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_DELETE on unlinking a file opened by someone",
+            contains (received, event ("log", wid, IN_DELETE)));
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    if (fd != -1) {
+        write (fd, "Hello\n", 6);
+        close (fd);
+    }
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("do not receive IN_MODIFY for an unlinked file with IN_EXCL_UNLINK",
+            fd != -1 && !contains (received, event ("log", wid, IN_MODIFY)));
+
+
+    cons.input.setup ("ntfsdt-bugs",
+                      IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    cons.output.wait ();
+    int wid_from = cons.output.added_watch_id ();
+
+    cons.input.setup ("ntfsdt-cache",
+                      IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    cons.output.wait ();
+    int wid_to = cons.output.added_watch_id ();
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("mv ntfsdt-bugs/1 ntfsdt-cache/one");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+
+    iter_from = std::find_if (received.begin(),
+                              received.end(),
+                              event_matcher (event ("1", wid_from, IN_MOVED_FROM)));
+    iter_to = std::find_if (received.begin(),
+                            received.end(),
+                            event_matcher (event ("one", wid_to, IN_MOVED_TO)));
+
+    if (should ("receive IN_MOVED_FROM and IN_MOVED_TO for a move between "
+                "two watched directories",
+                iter_from != received.end () && iter_to != received.end())) {
+        should ("both events for a move between watched directories have "
+                "the same cookie",
+                iter_from->cookie != 0 && iter_from->cookie == iter_to->cookie);
+    }
+    should ("do not receive IN_DELETE and IN_CREATE for a move between "
+            "two watched directories",
+            !contains (received, event ("1", wid_from, IN_DELETE))
+            && !contains (received, event ("one", wid_to, IN_CREATE)));
+
+
+    cons.input.setup ("ntfsdt-cache", IN_MOVED_FROM | IN_MOVED_TO);
+    cons.output.wait ();
+    wid_from = cons.output.added_watch_id ();
+
+    cons.input.setup ("ntfsdt-bugs", IN_MOVED_FROM | IN_MOVED_TO);
+    cons.output.wait ();
+    wid_to = cons.output.added_watch_id ();
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("mv ntfsdt-cache/one ntfsdt-bugs/1");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+
+    iter_from = std::find_if (received.begin(),
+                              received.end(),
+                              event_matcher (event ("one", wid_from, IN_MOVED_FROM)));
+    iter_to = std::find_if (received.begin(),
+                            received.end(),
+                            event_matcher (event ("1", wid_to, IN_MOVED_TO)));
+
+    if (should ("receive IN_MOVED_FROM and IN_MOVED_TO for a move between "
+                "two directories watched for moves only",
+                iter_from != received.end () && iter_to != received.end())) {
+        should ("both events for a move between directories watched for "
+                "moves only have the same cookie",
+                iter_from->cookie != 0 && iter_from->cookie == iter_to->cookie);
+    }
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("rm ntfsdt-bugs/1");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("do not receive IN_DELETE on removing a file from a directory "
+            "watched for moves only",
+            !contains (received, event ("1", wid_to, IN_DELETE)));
+
+
     cons.input.interrupt ();
 }
 
@@ -352,4 +469,5 @@ void notifications_dir_test::cleanup ()
     system ("rm -rf ntfsdt-working");
     system ("rm -rf ntfsdt-cache");
     system ("rm -rf ntfsdt-bugs");
+    system ("rm -rf ntfsdt-unlink");
 }
@@ -31,6 +31,13 @@
 #include "open_close_test.hh"
 #include "symlink_test.hh"
 #include "bugs_test.hh"
+#include "name_filter_test.hh"
+#include "dep_list_test.hh"
+#include "dep_tree_test.hh"
+#ifndef __linux__
+#include "flags_test.hh"
+#include "extensions_test.hh"
+#endif
 
 #define CONCURRENT
 
@@ -48,6 +55,14 @@ int main (int argc, char *argv[]) {
         new symlink_test (j),
         new fail_test (j),
         new bugs_test (j),
+        /* Check internals of the library, not the inotify API */
+        new name_filter_test (j),
+        new dep_list_test (j),
+        new dep_tree_test (j),
+#ifndef __linux__
+        new flags_test (j),
+        new extensions_test (j),
+#endif
     };
     const int num_tests = sizeof(tests)/sizeof(tests[0]);
 
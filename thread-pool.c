@@ -0,0 +1,195 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include "compat.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>  /* sigfillset */
+#include <stddef.h>  /* NULL */
+#include <unistd.h>  /* sysconf */
+
+#include "utils.h"
+#include "thread-pool.h"
+
+/**
+ * This structure represents a batch of tasks submitted to the pool.
+ * Every participating thread (helpers and the submitter itself) takes
+ * the next unprocessed task until the batch is exhausted.
+ **/
+typedef struct pool_job {
+    pool_task_cb task;     /* a routine to run */
+    void **args;           /* an array of routine arguments */
+    size_t nargs;          /* number of arguments (i.e. tasks) */
+    size_t next;           /* index of the next task to take */
+    size_t done;           /* number of completed tasks */
+} pool_job;
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_finished = PTHREAD_COND_INITIALIZER;
+
+static pool_job *pool_current = NULL;  /* a batch being processed */
+static unsigned long pool_generation = 0; /* incremented on every batch */
+static int pool_nthreads = 0;          /* number of started helpers */
+
+/**
+ * Take the tasks of a batch one by one and run them.
+ *
+ * Must be called with pool_mutex locked. Returns with pool_mutex locked.
+ *
+ * @param[in] job A pointer to #pool_job.
+ **/
+static void
+pool_drain (pool_job *job)
+{
+    while (job->next < job->nargs) {
+        size_t i = job->next++;
+
+        pthread_mutex_unlock (&pool_mutex);
+        job->task (job->args[i]);
+        pthread_mutex_lock (&pool_mutex);
+
+        if (++job->done == job->nargs) {
+            pthread_cond_broadcast (&pool_finished);
+        }
+    }
+}
+
+/**
+ * The helper thread loop.
+ *
+ * @param[in] arg Unused.
+ * @return NULL.
+ **/
+static void*
+pool_thread (void *arg)
+{
+    unsigned long seen = 0;
+    (void) arg;
+
+    pthread_mutex_lock (&pool_mutex);
+    for (;;) {
+        while (pool_current == NULL || seen == pool_generation) {
+            pthread_cond_wait (&pool_wakeup, &pool_mutex);
+        }
+        seen = pool_generation;
+        pool_drain (pool_current);
+    }
+    pthread_mutex_unlock (&pool_mutex);
+    return NULL;
+}
+
+/**
+ * Start helper threads. Number of helpers is the number of online CPUs
+ * minus one, as the submitting thread takes part in the processing too.
+ **/
+static void
+pool_init (void)
+{
+    pthread_attr_t attr;
+    sigset_t set, oset;
+    pthread_t thread;
+    int nthreads = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+    if (ncpu > 1) {
+        nthreads = ncpu - 1;
+    }
+#endif
+    if (nthreads > POOL_MAX_THREADS) {
+        nthreads = POOL_MAX_THREADS;
+    }
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+    /* Helpers should never be selected for signal delivery */
+    sigfillset (&set);
+    pthread_sigmask (SIG_BLOCK, &set, &oset);
+
+    for (; pool_nthreads < nthreads; pool_nthreads++) {
+        if (pthread_create (&thread, &attr, pool_thread, NULL) != 0) {
+            perror_msg ("Failed to start a helper thread");
+            break;
+        }
+    }
+
+    pthread_sigmask (SIG_SETMASK, &oset, NULL);
+    pthread_attr_destroy (&attr);
+}
+
+/**
+ * Run a set of independent tasks in parallel and wait for their completion.
+ *
+ * The calling thread processes tasks as well. If the pool is occupied by
+ * another worker or there are no helper threads, all the tasks are run
+ * sequentially in the calling thread.
+ *
+ * @param[in] task  A routine to run.
+ * @param[in] args  An array of arguments, one per task.
+ * @param[in] nargs Number of tasks.
+ **/
+void
+pool_run (pool_task_cb task, void **args, size_t nargs)
+{
+    assert (task != NULL);
+    assert (args != NULL || nargs == 0);
+
+    size_t i;
+
+    pthread_once (&pool_once, pool_init);
+
+    if (nargs < 2
+        || pool_nthreads == 0
+        || pthread_mutex_trylock (&pool_busy) != 0) {
+        for (i = 0; i < nargs; i++) {
+            task (args[i]);
+        }
+        return;
+    }
+
+    pool_job job = {
+        .task = task,
+        .args = args,
+        .nargs = nargs,
+        .next = 0,
+        .done = 0,
+    };
+
+    pthread_mutex_lock (&pool_mutex);
+    pool_current = &job;
+    ++pool_generation;
+    pthread_cond_broadcast (&pool_wakeup);
+
+    pool_drain (&job);
+    while (job.done < job.nargs) {
+        pthread_cond_wait (&pool_finished, &pool_mutex);
+    }
+    pool_current = NULL;
+    pthread_mutex_unlock (&pool_mutex);
+
+    pthread_mutex_unlock (&pool_busy);
+}
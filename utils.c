@@ -32,9 +32,10 @@
 #include <unistd.h> /* read, write */
 #include <errno.h>  /* EINTR */
 #include <stdlib.h> /* malloc */
-#include <string.h> /* strlen */
+#include <string.h> /* memcpy */
 #include <fcntl.h> /* fcntl */
 #include <stdio.h>
+#include <time.h>  /* clock_gettime */
 #include <assert.h>
 
 #include <sys/types.h>
@@ -51,6 +52,7 @@
  * @param[in] mask   An inotify watch mask.
  * @param[in] cookie Event cookie.
  * @param[in] name   File name (may be NULL).
+ * @param[in] name_len The length of the name without the trailing zero.
  * @param[out] event_len The length of the created event, in bytes.
  * @return A pointer to a created event on NULL on a failure.
  **/
@@ -59,10 +61,15 @@ create_inotify_event (int         wd,
                       uint32_t    mask,
                       uint32_t    cookie,
                       const char *name,
+                      size_t      name_len,
                       size_t     *event_len)
 {
     struct inotify_event *event = NULL;
-    size_t name_len = name ? strlen (name) + 1 : 0;
+    if (name != NULL) {
+        ++name_len;
+    } else {
+        name_len = 0;
+    }
     *event_len = sizeof (struct inotify_event) + name_len;
     event = calloc (1, *event_len);
 
@@ -79,12 +86,74 @@ create_inotify_event (int         wd,
     event->len = name_len;
 
     if (name) {
-        strlcpy (event->name, name, name_len);
+        memcpy (event->name, name, name_len);
     }
 
     return event;
 }
 
+/**
+ * Create a new extended inotify event.
+ *
+ * The name is padded with zeroes, so records placed one after another
+ * stay 8-byte aligned. The fields not found in struct inotify_event are
+ * left zeroed.
+ *
+ * @param[in] wd     An associated watch's id.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name (may be NULL).
+ * @param[in] name_len The length of the name without the trailing zero.
+ * @param[out] event_len The length of the created event, in bytes.
+ * @return A pointer to a created event on NULL on a failure.
+ **/
+struct inotify_event_ext*
+create_inotify_event_ext (int         wd,
+                          uint32_t    mask,
+                          uint32_t    cookie,
+                          const char *name,
+                          size_t      name_len,
+                          size_t     *event_len)
+{
+    struct inotify_event_ext *event = NULL;
+    size_t len = 0;
+    if (name != NULL) {
+        len = (name_len + 8) & ~(size_t) 7;
+    }
+    *event_len = sizeof (struct inotify_event_ext) + len;
+    event = calloc (1, *event_len);
+
+    if (event == NULL) {
+        perror_msg ("Failed to allocate a new inotify event [%s, %X]",
+                    name,
+                    mask);
+        return NULL;
+    }
+
+    event->wd = wd;
+    event->mask = mask;
+    event->cookie = cookie;
+    event->len = len;
+
+    if (name) {
+        memcpy (event->name, name, name_len);
+    }
+
+    return event;
+}
+
+/**
+ * Get the current time of the monotonic clock.
+ *
+ * @return The time in nanoseconds.
+ **/
+uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 #define SAFE_GENERIC_OP(fcn, fd, data, size)    \
     size_t total = 0;                           \
@@ -60,12 +60,21 @@ struct inotify_event* create_inotify_event (int         wd,
                                             uint32_t    mask,
                                             uint32_t    cookie,
                                             const char *name,
+                                            size_t      name_len,
                                             size_t     *event_len);
+struct inotify_event_ext* create_inotify_event_ext (int         wd,
+                                                    uint32_t    mask,
+                                                    uint32_t    cookie,
+                                                    const char *name,
+                                                    size_t      name_len,
+                                                    size_t     *event_len);
 
 ssize_t safe_read   (int fd, void *data, size_t size);
 ssize_t safe_write  (int fd, const void *data, size_t size);
 ssize_t safe_writev (int fd, const struct iovec iov[], int iovcnt);
 
+uint64_t monotonic_ns (void);
+
 int is_opened (int fd);
 int is_deleted (int fd);
 int set_cloexec_flag (int fd, int value);
@@ -0,0 +1,300 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include "compat.h"
+
+#include <assert.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/event.h> /* NOTE_* */
+#include <sys/stat.h>
+
+#include "sys/inotify.h"
+#include "watch-flags.h"
+
+/**
+ * Convert the inotify watch mask to the kqueue event filter flags.
+ *
+ * The reference implementation for the lookup tables.
+ *
+ * @param[in] flags An inotify watch mask.
+ * @param[in] wf    A kqueue watch internal flags.
+ * @return Converted kqueue event filter flags.
+ **/
+uint32_t
+inotify_to_kqueue_ref (uint32_t flags, watch_flags_t wf)
+{
+    uint32_t result = 0;
+
+    if (!(S_ISREG (wf) || S_ISDIR (wf) || S_ISLNK (wf))) {
+        return result;
+    }
+
+#ifdef NOTE_OPEN
+    if (flags & IN_OPEN)
+        result |= NOTE_OPEN;
+#endif
+#ifdef NOTE_CLOSE
+    if (flags & IN_CLOSE_NOWRITE)
+        result |= NOTE_CLOSE;
+    if (flags & IN_CLOSE_WRITE && S_ISREG (wf))
+        result |= (NOTE_CLOSE | NOTE_WRITE);
+#endif
+#ifdef NOTE_READ
+    if (flags & IN_ACCESS && S_ISREG (wf))
+        result |= NOTE_READ;
+#endif
+    if (flags & IN_ATTRIB)
+        result |= NOTE_ATTRIB;
+    if (flags & IN_MODIFY && S_ISREG (wf))
+        result |= NOTE_WRITE;
+    if (!(wf & WF_ISSUBWATCH)) {
+        if (S_ISDIR (wf)) {
+            result |= NOTE_WRITE;
+#ifdef HAVE_NOTE_EXTEND_ON_SUBFILE_RENAME
+            result |= NOTE_EXTEND;
+#endif
+        }
+        if (flags & IN_ATTRIB && S_ISREG (wf))
+            result |= NOTE_LINK;
+        if (flags & IN_MOVE_SELF)
+            result |= NOTE_RENAME;
+        result |= NOTE_DELETE | NOTE_REVOKE;
+    }
+    return result;
+}
+
+/**
+ * Convert the kqueue event filter flags to the inotify watch mask.
+ *
+ * The reference implementation for the lookup tables.
+ *
+ * @param[in] flags A kqueue filter flags.
+ * @param[in] wf    A kqueue watch internal flags.
+ * @return Converted inotify watch mask.
+ **/
+uint32_t
+kqueue_to_inotify_ref (uint32_t flags, watch_flags_t wf)
+{
+    uint32_t result = 0;
+
+#ifdef NOTE_OPEN
+    if (flags & NOTE_OPEN)
+        result |= IN_OPEN;
+#endif
+#ifdef NOTE_CLOSE
+    if (flags & NOTE_CLOSE) {
+        if (wf & WF_MODIFIED && S_ISREG (wf))
+            result |= IN_CLOSE_WRITE;
+        else
+            result |= IN_CLOSE_NOWRITE;
+    }
+#endif
+#ifdef NOTE_READ
+    if (flags & NOTE_READ && S_ISREG (wf))
+        result |= IN_ACCESS;
+#endif
+
+    if (flags & NOTE_ATTRIB)
+        result |= IN_ATTRIB;
+
+    if (flags & NOTE_LINK && S_ISREG (wf) && !(wf & WF_ISSUBWATCH))
+        result |= IN_ATTRIB;
+
+    if (flags & NOTE_WRITE && S_ISREG (wf))
+        result |= IN_MODIFY;
+
+    if (flags & NOTE_DELETE && !(wf & WF_ISSUBWATCH)) {
+        /* Treat deletes as link number changes if links still exist */
+        if (wf & WF_DELETED || !S_ISREG (wf))
+            result |= IN_DELETE_SELF;
+        else
+            result |= IN_ATTRIB;
+    }
+
+    if (flags & NOTE_RENAME && !(wf & WF_ISSUBWATCH))
+        result |= IN_MOVE_SELF;
+
+    if (flags & NOTE_REVOKE && !(wf & WF_ISSUBWATCH))
+        result |= IN_UNMOUNT;
+
+    /* IN_ISDIR flag for subwatches is set in the enqueue_event routine */
+    if ((result & (IN_ATTRIB | IN_OPEN | IN_ACCESS | IN_CLOSE))
+        && S_ISDIR (wf) && !(wf & WF_ISSUBWATCH)) {
+        result |= IN_ISDIR;
+    }
+
+    return result;
+}
+
+/*
+ * Both conversions are unions of per-bit contributions which depend only
+ * on a class of a watch (file type and WF_* flags). So the results are
+ * precomputed for every class and every value of WF_CHUNK_BITS-bit chunks
+ * of the lower flags, and are combined with bitwise OR. Flags above the
+ * tables are converted with the reference functions if they matter.
+ */
+#define WF_CHUNK_BITS 6
+#define WF_CHUNKS     2
+#define WF_CHUNK_SIZE (1 << WF_CHUNK_BITS)
+#define WF_CHUNK_MASK (WF_CHUNK_SIZE - 1)
+
+/* Classes of file types: other, regular, directory, symlink */
+#define WF_TYPES 4
+/* inotify_to_kqueue depends on the type and WF_ISSUBWATCH only */
+#define I2K_CLASSES (WF_TYPES * 2)
+/* kqueue_to_inotify depends also on WF_DELETED and WF_MODIFIED */
+#define K2I_CLASSES (WF_TYPES * 8)
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static unsigned char type_class[16];   /* indexed by S_IFMT bits */
+static uint32_t i2k_table[I2K_CLASSES][WF_CHUNKS][WF_CHUNK_SIZE];
+static uint32_t i2k_slow[I2K_CLASSES]; /* flags not covered by the table */
+static uint32_t k2i_table[K2I_CLASSES][WF_CHUNKS][WF_CHUNK_SIZE];
+static uint32_t k2i_slow[K2I_CLASSES];
+
+#define WF_TYPE(wf) (type_class[((wf) & S_IFMT) >> 12])
+#define I2K_CLASS(wf) \
+    (WF_TYPE (wf) | ((wf) & WF_ISSUBWATCH ? WF_TYPES : 0))
+#define K2I_CLASS(wf) \
+    (I2K_CLASS (wf) \
+     | ((wf) & WF_DELETED ? WF_TYPES * 2 : 0) \
+     | ((wf) & WF_MODIFIED ? WF_TYPES * 4 : 0))
+
+/**
+ * Fill lookup tables of a single class of watches.
+ *
+ * @param[in]  ref   A reference conversion function.
+ * @param[in]  wf    Watch flags of the class.
+ * @param[out] table Lookup tables of the class.
+ * @param[out] slow  Flags which are not covered by the tables.
+ **/
+static void
+watch_flags_fill (uint32_t (* ref) (uint32_t, watch_flags_t),
+                  watch_flags_t wf,
+                  uint32_t table[WF_CHUNKS][WF_CHUNK_SIZE],
+                  uint32_t *slow)
+{
+    uint32_t base = ref (0, wf);
+    int chunk, value, bit;
+
+    for (chunk = 0; chunk < WF_CHUNKS; chunk++) {
+        for (value = 0; value < WF_CHUNK_SIZE; value++) {
+            uint32_t result = chunk == 0 ? base : 0;
+            for (bit = 0; bit < WF_CHUNK_BITS; bit++) {
+                if (value & (1 << bit)) {
+                    result |= ref (1u << (chunk * WF_CHUNK_BITS + bit), wf);
+                }
+            }
+            table[chunk][value] = result;
+        }
+    }
+
+    *slow = 0;
+    for (bit = WF_CHUNK_BITS * WF_CHUNKS; bit < 32; bit++) {
+        if (ref (1u << bit, wf) != base) {
+            *slow |= 1u << bit;
+        }
+    }
+}
+
+/**
+ * Build the lookup tables.
+ **/
+static void
+watch_flags_build (void)
+{
+    static const mode_t types[WF_TYPES] = { 0, S_IFREG, S_IFDIR, S_IFLNK };
+    int t, c;
+
+    for (t = 1; t < WF_TYPES; t++) {
+        type_class[(types[t] & S_IFMT) >> 12] = t;
+    }
+
+    for (c = 0; c < K2I_CLASSES; c++) {
+        watch_flags_t wf = types[c % WF_TYPES];
+        if (c & WF_TYPES) {
+            wf |= WF_ISSUBWATCH;
+        }
+        if (c & (WF_TYPES * 2)) {
+            wf |= WF_DELETED;
+        }
+        if (c & (WF_TYPES * 4)) {
+            wf |= WF_MODIFIED;
+        }
+
+        assert (K2I_CLASS (wf) == c);
+        watch_flags_fill (kqueue_to_inotify_ref, wf, k2i_table[c], &k2i_slow[c]);
+        if (c < I2K_CLASSES) {
+            watch_flags_fill (inotify_to_kqueue_ref, wf,
+                              i2k_table[c], &i2k_slow[c]);
+        }
+    }
+}
+
+/**
+ * Prepare the flags conversion. Must be called before any conversion.
+ **/
+void
+watch_flags_init (void)
+{
+    pthread_once (&tables_once, watch_flags_build);
+}
+
+/**
+ * Convert the inotify watch mask to the kqueue event filter flags.
+ *
+ * @param[in] flags An inotify watch mask.
+ * @param[in] wf    A kqueue watch internal flags.
+ * @return Converted kqueue event filter flags.
+ **/
+uint32_t
+inotify_to_kqueue (uint32_t flags, watch_flags_t wf)
+{
+    int c = I2K_CLASS (wf);
+
+    if (flags & i2k_slow[c]) {
+        return inotify_to_kqueue_ref (flags, wf);
+    }
+    return i2k_table[c][0][flags & WF_CHUNK_MASK]
+         | i2k_table[c][1][(flags >> WF_CHUNK_BITS) & WF_CHUNK_MASK];
+}
+
+/**
+ * Convert the kqueue event filter flags to the inotify watch mask.
+ *
+ * @param[in] flags A kqueue filter flags.
+ * @param[in] wf    A kqueue watch internal flags.
+ * @return Converted inotify watch mask.
+ **/
+uint32_t
+kqueue_to_inotify (uint32_t flags, watch_flags_t wf)
+{
+    int c = K2I_CLASS (wf);
+
+    if (flags & k2i_slow[c]) {
+        return kqueue_to_inotify_ref (flags, wf);
+    }
+    return k2i_table[c][0][flags & WF_CHUNK_MASK]
+         | k2i_table[c][1][(flags >> WF_CHUNK_BITS) & WF_CHUNK_MASK];
+}
@@ -0,0 +1,47 @@
+/*******************************************************************************
+  Copyright (c) 2011-2014 Dmitry Matveev <me@dmitrymatveev.co.uk>
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __WATCH_FLAGS_H__
+#define __WATCH_FLAGS_H__
+
+#include <stdint.h>    /* uint32_t */
+#include <sys/types.h>
+#include <sys/stat.h>  /* mode_t */
+
+/* Inherit watch_flags_t from <sys/stat.h> mode_t type.
+ * It is hackish but allow to use existing stat macroses */
+typedef mode_t watch_flags_t;
+
+#define WF_ISSUBWATCH S_IXOTH /* a type of watch */
+#define WF_DELETED    S_IROTH /* file`s link count == 0 */
+#define WF_MODIFIED   S_IWOTH /* file has been modified i.e. received
+                               * NOTE_WRITE since last NOTE_CLOSE event */
+
+void     watch_flags_init      (void);
+
+uint32_t inotify_to_kqueue     (uint32_t flags, watch_flags_t wf);
+uint32_t kqueue_to_inotify     (uint32_t flags, watch_flags_t wf);
+
+uint32_t inotify_to_kqueue_ref (uint32_t flags, watch_flags_t wf);
+uint32_t kqueue_to_inotify_ref (uint32_t flags, watch_flags_t wf);
+
+#endif /* __WATCH_FLAGS_H__ */
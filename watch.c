@@ -36,119 +36,9 @@
 
 #include "utils.h"
 #include "watch.h"
+#include "worker-thread.h"
 #include "sys/inotify.h"
 
-/**
- * Convert the inotify watch mask to the kqueue event filter flags.
- *
- * @param[in] flags An inotify watch mask.
- * @param[in] wf    A kqueue watch internal flags.
- * @return Converted kqueue event filter flags.
- **/
-uint32_t
-inotify_to_kqueue (uint32_t flags, watch_flags_t wf)
-{
-    uint32_t result = 0;
-
-    if (!(S_ISREG (wf) || S_ISDIR (wf) || S_ISLNK (wf))) {
-        return result;
-    }
-
-#ifdef NOTE_OPEN
-    if (flags & IN_OPEN)
-        result |= NOTE_OPEN;
-#endif
-#ifdef NOTE_CLOSE
-    if (flags & IN_CLOSE_NOWRITE)
-        result |= NOTE_CLOSE;
-    if (flags & IN_CLOSE_WRITE && S_ISREG (wf))
-        result |= (NOTE_CLOSE | NOTE_WRITE);
-#endif
-#ifdef NOTE_READ
-    if (flags & IN_ACCESS && S_ISREG (wf))
-        result |= NOTE_READ;
-#endif
-    if (flags & IN_ATTRIB)
-        result |= NOTE_ATTRIB;
-    if (flags & IN_MODIFY && S_ISREG (wf))
-        result |= NOTE_WRITE;
-    if (!(wf & WF_ISSUBWATCH)) {
-        if (S_ISDIR (wf)) {
-            result |= NOTE_WRITE;
-#ifdef HAVE_NOTE_EXTEND_ON_SUBFILE_RENAME
-            result |= NOTE_EXTEND;
-#endif
-        }
-        if (flags & IN_ATTRIB && S_ISREG (wf))
-            result |= NOTE_LINK;
-        if (flags & IN_MOVE_SELF)
-            result |= NOTE_RENAME;
-        result |= NOTE_DELETE | NOTE_REVOKE;
-    }
-    return result;
-}
-
-/**
- * Convert the kqueue event filter flags to the inotify watch mask.
- *
- * @param[in] flags A kqueue filter flags.
- * @param[in] wf    A kqueue watch internal flags.
- * @return Converted inotify watch mask.
- **/
-uint32_t
-kqueue_to_inotify (uint32_t flags, watch_flags_t wf)
-{
-    uint32_t result = 0;
-
-#ifdef NOTE_OPEN
-    if (flags & NOTE_OPEN)
-        result |= IN_OPEN;
-#endif
-#ifdef NOTE_CLOSE
-    if (flags & NOTE_CLOSE) {
-        if (wf & WF_MODIFIED && S_ISREG (wf))
-            result |= IN_CLOSE_WRITE;
-        else
-            result |= IN_CLOSE_NOWRITE;
-    }
-#endif
-#ifdef NOTE_READ
-    if (flags & NOTE_READ && S_ISREG (wf))
-        result |= IN_ACCESS;
-#endif
-
-    if (flags & NOTE_ATTRIB)
-        result |= IN_ATTRIB;
-
-    if (flags & NOTE_LINK && S_ISREG (wf) && !(wf & WF_ISSUBWATCH))
-        result |= IN_ATTRIB;
-
-    if (flags & NOTE_WRITE && S_ISREG (wf))
-        result |= IN_MODIFY;
-
-    if (flags & NOTE_DELETE && !(wf & WF_ISSUBWATCH)) {
-        /* Treat deletes as link number changes if links still exist */
-        if (wf & WF_DELETED || !S_ISREG (wf))
-            result |= IN_DELETE_SELF;
-        else
-            result |= IN_ATTRIB;
-    }
-
-    if (flags & NOTE_RENAME && !(wf & WF_ISSUBWATCH))
-        result |= IN_MOVE_SELF;
-
-    if (flags & NOTE_REVOKE && !(wf & WF_ISSUBWATCH))
-        result |= IN_UNMOUNT;
-
-    /* IN_ISDIR flag for subwatches is set in the enqueue_event routine */
-    if ((result & (IN_ATTRIB | IN_OPEN | IN_ACCESS | IN_CLOSE))
-        && S_ISDIR (wf) && !(wf & WF_ISSUBWATCH)) {
-        result |= IN_ISDIR;
-    }
-
-    return result;
-}
-
 /* struct kevent is declared slightly differently on the different BSDs.
  * This macros will help to avoid cast warnings on the supported platforms. */
 #if defined (__NetBSD__)
@@ -184,6 +74,89 @@ watch_register_event (watch *w, uint32_t fflags)
     return kevent (kq, &ev, 1, NULL, 0, NULL);
 }
 
+/**
+ * Register vnode kqueue watches of a single worker with one system call.
+ *
+ * @param[in] ws     An array of watches.
+ * @param[in] fflags An array of filter flags in kqueue format, one per watch.
+ * @param[in] n      Number of watches, up to WATCH_BATCH.
+ * @return 0 on success, -1 if any of the watches has failed to register.
+ **/
+int
+watch_register_events (watch **ws, const uint32_t *fflags, size_t n)
+{
+    assert (ws != NULL);
+    assert (fflags != NULL);
+    assert (n <= WATCH_BATCH);
+
+    struct kevent ev[WATCH_BATCH];
+    size_t i;
+    int retval = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    int kq = ws[0]->iw->wrk->kq;
+    assert (kq != -1);
+
+    for (i = 0; i < n; i++) {
+        assert (ws[i]->iw->wrk->kq == kq);
+        EV_SET (&ev[i],
+                ws[i]->fd,
+                EVFILT_VNODE,
+                EV_ADD | EV_ENABLE | EV_CLEAR,
+                fflags[i],
+                0,
+                PTR_TO_UDATA (ws[i]));
+    }
+
+    if (kevent (kq, ev, n, NULL, 0, NULL) != -1) {
+        return 0;
+    }
+
+    /* Changes following a failed one may be left unapplied. Find out
+     * which watches have failed by registering them one by one */
+    for (i = 0; i < n; i++) {
+        if (watch_register_event (ws[i], fflags[i]) == -1) {
+            perror_msg ("Failed to register kqueue event on %d", ws[i]->fd);
+            retval = -1;
+        }
+    }
+    return retval;
+}
+
+/**
+ * Check if a file descriptor of a watch can be shared between workers.
+ *
+ * Descriptors of watched directories are used for listings. Listings
+ * made in place or with a dup'ed descriptor move its file offset, so
+ * such descriptors are kept private.
+ *
+ * @param[in] iw         A backreference to parent #i_watch.
+ * @param[in] watch_type The type of the watch.
+ * @param[in] st         A stat structure of watch.
+ * @return 1 if the descriptor can be shared, 0 otherwise.
+ **/
+static int
+watch_is_shareable (const i_watch *iw,
+                    watch_type_t watch_type,
+                    const struct stat *st)
+{
+    /* Mount points are stored with inode numbers of the underlying
+     * directories, which do not identify the opened file */
+    if (watch_type != WATCH_USER && st->st_dev != iw->dev) {
+        return 0;
+    }
+#if defined (DL_LISTING_IN_PLACE) || \
+    !defined (HAVE_FDOPENDIR) || defined (DIRECTORY_LISTING_REWINDS)
+    if (watch_type == WATCH_USER && S_ISDIR (st->st_mode)) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
 /**
  * Opens a file descriptor of kqueue watch
  *
@@ -254,9 +227,14 @@ watch_open (int dirfd, const char *path, uint32_t flags)
 /**
  * Initialize a watch.
  *
+ * If the file is already watched by another worker, its descriptor is
+ * used instead of fd and fd is closed. Otherwise fd is offered to the
+ * other workers.
+ *
  * @param[in] iw;        A backreference to parent #i_watch.
  * @param[in] watch_type The type of the watch.
- * @param[in] fd         A file descriptor of a watched entry.
+ * @param[in] fd         A file descriptor of a watched entry. Is owned by
+ *     the watch on success.
  * @param[in] st         A stat structure of watch.
  * @return A pointer to a watch on success, NULL on failure.
  **/
@@ -281,6 +259,9 @@ watch_init (i_watch *iw, watch_type_t watch_type, int fd, struct stat *st)
         return NULL;
     }
 
+    int shareable = watch_is_shareable (iw, watch_type, st);
+    shared_fd *sf = NULL;
+
     w->iw = iw;
     w->fd = fd;
     w->flags = wf;
@@ -288,12 +269,27 @@ watch_init (i_watch *iw, watch_type_t watch_type, int fd, struct stat *st)
     /* Inode number obtained via fstat call cannot be used here as it
      * differs from readdir`s one at mount points. */
     w->inode = st->st_ino;
+    w->size = st->st_size;
+
+    if (shareable) {
+        sf = sfd_find (st, iw->wrk, &w->fd);
+    }
 
     if (watch_register_event (w, fflags) == -1) {
+        if (sf != NULL) {
+            sfd_release (sf, iw->wrk);
+        }
         free (w);
         return NULL;
     }
 
+    if (sf != NULL) {
+        close (fd);
+    } else if (shareable) {
+        sf = sfd_insert (st, fd, iw->wrk);
+    }
+    w->sfd = sf;
+
     return w;
 }
 
@@ -306,7 +302,17 @@ void
 watch_free (watch *w)
 {
     assert (w != NULL);
-    if (w->fd != -1) {
+    discard_kevents (w->iw->wrk, w);
+    if (w->sfd != NULL) {
+        /* The descriptor may stay open, so drop the kevent explicitly */
+        int kq = w->iw->wrk->kq;
+        if (kq != -1) {
+            struct kevent ev;
+            EV_SET (&ev, w->fd, EVFILT_VNODE, EV_DELETE, 0, 0, 0);
+            kevent (kq, &ev, 1, NULL, 0, NULL);
+        }
+        sfd_release (w->sfd, w->iw->wrk);
+    } else if (w->fd != -1) {
         close (w->fd);
     }
     free (w);
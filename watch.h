@@ -31,16 +31,10 @@
 #include <sys/stat.h>  /* stat */
 
 typedef struct watch watch;
-/* Inherit watch_flags_t from <sys/stat.h> mode_t type.
- * It is hackish but allow to use existing stat macroses */
-typedef mode_t watch_flags_t;
 
+#include "watch-flags.h"
 #include "inotify-watch.h"
-
-#define WF_ISSUBWATCH S_IXOTH /* a type of watch */
-#define WF_DELETED    S_IROTH /* file`s link count == 0 */
-#define WF_MODIFIED   S_IWOTH /* file has been modified i.e. received
-                               * NOTE_WRITE since last NOTE_CLOSE event */
+#include "shared-fd.h"
 
 typedef enum watch_type {
     WATCH_USER,
@@ -54,13 +48,14 @@ struct watch {
     size_t refcount;          /* number of dependency list items corresponding
                                * to that watch */ 
     int fd;                   /* file descriptor of a watched entry */
+    shared_fd *sfd;           /* owner of fd if it is shared with other
+                               * workers, NULL if fd is private */
     ino_t inode;              /* inode number taken from readdir call */
+    off_t size;               /* size of a regular file at the last
+                               * IN_MODIFY (IN_TRACK_SIZE) */
     RB_ENTRY(watch) link;     /* RB tree links */
 };
 
-uint32_t inotify_to_kqueue (uint32_t flags, watch_flags_t wf);
-uint32_t kqueue_to_inotify (uint32_t flags, watch_flags_t wf);
-
 int    watch_open (int dirfd, const char *path, uint32_t flags);
 watch *watch_init (i_watch *iw,
                    watch_type_t watch_type,
@@ -68,6 +63,10 @@ watch *watch_init (i_watch *iw,
                    struct stat *st);
 void   watch_free (watch *w);
 
-int    watch_register_event (watch *w, uint32_t fflags);
+/* Maximal number of watches registered with a single kevent call */
+#define WATCH_BATCH 64
+
+int    watch_register_event  (watch *w, uint32_t fflags);
+int    watch_register_events (watch **ws, const uint32_t *fflags, size_t n);
 
 #endif /* __WATCH_H__ */
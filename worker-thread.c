@@ -25,18 +25,20 @@
 #include <stddef.h> /* NULL */
 #include <assert.h>
 #include <errno.h>  /* errno */
-#include <stdlib.h> /* calloc, realloc */
-#include <string.h> /* memset */
+#include <stdlib.h> /* calloc, realloc, qsort */
+#include <string.h> /* memset, memcpy */
 #include <stdio.h>
 
 #include <sys/types.h>
 #include <sys/event.h>
+#include <sys/socket.h> /* recv */
 
 #include "sys/inotify.h"
 
 #include "config.h"
 #include "utils.h"
 #include "inotify-watch.h"
+#include "thread-pool.h"
 #include "watch.h"
 #include "worker.h"
 #include "worker-thread.h"
@@ -47,42 +49,80 @@ static void handle_moved (void *udata, dep_item *from_di, dep_item *to_di);
 /**
  * Create a new inotify event and place it to event queue.
  *
- * @param[in] iw   A pointer to #i_watch.
- * @param[in] mask An inotify watch mask.
- * @param[in] di   A pointer to dependency item for subfiles (NULL for user).
+ * Events of subdirectories of recursive watches are reported with the
+ * descriptor of the topmost watch and names relative to it. If an event
+ * is lost, the directory is marked to re-derive its events later.
+ *
+ * @param[in] iw    A pointer to #i_watch.
+ * @param[in] mask  An inotify watch mask.
+ * @param[in] di    A pointer to dependency item for subfiles (NULL for user).
+ * @param[in] sizes The new and the previous sizes of a modified file sent
+ *     with IN_MODIFY by extended instances, or NULL if not known.
  * @return 0 on success, -1 otherwise.
  **/
-int
-enqueue_event (i_watch *iw, uint32_t mask, const dep_item *di)
+static int
+enqueue_event_sized (i_watch        *iw,
+                     uint32_t        mask,
+                     const dep_item *di,
+                     const int64_t   sizes[2])
 {
     assert (iw != NULL);
     worker *wrk = iw->wrk;
     assert (wrk != NULL);
 
-    mask &= (~IN_ALL_EVENTS | iw->flags);
+    i_watch *dir = iw;
+    iw = iwatch_root (iw);
+
+    /* Removals and additions are queued to be paired as moves even if
+     * only IN_MOVED_FROM or IN_MOVED_TO is watched. The watch flags are
+     * applied to them after pairing */
+    int pairable = di != NULL
+        && !(mask & IN_SUMMARY)
+        && (!(iw->flags & IN_ONESHOT) || mask & iw->flags)
+        && ((mask & IN_DELETE && iw->flags & IN_MOVED_FROM)
+            || (mask & IN_CREATE && iw->flags & IN_MOVED_TO));
+    if (!pairable) {
+        mask &= (~IN_ALL_EVENTS | iw->flags);
+    }
     if (!((mask & IN_ALL_EVENTS && !iw->is_closed) || mask & ~IN_ALL_EVENTS)) {
         return 0;
     }
 
-    if (iw->flags & IN_ONESHOT) {
+    if (iw->flags & IN_ONESHOT && mask & IN_ALL_EVENTS) {
         iw->is_closed = 1;
     }
 
     if (wrk->iovcnt >= wrk->iovalloc) {
-        int to_allocate = wrk->iovcnt + 1;
+        int to_allocate = wrk->iovalloc > 0 ? wrk->iovalloc * 2 : 16;
         void *ptr = realloc (wrk->iov, sizeof (struct iovec) * to_allocate);
         if (ptr == NULL) {
             perror_msg ("Failed to extend events to %d items", to_allocate);       
-            return -1;
+            goto lost;
         }
         wrk->iov = ptr;
+        ptr = realloc (wrk->origins, sizeof (event_origin) * to_allocate);
+        if (ptr == NULL) {
+            perror_msg ("Failed to extend events to %d items", to_allocate);
+            goto lost;
+        }
+        wrk->origins = ptr;
         wrk->iovalloc = to_allocate;
     }
 
     const char *name = NULL;
+    char *path = NULL;
+    size_t name_len = 0;
     uint32_t cookie = 0;
     if (di != NULL) {
         name = di->path;
+        name_len = di->namelen;
+        if (dir != iw) {
+            path = iwatch_path (dir, di->path, &name_len);
+            if (path == NULL) {
+                goto lost;
+            }
+            name = path;
+        }
         if (mask & IN_MOVE) {
             cookie = di->inode & 0x00000000FFFFFFFF;
         }
@@ -91,37 +131,431 @@ enqueue_event (i_watch *iw, uint32_t mask, const dep_item *di)
         }
     }
 
-    wrk->iov[wrk->iovcnt].iov_base = create_inotify_event (iw->wd, mask,
-        cookie, name, &wrk->iov[wrk->iovcnt].iov_len);
+    if (wrk->extended) {
+        struct inotify_event_ext *ext = create_inotify_event_ext (iw->wd,
+            mask, cookie, name, name_len, &wrk->iov[wrk->iovcnt].iov_len);
+        if (ext != NULL) {
+            ext->received = wrk->received;
+            ext->ino = di != NULL ? di->inode : dir->inode;
+            ext->dev = dir->dev;
+            ext->size = mask & IN_MODIFY && sizes != NULL ? sizes[0] : -1;
+            ext->old_size = mask & IN_MODIFY && sizes != NULL ? sizes[1] : -1;
+        }
+        wrk->iov[wrk->iovcnt].iov_base = ext;
+    } else {
+        wrk->iov[wrk->iovcnt].iov_base = create_inotify_event (iw->wd, mask,
+            cookie, name, name_len, &wrk->iov[wrk->iovcnt].iov_len);
+    }
+    free (path);
 
     if (wrk->iov[wrk->iovcnt].iov_base != NULL) {
+        event_origin *eo = &wrk->origins[wrk->iovcnt];
+        eo->inode = 0;
+        if (pairable) {
+            eo->inode = di->inode;
+            eo->dev = dir->dev;
+            eo->dir = dir;
+            eo->flags = iw->flags;
+        }
+        wrk->iovbytes += wrk->iov[wrk->iovcnt].iov_len;
         ++wrk->iovcnt;
     } else {
         perror_msg ("Failed to create a inotify event %x", mask);
-        return -1;
+        goto lost;
     }
 
     return 0;
+
+lost:
+    /* Entry events can not be told apart later, so all the entries are
+     * reported once more */
+    iwatch_resync_later (dir, di != NULL ? IW_RESYNC_FULL : IW_RESYNC_DIFF, 0);
+    return -1;
 }
 
 /**
- * Flush inotify events queue to socket
+ * Create a new inotify event without file sizes and place it to event
+ * queue.
+ *
+ * @param[in] iw   A pointer to #i_watch.
+ * @param[in] mask An inotify watch mask.
+ * @param[in] di   A pointer to dependency item for subfiles (NULL for user).
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+enqueue_event (i_watch *iw, uint32_t mask, const dep_item *di)
+{
+    return enqueue_event_sized (iw, mask, di, NULL);
+}
+
+/**
+ * Queue an event of a watched directory itself. Subdirectories of
+ * recursive watches are reported as entries of their parents.
+ *
+ * @param[in] iw   A pointer to #i_watch of the directory.
+ * @param[in] mask An inotify watch mask.
+ **/
+static void
+enqueue_dir_event (i_watch *iw, uint32_t mask)
+{
+    assert (iw != NULL);
+
+    if (iw->parent == NULL) {
+        enqueue_event (iw, mask, NULL);
+    } else if (iwatch_snapshot_thaw (iw->parent) == 0) {
+        size_t i, n;
+        size_t first = dl_find (iw->parent->deps, iw->inode, &n);
+        for (i = first; i < first + n; i++) {
+            enqueue_event (iw->parent, mask, dl_item (iw->parent->deps, i));
+        }
+    }
+}
+
+/**
+ * An event which may be paired with another one as a part of move.
+ **/
+typedef struct {
+    ino_t inode;
+    dev_t dev;
+    int index;  /* position of the event in the queue */
+} move_candidate;
+
+/**
+ * Compare two move candidates by device and inode numbers and then by
+ * position in the queue.
+ *
+ * @param[in] a A pointer to the first #move_candidate.
+ * @param[in] b A pointer to the second #move_candidate.
+ * @return An integer less than, equal to, or greater than zero.
+ **/
+static int
+move_candidate_cmp (const void *a, const void *b)
+{
+    const move_candidate *mc1 = (const move_candidate *) a;
+    const move_candidate *mc2 = (const move_candidate *) b;
+
+    if (mc1->dev != mc2->dev) {
+        return mc1->dev < mc2->dev ? -1 : 1;
+    }
+    if (mc1->inode != mc2->inode) {
+        return mc1->inode < mc2->inode ? -1 : 1;
+    }
+    return mc1->index - mc2->index;
+}
+
+/**
+ * Check whether a queued event is wanted by its watch. Removals and
+ * additions left unpaired are not wanted by watches which ask for moves
+ * only.
  *
  * @param[in] wrk A pointer to #worker.
+ * @param[in] i   A position of the event in the queue.
+ * @return 1 if the event is to be sent, 0 otherwise.
  **/
-void
-flush_events (worker *wrk)
+static int
+is_wanted (const worker *wrk, int i)
+{
+    const struct inotify_event *ev = wrk->iov[i].iov_base;
+    return wrk->origins[i].inode == 0
+        || ev->mask & IN_ALL_EVENTS & wrk->origins[i].flags;
+}
+
+/**
+ * Check whether a file added by a queued event has links besides the
+ * added one. Such a file has been linked to a directory rather than moved
+ * to it, even if one of its old links has been removed.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] ev  A queued event of the addition.
+ * @return 1 if other links are left, 0 if not or not known.
+ **/
+static int
+has_other_links (const worker *wrk, const struct inotify_event *ev)
 {
-    if (safe_writev (wrk->io[KQUEUE_FD], wrk->iov, wrk->iovcnt) == -1) {
-        perror_msg ("Sending of inotify events to socket failed");
+    if (ev->mask & IN_ISDIR) {
+        return 0;
     }
 
-    int i;
+    const char *name = wrk->extended
+        ? ((const struct inotify_event_ext *) ev)->name
+        : ev->name;
+
+    struct stat st;
+    if (fstatat (ev->wd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return 0;
+    }
+    return st.st_nlink > 1;
+}
+
+/**
+ * Report a file renamed between two watched directories as moved.
+ *
+ * Diffs of both the directories report the file as removed from one of
+ * them and added to another one. Such queued IN_DELETE and IN_CREATE are
+ * replaced with IN_MOVED_FROM and IN_MOVED_TO sharing a cookie, the former
+ * placed right before the latter. Unpaired events not wanted by their
+ * watches are dropped.
+ *
+ * A rename of many files is diffed in slices, and the events are sent in
+ * the middle of the batch. The unpaired removals and additions are kept
+ * in the queue then, up to WORKER_MOVES_HELD latest ones, to be paired
+ * with the events of the rest of the batch.
+ *
+ * @param[in] wrk  A pointer to #worker.
+ * @param[in] hold 1 to keep unpaired removals and additions back, 0 when
+ *     the batch is over.
+ * @return Number of events at the start of the queue to send now.
+ **/
+static int
+pair_moves (worker *wrk, int hold)
+{
+    int i, j, n = 0;
+    for (i = 0; i < wrk->iovcnt; i++) {
+        if (wrk->origins[i].inode != 0) {
+            ++n;
+        }
+    }
+    if (n == 0) {
+        return wrk->iovcnt;
+    }
+
+    int paired = 0, held = 0, nsend = 0;
+    move_candidate *mc = malloc (sizeof (move_candidate) * n);
+    int *partner = malloc (sizeof (int) * wrk->iovcnt);
+    struct iovec *iov = malloc (sizeof (struct iovec) * wrk->iovcnt);
+    event_origin *origins = malloc (sizeof (event_origin) * wrk->iovcnt);
+    if (mc == NULL || partner == NULL || iov == NULL || origins == NULL) {
+        perror_msg ("Failed to allocate %d events to pair", n);
+        goto drop;
+    }
+
+    for (i = 0, n = 0; i < wrk->iovcnt; i++) {
+        partner[i] = -1;
+        if (wrk->origins[i].inode != 0) {
+            mc[n].inode = wrk->origins[i].inode;
+            mc[n].dev = wrk->origins[i].dev;
+            mc[n].index = i;
+            ++n;
+        }
+    }
+    qsort (mc, n, sizeof (move_candidate), move_candidate_cmp);
+
+    /* Both record formats start with the fields of struct inotify_event */
+    for (i = 0; i < n; i++) {
+        int from = mc[i].index;
+        if (partner[from] != -1) {
+            continue;
+        }
+        struct inotify_event *ev = wrk->iov[from].iov_base;
+
+        for (j = i + 1;
+             j < n && mc[j].dev == mc[i].dev && mc[j].inode == mc[i].inode;
+             j++) {
+            int to = mc[j].index;
+            struct inotify_event *other = wrk->iov[to].iov_base;
+            if (partner[to] != -1
+                || wrk->origins[to].dir == wrk->origins[from].dir
+                || !((ev->mask ^ other->mask) & IN_DELETE)) {
+                continue;
+            }
+
+            struct inotify_event *removed = ev, *added = other;
+            if (added->mask & IN_DELETE) {
+                removed = other;
+                added = ev;
+            }
+            if (has_other_links (wrk, added)) {
+                continue;
+            }
+
+            removed->mask = (removed->mask & ~IN_DELETE) | IN_MOVED_FROM;
+            added->mask = (added->mask & ~IN_CREATE) | IN_MOVED_TO;
+            removed->cookie = mc[i].inode & 0x00000000FFFFFFFF;
+            added->cookie = removed->cookie;
+            partner[from] = to;
+            partner[to] = from;
+            ++paired;
+            break;
+        }
+    }
+
+    /* Partners of the latest unpaired events may be queued later */
+    if (hold) {
+        for (i = wrk->iovcnt - 1; i >= 0 && held < WORKER_MOVES_HELD; i--) {
+            if (partner[i] == -1 && wrk->origins[i].inode != 0) {
+                partner[i] = -2;
+                ++held;
+            }
+        }
+    }
+
+    if (paired == 0 && held == 0) {
+        goto drop;
+    }
+
+    /* Place every pair where its earlier event has been, and the events
+     * kept back after the ones to send */
+    for (i = 0, j = 0; i < wrk->iovcnt; i++) {
+        int p = partner[i];
+        if (p == -2) {
+            continue;
+        } else if (p == -1) {
+            if (is_wanted (wrk, i)) {
+                iov[j++] = wrk->iov[i];
+            } else {
+                free (wrk->iov[i].iov_base);
+            }
+        } else if (p > i) {
+            struct inotify_event *ev = wrk->iov[i].iov_base;
+            if (ev->mask & IN_MOVED_FROM) {
+                iov[j++] = wrk->iov[i];
+                iov[j++] = wrk->iov[p];
+            } else {
+                iov[j++] = wrk->iov[p];
+                iov[j++] = wrk->iov[i];
+            }
+        }
+    }
+    nsend = j;
     for (i = 0; i < wrk->iovcnt; i++) {
+        if (partner[i] == -2) {
+            iov[j] = wrk->iov[i];
+            origins[j++] = wrk->origins[i];
+        }
+    }
+    memcpy (wrk->iov, iov, sizeof (struct iovec) * j);
+    memcpy (&wrk->origins[nsend],
+            &origins[nsend],
+            sizeof (event_origin) * held);
+    wrk->iovcnt = j;
+    goto exit;
+
+drop:
+    for (i = 0, j = 0; i < wrk->iovcnt; i++) {
+        if (is_wanted (wrk, i)) {
+            wrk->iov[j++] = wrk->iov[i];
+        } else {
+            free (wrk->iov[i].iov_base);
+        }
+    }
+    wrk->iovcnt = j;
+    nsend = j;
+
+exit:
+    free (mc);
+    free (partner);
+    free (iov);
+    free (origins);
+    return nsend;
+}
+
+/**
+ * Send queued inotify events to socket.
+ *
+ * @param[in] wrk  A pointer to #worker.
+ * @param[in] hold 1 to keep back the events which may be paired as moves
+ *     later in the batch, 0 to send all the events.
+ **/
+static void
+send_events (worker *wrk, int hold)
+{
+    int i;
+    int nsend = pair_moves (wrk, hold);
+
+    /* Events are numbered only now, as pair_moves reorders them */
+    if (wrk->extended && nsend > 0) {
+        uint64_t sent = monotonic_ns ();
+        for (i = 0; i < nsend; i++) {
+            struct inotify_event_ext *ext = wrk->iov[i].iov_base;
+            ext->seq = ++wrk->seq;
+            ext->sent = sent;
+        }
+    }
+
+    /* writev(2) fails with EINVAL given more than IOV_MAX buffers */
+    for (i = 0; i < nsend; i += IOV_MAX) {
+        int count = nsend - i;
+        if (count > IOV_MAX) {
+            count = IOV_MAX;
+        }
+        if (safe_writev (wrk->io[KQUEUE_FD], &wrk->iov[i], count) == -1) {
+            int error = errno;
+            perror_msg ("Sending of inotify events to socket failed");
+
+            /* Nobody reads the events anymore */
+            if (error == EPIPE) {
+                break;
+            }
+
+            /* The events not sent are lost, so the watched trees they
+             * belong to are reported once more */
+            int j, last_wd = -1;
+            for (j = i; j < nsend; j++) {
+                const struct inotify_event *ie = wrk->iov[j].iov_base;
+                if (ie->wd == last_wd) {
+                    continue;
+                }
+                last_wd = ie->wd;
+
+                i_watch *iw;
+                SLIST_FOREACH (iw, &wrk->head, next) {
+                    if (iw->wd == ie->wd) {
+                        iwatch_resync_later (iw, IW_RESYNC_FULL, 1);
+                        break;
+                    }
+                }
+            }
+            break;
+        }
+    }
+
+    for (i = 0; i < nsend; i++) {
         free (wrk->iov[i].iov_base);
     }
 
-    wrk->iovcnt = 0;
+    /* The events kept back are already at the start of the queue */
+    wrk->iovcnt -= nsend;
+    wrk->iovbytes = 0;
+    for (i = 0; i < wrk->iovcnt; i++) {
+        wrk->iov[i] = wrk->iov[nsend + i];
+        wrk->origins[i] = wrk->origins[nsend + i];
+        wrk->iovbytes += wrk->iov[i].iov_len;
+    }
+    wrk->iovheld = wrk->iovcnt;
+}
+
+/**
+ * Flush inotify events queue to socket
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+void
+flush_events (worker *wrk)
+{
+    send_events (wrk, 0);
+}
+
+/**
+ * Forget about received but not yet processed kqueue events of a watch.
+ *
+ * Must be called before the watch is freed as the events keep pointers
+ * to it.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to the watch being freed.
+ **/
+void
+discard_kevents (worker *wrk, const watch *w)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+
+    int i;
+    for (i = 0; i < wrk->nevents; i++) {
+        if ((watch *) wrk->events[i].udata == w) {
+            wrk->events[i].udata = 0;
+        }
+    }
 }
 
 /**
@@ -134,9 +568,11 @@ process_command (worker *wrk)
 {
     assert (wrk != NULL);
 
-    /* read a byte */
+    /* read a byte. It may have been already consumed by worker_yield */
     char unused;
-    safe_read (wrk->io[KQUEUE_FD], &unused, 1);
+    if (recv (wrk->io[KQUEUE_FD], &unused, 1, MSG_DONTWAIT) != 1) {
+        return;
+    }
 
     if (wrk->cmd.type == WCMD_ADD) {
         wrk->cmd.retval = worker_add_or_modify (wrk,
@@ -146,6 +582,35 @@ process_command (worker *wrk)
     } else if (wrk->cmd.type == WCMD_REMOVE) {
         wrk->cmd.retval = worker_remove (wrk, wrk->cmd.rm_id);
         wrk->cmd.error = errno;
+    } else if (wrk->cmd.type == WCMD_FILTER) {
+        wrk->cmd.retval = worker_filter (wrk,
+                                         wrk->cmd.filter.wd,
+                                         wrk->cmd.filter.kind,
+                                         wrk->cmd.filter.pattern);
+        wrk->cmd.error = errno;
+    } else if (wrk->cmd.type == WCMD_CHECKPOINT) {
+        wrk->cmd.retval = worker_checkpoint (wrk, wrk->cmd.snapshot_dir);
+        wrk->cmd.error = errno;
+    } else if (wrk->cmd.type == WCMD_RESYNC) {
+        wrk->cmd.retval = worker_resync (wrk, wrk->cmd.resync_id);
+        wrk->cmd.error = errno;
+    } else if (wrk->cmd.type == WCMD_WATCH_PARAM) {
+        wrk->cmd.retval = worker_set_watch_param (wrk,
+                                                  wrk->cmd.watch_param.wd,
+                                                  wrk->cmd.watch_param.param,
+                                                  wrk->cmd.watch_param.value);
+        wrk->cmd.error = errno;
+    } else if (wrk->cmd.type == WCMD_PARAM) {
+        wrk->cmd.retval = worker_set_param (wrk,
+                                            wrk->cmd.param.param,
+                                            wrk->cmd.param.value);
+        wrk->cmd.error = errno;
+    } else if (wrk->cmd.type == WCMD_LISTING) {
+        wrk->cmd.retval = worker_get_listing (wrk,
+                                              wrk->cmd.listing.wd,
+                                              &wrk->cmd.listing.entries,
+                                              &wrk->cmd.listing.size);
+        wrk->cmd.error = errno;
     } else {
         perror_msg ("Worker processing a command without a command - "
                     "something went wrong.");
@@ -156,34 +621,58 @@ process_command (worker *wrk)
     worker_cmd_wait (&wrk->cmd);
 }
 
+/**
+ * Let the user threads blocked in inotify_add_watch/inotify_rm_watch go on
+ * during a long directory diff and send the events collected so far.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+void
+worker_yield (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    send_events (wrk, 1);
+
+    char unused;
+    if (recv (wrk->io[KQUEUE_FD], &unused, 1, MSG_PEEK | MSG_DONTWAIT) == 1) {
+        process_command (wrk);
+    }
+}
+
 /** 
  * This structure represents a directory diff calculation context.
- * It is passed to dl_calculate as user data and then is used in all
+ * It is passed to dl_diff_close as user data and then is used in all
  * the callbacks.
  **/
 typedef struct {
     i_watch *iw;
     uint32_t fflags;
+    size_t processed;  /* number of entries processed since the last yield */
+    const name_filter *hidden; /* a filter replaced by iw->filter */
+    size_t created;    /* number of additions summarized */
+    size_t deleted;    /* number of removals summarized */
+    size_t moved;      /* number of renames summarized */
 } handle_context;
 
 /**
- * Copy type of item from old directory listing to a new one.
- * Do not produces any notifications.
- *
- * This function is used as a callback and is invoked from the dep-list
- * routines.
+ * Count an entry processed by a directory diff and yield to pending
+ * commands once per WORKER_SLICE entries. An entry may produce a couple
+ * of events, so the events are also sent as soon as IOV_MAX of them are
+ * queued.
  *
- * @param[in] udata   A pointer to user data (#handle_context).
- * @param[in] from_di The old name & inode number of the file.
- * @param[in] to_di   The new name & inode number of the file.
+ * @param[in] ctx A pointer to #handle_context.
  **/
 static void
-handle_unchanged (void *udata, dep_item *from_di, dep_item *to_di)
+handle_tick (handle_context *ctx)
 {
-    assert (udata != NULL);
+    worker *wrk = ctx->iw->wrk;
 
-    if (to_di->type == S_IFUNK) {
-        to_di->type = from_di->type;
+    if (++ctx->processed >= WORKER_SLICE) {
+        ctx->processed = 0;
+        worker_yield (wrk);
+    } else if (wrk->iovcnt - wrk->iovheld >= IOV_MAX) {
+        send_events (wrk, 1);
     }
 }
 
@@ -211,6 +700,31 @@ handle_added (void *udata, dep_item *di)
     } else
 #endif
     enqueue_event (ctx->iw, IN_CREATE, di);
+
+    handle_tick (ctx);
+}
+
+/**
+ * Stop watching a file which name has gone from a directory.
+ *
+ * Other names of the file in the directory keep it watched, unless the
+ * watch has IN_EXCL_UNLINK and the file has no links left: it may still
+ * be written through descriptors left open.
+ *
+ * @param[in] iw A pointer to #i_watch of the directory.
+ * @param[in] di File name & inode number of the removed file.
+ **/
+static void
+remove_subwatch (i_watch *iw, const dep_item *di)
+{
+    iwatch_del_subwatch (iw, di);
+
+    if (iwatch_root (iw)->flags & IN_EXCL_UNLINK) {
+        watch *w = watch_set_find (&iw->watches, di->inode);
+        if (w != NULL && w->flags & WF_ISSUBWATCH && is_deleted (w->fd)) {
+            watch_set_delete (&iw->watches, w);
+        }
+    }
 }
 
 /**
@@ -236,7 +750,9 @@ handle_removed (void *udata, dep_item *di)
     } else
 #endif
     enqueue_event (ctx->iw, IN_DELETE, di);
-    iwatch_del_subwatch (ctx->iw, di);
+    remove_subwatch (ctx->iw, di);
+
+    handle_tick (ctx);
 }
 
 /**
@@ -258,7 +774,7 @@ handle_replaced (void *udata, dep_item *di)
     handle_context *ctx = (handle_context *) udata;
     assert (ctx->iw != NULL);
 
-    iwatch_del_subwatch (ctx->iw, di);
+    remove_subwatch (ctx->iw, di);
 }
 
 /**
@@ -311,13 +827,15 @@ handle_moved (void *udata, dep_item *from_di, dep_item *to_di)
         to_di->type = from_di->type;
     }
 
+    iwatch_rename_subwatch (ctx->iw, to_di);
     enqueue_event (ctx->iw, IN_MOVED_FROM, from_di);
     enqueue_event (ctx->iw, IN_MOVED_TO, to_di);
+
+    handle_tick (ctx);
 }
 
 
 static const traverse_cbs cbs = {
-    handle_unchanged,
     handle_added,
     handle_removed,
     handle_replaced,
@@ -328,63 +846,796 @@ static const traverse_cbs cbs = {
     NULL, /* names_updated */
 };
 
+/* Callbacks for watches which do not need moves to be recognized */
+static const traverse_cbs membership_cbs = {
+    handle_added,
+    handle_removed,
+    NULL, /* replaced */
+    NULL, /* overwritten */
+    NULL, /* moved */
+    NULL, /* many_added */
+    NULL, /* many_removed */
+    NULL, /* names_updated */
+};
+
 /**
- * Detect and notify about the changes in the watched directory.
+ * Start watching a new file and count it for a summary.
  *
- * This function is top-level and it operates with other specific routines
- * to notify about different sets of events in a different conditions.
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
  *
- * @param[in] iw    A pointer to #i_watch.
- * @param[in] event A pointer to the received kqueue event.
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] di     File name & inode number of a new file.
  **/
-void
-produce_directory_diff (i_watch *iw, struct kevent *event)
+static void
+summary_added (void *udata, dep_item *di)
 {
-    assert (iw != NULL);
-    assert (event != NULL);
-
-    dep_list *was = NULL, *now = NULL;
-    was = iw->deps;
-    now = dl_listing (iw->wd);
-    if (now == NULL) {
-        perror_msg ("Failed to create a listing for watch %d", iw->wd);
-        return;
-    }
-
-    iw->deps = now;
+    assert (udata != NULL);
 
-    handle_context ctx;
-    memset (&ctx, 0, sizeof (ctx));
-    ctx.iw = iw;
-    ctx.fflags = event->fflags;
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->iw != NULL);
 
-    if (dl_calculate (was, now, &cbs, &ctx) == -1) {
-        iw->deps = was;
-        dl_free (now);
-        perror_msg ("Failed to produce directory diff for watch %d", iw->wd);
-    }
+    iwatch_add_subwatch (ctx->iw, di);
+    ++ctx->created;
+    handle_tick (ctx);
 }
 
 /**
- * Produce notifications about file system activity observer by a worker.
+ * Stop watching a removed file and count it for a summary.
  *
- * @param[in] wrk   A pointer to #worker.
- * @param[in] event A pointer to the associated received kqueue event.
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] di     File name & inode number of the removed file.
  **/
-void
-produce_notifications (worker *wrk, struct kevent *event)
+static void
+summary_removed (void *udata, dep_item *di)
 {
-    assert (wrk != NULL);
-    assert (event != NULL);
+    assert (udata != NULL);
 
-    watch *w = (watch *)event->udata;
-    assert (w != NULL);
-    assert (w->fd == event->ident);
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->iw != NULL);
 
-    i_watch *iw = w->iw;
-    assert (watch_set_find (&iw->watches, w->inode) == w);
+    remove_subwatch (ctx->iw, di);
+    ++ctx->deleted;
+    handle_tick (ctx);
+}
 
-    uint32_t flags = event->fflags;
+/**
+ * Reopen a watch for an overwritten file and count the removal and the
+ * addition for a summary.
+ *
+ * @param[in] udata   A pointer to user data (#handle_context).
+ * @param[in] from_di A file name & inode number of the deleted file.
+ * @param[in] to_di   A file name & inode number of the appeared file.
+ **/
+static void
+summary_overwritten (void *udata, dep_item *from_di, dep_item *to_di)
+{
+    summary_removed (udata, from_di);
+    summary_added (udata, to_di);
+}
+
+/**
+ * Rename a watch of a renamed file and count the rename for a summary.
+ *
+ * @param[in] udata   A pointer to user data (#handle_context).
+ * @param[in] from_di A old name & inode number of the file.
+ * @param[in] to_di   A new name & inode number of the file.
+ **/
+static void
+summary_moved (void *udata, dep_item *from_di, dep_item *to_di)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->iw != NULL);
+
+    if (to_di->type == S_IFUNK) {
+        to_di->type = from_di->type;
+    }
+
+    iwatch_rename_subwatch (ctx->iw, to_di);
+    ++ctx->moved;
+    handle_tick (ctx);
+}
+
+/* Callbacks for diffs reported with IN_SUMMARY */
+static const traverse_cbs summary_cbs = {
+    summary_added,
+    summary_removed,
+    handle_replaced,
+    summary_overwritten,
+    summary_moved,
+    NULL, /* many_added */
+    NULL, /* many_removed */
+    NULL, /* names_updated */
+};
+
+static const traverse_cbs summary_membership_cbs = {
+    summary_added,
+    summary_removed,
+    NULL, /* replaced */
+    NULL, /* overwritten */
+    NULL, /* moved */
+    NULL, /* many_added */
+    NULL, /* many_removed */
+    NULL, /* names_updated */
+};
+
+/**
+ * Queue an IN_SUMMARY record for a kind of events of a directory.
+ *
+ * @param[in] iw    A pointer to #i_watch of the directory.
+ * @param[in] mask  IN_CREATE, IN_DELETE, IN_MOVED_FROM or IN_MOVED_TO.
+ * @param[in] count Number of the events summarized.
+ **/
+static void
+enqueue_summary (i_watch *iw, uint32_t mask, size_t count)
+{
+    assert (iw != NULL);
+
+    if (count == 0 || !(iwatch_root (iw)->flags & mask)) {
+        return;
+    }
+
+    worker *wrk = iw->wrk;
+    int i = wrk->iovcnt;
+    enqueue_dir_event (iw, IN_SUMMARY | IN_Q_OVERFLOW | mask);
+
+    /* Both record formats start with the fields of struct inotify_event */
+    for (; i < wrk->iovcnt; i++) {
+        struct inotify_event *ev = wrk->iov[i].iov_base;
+        ev->cookie = count < UINT32_MAX ? count : UINT32_MAX;
+    }
+}
+
+/**
+ * Start watching a file shown by a new name filter or report a new file.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] di     File name & inode number of a file.
+ **/
+static void
+handle_shown (void *udata, dep_item *di)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->iw != NULL);
+
+    if (nf_skips (ctx->hidden, di->path)) {
+        iwatch_add_subwatch (ctx->iw, di);
+        handle_tick (ctx);
+    } else {
+        handle_added (udata, di);
+    }
+}
+
+/**
+ * Stop watching a file hidden by a new name filter or report a removed
+ * file.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] di     File name & inode number of a file.
+ **/
+static void
+handle_hidden (void *udata, dep_item *di)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    assert (ctx->iw != NULL);
+
+    if (nf_skips (iwatch_root (ctx->iw)->filter, di->path)) {
+        iwatch_del_subwatch (ctx->iw, di);
+        handle_tick (ctx);
+    } else {
+        handle_removed (udata, di);
+    }
+}
+
+/* Callbacks for directory diffs made on name filter changes */
+static const traverse_cbs filter_cbs = {
+    handle_shown,
+    handle_hidden,
+    NULL, /* replaced */
+    NULL, /* overwritten */
+    NULL, /* moved */
+    NULL, /* many_added */
+    NULL, /* many_removed */
+    NULL, /* names_updated */
+};
+
+/**
+ * Produce an IN_CREATE notification for a file created while the directory
+ * has not been watched.
+ *
+ * This function is used as a callback and is invoked from the dep-list
+ * routines. Subwatches are opened for the current listing beforehand.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] di     File name & inode number of a new file.
+ **/
+static void
+report_added (void *udata, dep_item *di)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    enqueue_event (ctx->iw, IN_CREATE, di);
+}
+
+/**
+ * Produce an IN_DELETE notification for a file removed while the directory
+ * has not been watched.
+ *
+ * @param[in] udata  A pointer to user data (#handle_context).
+ * @param[in] di     File name & inode number of the removed file.
+ **/
+static void
+report_removed (void *udata, dep_item *di)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+    enqueue_event (ctx->iw, IN_DELETE, di);
+}
+
+/**
+ * Produce an IN_DELETE/IN_CREATE notifications pair for a file overwritten
+ * while the directory has not been watched.
+ *
+ * @param[in] udata   A pointer to user data (#handle_context).
+ * @param[in] from_di A file name & inode number of the deleted file.
+ * @param[in] to_di   A file name & inode number of the appeared file.
+ **/
+static void
+report_overwritten (void *udata, dep_item *from_di, dep_item *to_di)
+{
+    report_removed (udata, from_di);
+    report_added (udata, to_di);
+}
+
+/**
+ * Produce an IN_MOVED_FROM/IN_MOVED_TO notifications pair for a file
+ * renamed while the directory has not been watched.
+ *
+ * @param[in] udata   A pointer to user data (#handle_context).
+ * @param[in] from_di A old name & inode number of the file.
+ * @param[in] to_di   A new name & inode number of the file.
+ **/
+static void
+report_moved (void *udata, dep_item *from_di, dep_item *to_di)
+{
+    assert (udata != NULL);
+
+    handle_context *ctx = (handle_context *) udata;
+
+    if (to_di->type == S_IFUNK) {
+        to_di->type = from_di->type;
+    }
+
+    enqueue_event (ctx->iw, IN_MOVED_FROM, from_di);
+    enqueue_event (ctx->iw, IN_MOVED_TO, to_di);
+}
+
+/* Callbacks for diffs against listings saved before the watch is added */
+static const traverse_cbs offline_cbs = {
+    report_added,
+    report_removed,
+    NULL, /* replaced, reported with the move */
+    report_overwritten,
+    report_moved,
+    NULL, /* many_added */
+    NULL, /* many_removed */
+    NULL, /* names_updated */
+};
+
+static const traverse_cbs offline_membership_cbs = {
+    report_added,
+    report_removed,
+    NULL, /* replaced */
+    NULL, /* overwritten */
+    NULL, /* moved */
+    NULL, /* many_added */
+    NULL, /* many_removed */
+    NULL, /* names_updated */
+};
+
+/**
+ * Report changes made in a directory while it has not been watched, i.e.
+ * since its listing has been saved with iwatch_snapshot_save.
+ *
+ * The watch must be set up for the current listing already, so only the
+ * notifications are produced.
+ *
+ * @param[in] iw     A pointer to #i_watch.
+ * @param[in] stored A saved listing of the directory. Freed by the function.
+ **/
+void
+produce_offline_changes (i_watch *iw, dep_list *stored)
+{
+    assert (iw != NULL);
+    assert (iw->deps != NULL);
+    assert (stored != NULL);
+
+    handle_context ctx;
+    memset (&ctx, 0, sizeof (ctx));
+    ctx.iw = iw;
+
+    const traverse_cbs *diff_cbs = &offline_cbs;
+    if (iwatch_diff_level (iw) != IW_DIFF_FULL) {
+        diff_cbs = &offline_membership_cbs;
+    }
+
+    /* dl_calculate moves the current listing to the stored one and
+     * brings it back to iw->deps on success */
+    if (dl_calculate (stored, iw->deps, diff_cbs, &ctx) == -1) {
+        perror_msg ("Failed to diff watch %d against its snapshot", iw->wd);
+        dl_free (stored);
+
+        /* The current listing may have been consumed halfway */
+        dep_list *deps = dl_listing (iw->wd, iw->reader);
+        if (deps != NULL) {
+            dl_free (iw->deps);
+            iw->deps = deps;
+        }
+    }
+}
+
+/**
+ * Read a watched directory in slices matching its entries against the
+ * previous listing and letting pending commands run between the slices.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ * @return A directory diff ready to be closed or NULL on failure or if
+ *     the watch has been closed meanwhile.
+ **/
+static dep_diff*
+produce_listing (i_watch *iw)
+{
+    assert (iw != NULL);
+
+    int ret;
+    dep_diff *dd = dl_diff_open (iw->wd, iw->reader, iw->deps);
+    if (dd == NULL) {
+        return NULL;
+    }
+
+    while ((ret = dl_diff_read (dd, WORKER_SLICE)) == 1) {
+        worker_yield (iw->wrk);
+        if (iw->is_closed) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == -1) {
+        dl_diff_abort (dd);
+        return NULL;
+    }
+    return dd;
+}
+
+/**
+ * Detect and notify about the changes in the watched directory.
+ *
+ * This function is top-level and it operates with other specific routines
+ * to notify about different sets of events in a different conditions.
+ *
+ * Pending commands are processed while diffing large directories, so the
+ * watch may be removed by the time the function returns. In this case the
+ * watch is not freed, but is detached from the worker.
+ *
+ * @param[in] iw    A pointer to #i_watch.
+ * @param[in] event A pointer to the received kqueue event.
+ * @param[in] dd    A directory diff read in advance or NULL. The diff is
+ *     owned by the function after the call.
+ * @return 0 on success, -1 if the watch has been removed and should be freed
+ *     by a caller.
+ **/
+int
+produce_directory_diff (i_watch *iw, struct kevent *event, dep_diff *dd)
+{
+    assert (iw != NULL);
+    assert (event != NULL);
+
+    worker *wrk = iw->wrk;
+    iwatch_diff_level_t level = iwatch_diff_level (iw);
+
+    /* The listing is brought up to date when the flags are changed */
+    if (level == IW_DIFF_NONE) {
+        if (dd != NULL) {
+            dl_diff_abort (dd);
+        }
+        iw->deps_stale = 1;
+        ++wrk->stats.diffs_skipped;
+        return 0;
+    }
+
+    wrk->diffed = iw;
+
+    if (dd == NULL && iwatch_snapshot_thaw (iw) == 0) {
+        dd = produce_listing (iw);
+    }
+    if (dd == NULL) {
+        if (!iw->is_closed) {
+            perror_msg ("Failed to create a listing for watch %d", iw->wd);
+            iwatch_resync_later (iw, IW_RESYNC_DIFF, 0);
+        }
+    } else {
+        handle_context ctx;
+        memset (&ctx, 0, sizeof (ctx));
+        ctx.iw = iw;
+        ctx.fflags = event->fflags;
+
+        const traverse_cbs *diff_cbs = &cbs;
+        if (level == IW_DIFF_FULL) {
+            ++wrk->stats.diffs_full;
+        } else {
+            diff_cbs = &membership_cbs;
+            ++wrk->stats.diffs_membership;
+        }
+
+        /* Large diffs are reported with a few IN_SUMMARY records */
+        size_t threshold = iwatch_root (iw)->summary_threshold;
+        int summary = threshold > 0 && dl_diff_changes (dd) > threshold;
+        if (summary) {
+            diff_cbs = level == IW_DIFF_FULL
+                ? &summary_cbs
+                : &summary_membership_cbs;
+        }
+
+        /* iw->deps is updated in place before any callback is invoked */
+        if (dl_diff_close (dd, diff_cbs, &ctx) == -1) {
+            perror_msg ("Failed to produce directory diff for watch %d",
+                        iw->wd);
+            iwatch_resync_later (iw, IW_RESYNC_FULL, 0);
+        } else if (summary && wrk->diffed == iw) {
+            enqueue_summary (iw, IN_CREATE, ctx.created);
+            enqueue_summary (iw, IN_DELETE, ctx.deleted);
+            enqueue_summary (iw, IN_MOVED_FROM, ctx.moved);
+            enqueue_summary (iw, IN_MOVED_TO, ctx.moved);
+        }
+        iwatch_snapshot_used (iw);
+    }
+
+    /* worker_remove resets the pointer when it detaches the watch */
+    if (wrk->diffed != iw) {
+        return -1;
+    }
+    wrk->diffed = NULL;
+    return 0;
+}
+
+/**
+ * Bring the listings of a directory and its watched subdirectories in line
+ * with a new name filter of the tree.
+ *
+ * @param[in] iw     A pointer to #i_watch of the directory.
+ * @param[in] hidden The filter replaced or NULL.
+ * @return 0 on success, -1 if the watch has been removed and should be freed
+ *     by a caller.
+ **/
+static int
+filter_directory (i_watch *iw, const name_filter *hidden)
+{
+    assert (iw != NULL);
+
+    worker *wrk = iw->wrk;
+
+    if (iwatch_diff_level (iw) == IW_DIFF_NONE) {
+        iw->deps_stale = 1;
+    } else if (iw->deps != NULL && !iw->deps_stale) {
+        wrk->diffed = iw;
+
+        dep_diff *dd = NULL;
+        if (iwatch_snapshot_thaw (iw) == 0) {
+            dd = produce_listing (iw);
+        }
+        if (dd == NULL) {
+            if (!iw->is_closed) {
+                perror_msg ("Failed to create a listing for watch %d",
+                            iw->wd);
+            }
+        } else {
+            handle_context ctx;
+            memset (&ctx, 0, sizeof (ctx));
+            ctx.iw = iw;
+            ctx.hidden = hidden;
+
+            if (dl_diff_close (dd, &filter_cbs, &ctx) == -1) {
+                perror_msg ("Failed to produce directory diff for watch %d",
+                            iw->wd);
+            }
+            iwatch_snapshot_used (iw);
+        }
+
+        if (wrk->diffed != iw) {
+            return -1;
+        }
+        wrk->diffed = NULL;
+    }
+
+    i_watch *child;
+    RB_FOREACH (child, iwatch_children, &iw->children) {
+        dr_set_filter (child->reader, iwatch_root (iw)->filter);
+        if (filter_directory (child, hidden) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Install a name filter set with libinotify_filter_watch and bring the
+ * directory listings in line with it.
+ *
+ * Files shown or hidden by the new filter are silently watched or
+ * unwatched. Other changes found meanwhile are reported as usual. The
+ * filter applies to all the subdirectories of a recursive watch.
+ *
+ * @param[in] iw A pointer to #i_watch with a filter to install.
+ * @return 0 on success, -1 if the watch has been removed and should be freed
+ *     by a caller.
+ **/
+static int
+install_filter (i_watch *iw)
+{
+    assert (iw != NULL);
+    assert (iw->filter_next != NULL);
+
+    name_filter *hidden = iw->filter;
+
+    iw->filter = iw->filter_next;
+    iw->filter_next = NULL;
+    dr_set_filter (iw->reader, iw->filter);
+
+    int retval = filter_directory (iw, hidden);
+    nf_free (hidden);
+    return retval;
+}
+
+/**
+ * Install name filters changed during a batch of kqueue events.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+install_filters (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    i_watch *iw;
+
+    /* Pending commands are processed while listing, so the list of
+     * watches is rescanned after every installed filter */
+    while (wrk->filters_changed) {
+        wrk->filters_changed = 0;
+        SLIST_FOREACH (iw, &wrk->head, next) {
+            if (iw->filter_next != NULL) {
+                if (install_filter (iw) == -1) {
+                    iwatch_free (iw);
+                } else {
+                    iwatch_walk (wrk);
+                }
+                wrk->filters_changed = 1;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Update watch flags changed while their trees have been diffed.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+update_flags (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    if (!wrk->flags_changed) {
+        return;
+    }
+    wrk->flags_changed = 0;
+
+    i_watch *iw;
+    SLIST_FOREACH (iw, &wrk->head, next) {
+        if (iw->flags_changed) {
+            iw->flags_changed = 0;
+            iwatch_update_flags (iw, iw->flags_next);
+        }
+    }
+}
+
+/**
+ * Re-derive events of a directory which have been lost.
+ *
+ * The events are bracketed with IN_RESYNC and IN_LISTED. Changes missed
+ * by the worker are found by diffing the directory against its listing.
+ * If entry events have been lost, IN_RESYNC carries IN_Q_OVERFLOW and all
+ * the entries are reported as created.
+ *
+ * @param[in] iw A pointer to #i_watch marked with iwatch_resync_later.
+ * @return 0 on success, -1 if the watch has been removed and should be freed
+ *     by a caller.
+ **/
+static int
+produce_resync (i_watch *iw)
+{
+    assert (iw != NULL);
+
+    iwatch_resync_t resync = iw->resync;
+    iw->resync = IW_RESYNC_NONE;
+
+    /* Listings which are not kept up to date produce no events at all */
+    if (iwatch_diff_level (iw) == IW_DIFF_NONE) {
+        return 0;
+    }
+
+    if (resync == IW_RESYNC_DIFF) {
+        enqueue_dir_event (iw, IN_RESYNC);
+    }
+
+    struct kevent event;
+    memset (&event, 0, sizeof (event));
+    if (produce_directory_diff (iw, &event, NULL) == -1) {
+        return -1;
+    }
+    iwatch_walk (iw->wrk);
+
+    if (resync == IW_RESYNC_FULL) {
+        enqueue_dir_event (iw, IN_RESYNC | IN_Q_OVERFLOW);
+        if (iwatch_snapshot_thaw (iw) == 0) {
+            size_t i;
+            for (i = 0; i < iw->deps->count; i++) {
+                enqueue_event (iw, IN_CREATE, dl_item (iw->deps, i));
+            }
+        }
+    }
+
+    enqueue_dir_event (iw, IN_LISTED);
+    flush_events (iw->wrk);
+    return 0;
+}
+
+/**
+ * Re-derive lost events of the directories marked during a batch of kqueue
+ * events.
+ *
+ * Directories which fail again are retried after the next batch.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+resync_watches (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    if (!wrk->resync_pending) {
+        return;
+    }
+    wrk->resync_pending = 0;
+
+    i_watch *iw, *dir;
+    size_t left = 0;
+    SLIST_FOREACH (iw, &wrk->head, next) {
+        iwatch_next_resync (iw, &left);
+    }
+
+    /* Pending commands are processed while diffing, so the watches are
+     * rescanned after every directory */
+    while (left > 0) {
+        dir = NULL;
+        SLIST_FOREACH (iw, &wrk->head, next) {
+            dir = iwatch_next_resync (iw, NULL);
+            if (dir != NULL) {
+                break;
+            }
+        }
+        if (dir == NULL) {
+            break;
+        }
+
+        --left;
+        if (produce_resync (dir) == -1) {
+            /* The watch has been removed while diffing */
+            flush_events (wrk);
+            iwatch_free (iwatch_root (dir));
+        }
+    }
+}
+
+/**
+ * Check if a kqueue event will cause a directory diff calculation.
+ *
+ * @param[in] w     A pointer to the watch which received the event.
+ * @param[in] event A pointer to the received kqueue event.
+ * @return 1 if directory should be relisted, 0 otherwise.
+ **/
+static int
+needs_directory_diff (const watch *w, const struct kevent *event)
+{
+    return (event->fflags & NOTE_WRITE
+            && S_ISDIR (w->flags)
+            && !(w->flags & WF_ISSUBWATCH));
+}
+
+/**
+ * Take the new size of a modified regular file to be sent with IN_MODIFY.
+ *
+ * @param[in]  w       A pointer to the watch of the file.
+ * @param[in]  i_flags Inotify events to be queued.
+ * @param[out] sizes   The new and the previous sizes of the file, -1 if
+ *     sizes are not tracked.
+ **/
+static void
+track_size (watch *w, uint32_t i_flags, int64_t sizes[2])
+{
+    sizes[0] = -1;
+    sizes[1] = -1;
+
+    uint32_t flags = iwatch_root (w->iw)->flags;
+    if (!(i_flags & IN_MODIFY)
+        || !(flags & IN_MODIFY)
+        || !(flags & IN_TRACK_SIZE)
+        || !S_ISREG (w->flags)) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat (w->fd, &st) == -1) {
+        perror_msg ("Failed to stat modified file %d", w->fd);
+        return;
+    }
+
+    sizes[0] = st.st_size;
+    sizes[1] = w->size;
+    w->size = st.st_size;
+}
+
+/**
+ * Produce notifications about file system activity observer by a worker.
+ *
+ * @param[in] wrk     A pointer to #worker.
+ * @param[in] event   A pointer to the associated received kqueue event.
+ * @param[in] diff    A diff of the watched directory read in advance or
+ *     NULL. The diff is owned by the function after the call.
+ **/
+void
+produce_notifications (worker *wrk, struct kevent *event, dep_diff *diff)
+{
+    assert (wrk != NULL);
+    assert (event != NULL);
+
+    watch *w = (watch *)event->udata;
+    assert (w != NULL);
+    assert (w->fd == event->ident);
+
+    i_watch *iw = w->iw;
+    assert (watch_set_find (&iw->watches, w->inode) == w);
+
+    /* The subtree has been moved out of its directory during the batch
+     * and waits for the walk to be reattached or freed. The changes are
+     * re-derived if it is reattached */
+    if (iwatch_root (iw)->detached_from != NULL) {
+        if (needs_directory_diff (w, event)) {
+            iwatch_resync_later (iw, IW_RESYNC_DIFF, 0);
+        }
+        if (diff != NULL) {
+            dl_diff_abort (diff);
+        }
+        return;
+    }
+
+    uint32_t flags = event->fflags;
 
     if (flags & NOTE_WRITE) {
         w->flags |= WF_MODIFIED;
@@ -397,14 +1648,23 @@ produce_notifications (worker *wrk, struct kevent *event)
                 w->flags |= WF_DELETED;
         }
 
-        if (flags & NOTE_WRITE && S_ISDIR (w->flags)) {
-            produce_directory_diff (iw, event);
+        if (needs_directory_diff (w, event)) {
+            int retval = produce_directory_diff (iw, event, diff);
+            diff = NULL;
+            if (retval == -1) {
+                /* The watch has been removed while diffing */
+                flush_events (wrk);
+                iwatch_free (iwatch_root (iw));
+                return;
+            }
         }
 
 #if ! defined (DIRECTORY_LISTING_REWINDS) && \
+    ! defined (DL_LISTING_IN_PLACE) && \
     defined (NOTE_OPEN) && defined (NOTE_CLOSE)
         /* Mask events produced by open/closedir calls while directory diffing.
-         * Kqueue coalesces both events as kevent is not called that time */
+         * Kqueue coalesces both events as kevent is not called that time.
+         * Listings made in place do not open the directory at all */
         if (flags & (NOTE_OPEN | NOTE_CLOSE)
           && S_ISDIR (w->flags) && w->flags & WF_MODIFIED) {
             flags &= ~(NOTE_OPEN | NOTE_CLOSE);
@@ -412,35 +1672,203 @@ produce_notifications (worker *wrk, struct kevent *event)
         }
 #endif
 
-        enqueue_event (iw, kqueue_to_inotify (flags, w->flags), NULL);
+        if (iw->parent == NULL) {
+            uint32_t i_flags = kqueue_to_inotify (flags, w->flags);
+            int64_t sizes[2];
+            track_size (w, i_flags, sizes);
+            enqueue_event_sized (iw, i_flags, NULL, sizes);
 
-        if (w->flags & WF_DELETED || flags & NOTE_REVOKE) {
-            iw->is_closed = 1;
+            if (w->flags & WF_DELETED || flags & NOTE_REVOKE) {
+                iw->is_closed = 1;
+            }
+        } else {
+            /* A subdirectory of a recursive watch is reported as an entry
+             * of its parent. Removal is left to the parent`s diff */
+            uint32_t i_flags = kqueue_to_inotify (flags,
+                                                  w->flags | WF_ISSUBWATCH);
+            enqueue_dir_event (iw, i_flags);
         }
+    } else if (iw->flags & IN_EXCL_UNLINK && is_deleted (w->fd)) {
+        /* An unlinked file is still written through the descriptors
+         * left open. Stop watching it before its directory is diffed,
+         * the entry is removed from the listing on the diff anyway */
+        watch_set_delete (&iw->watches, w);
+        w = NULL;
     } else {
         uint32_t i_flags = kqueue_to_inotify (flags, w->flags);
-        dep_node *iter = NULL;
-        SLIST_FOREACH (iter, &iw->deps->head, next) {
-            dep_item *di = iter->item;
-
-            if (di->inode == w->inode) {
-                enqueue_event (iw, i_flags, di);
-            }
+        int64_t sizes[2];
+        track_size (w, i_flags, sizes);
+        size_t i, n;
+        size_t first = dl_find (iw->deps, w->inode, &n);
+        for (i = first; i < first + n; i++) {
+            enqueue_event_sized (iw, i_flags, dl_item (iw->deps, i), sizes);
         }
     }
-    flush_events (wrk);
+
+    if (diff != NULL) {
+        dl_diff_abort (diff);
+    }
 
 #ifdef NOTE_CLOSE
-    if (flags & NOTE_CLOSE) {
+    if (w != NULL && flags & NOTE_CLOSE) {
         w->flags &= ~WF_MODIFIED;
     }
 #endif
 
+    iw = iwatch_root (iw);
     if (iw->is_closed) {
         worker_remove (wrk, iw->wd);
     }
 }
 
+/**
+ * This structure represents a directory listing to be made by a helper
+ * thread on behalf of a worker.
+ **/
+typedef struct {
+    i_watch *iw;   /* the watched directory */
+    dep_diff *dd;  /* the resulting diff */
+} listing_task;
+
+/**
+ * Read a directory and match it against the previous listing. Invoked
+ * from the helper threads. No callbacks are invoked at this stage.
+ *
+ * @param[in] arg A pointer to #listing_task.
+ **/
+static void
+listing_task_run (void *arg)
+{
+    listing_task *lt = (listing_task *) arg;
+
+    lt->dd = dl_diff_open (lt->iw->wd, lt->iw->reader, lt->iw->deps);
+    if (lt->dd != NULL && dl_diff_read (lt->dd, SIZE_MAX) == -1) {
+        dl_diff_abort (lt->dd);
+        lt->dd = NULL;
+    }
+}
+
+/**
+ * List all the watched directories changed in a batch of kqueue events
+ * concurrently.
+ *
+ * Listings of different directories do not depend on each other, so they
+ * are made and matched against the previous listings on a helper pool.
+ * Changes are reported later on the worker thread in the order the events
+ * have been received.
+ *
+ * @param[in]  wrk      A pointer to #worker.
+ * @param[in]  events   An array of received kqueue events.
+ * @param[in]  nevents  Number of received kqueue events.
+ * @param[out] listings An array of diffs, one item per event. Items not
+ *     related to directory changes are set to NULL.
+ **/
+static void
+prefetch_listings (worker *wrk,
+                   struct kevent *events,
+                   int nevents,
+                   dep_diff **listings)
+{
+    listing_task tasks[WORKER_NEVENTS];
+    void *args[WORKER_NEVENTS];
+    int index[WORKER_NEVENTS];
+    size_t ntasks = 0;
+    size_t j;
+    int i;
+
+    for (i = 0; i < nevents; i++) {
+        listings[i] = NULL;
+
+        watch *w = (watch *) events[i].udata;
+        if (events[i].ident == wrk->io[KQUEUE_FD]
+            || w == NULL
+            || !needs_directory_diff (w, &events[i])) {
+            continue;
+        }
+
+        /* Large directories are listed by the worker in slices to not
+         * block inotify_add_watch/inotify_rm_watch callers for long */
+        if (w->iw->deps->count > WORKER_SLICE) {
+            continue;
+        }
+
+        /* Frozen listings are unpacked by the worker on demand */
+        if (w->iw->deps->frozen) {
+            continue;
+        }
+
+        /* Nobody is interested in the changes */
+        if (iwatch_diff_level (w->iw) == IW_DIFF_NONE) {
+            continue;
+        }
+
+        tasks[ntasks].iw = w->iw;
+        tasks[ntasks].dd = NULL;
+        args[ntasks] = &tasks[ntasks];
+        index[ntasks] = i;
+        ++ntasks;
+    }
+
+    /* A single directory is listed by the worker itself */
+    if (ntasks < 2) {
+        return;
+    }
+
+    pool_run (listing_task_run, args, ntasks);
+
+    for (j = 0; j < ntasks; j++) {
+        listings[index[j]] = tasks[j].dd;
+    }
+}
+
+/**
+ * Decide whether the events of a batch may wait for the next batches and
+ * set a timer to send them no later than IN_BATCH_DELAY allows.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @return 1 if the events are held back, 0 if they must be sent now.
+ **/
+static int
+hold_events (worker *wrk)
+{
+    assert (wrk != NULL);
+
+    if (wrk->batch_delay == 0 || wrk->iovcnt == 0) {
+        return 0;
+    }
+
+    if (wrk->batch_bytes != 0 && wrk->iovbytes >= wrk->batch_bytes) {
+        return 0;
+    }
+
+    /* A single writev(2) sends up to IOV_MAX events */
+    if (wrk->iovcnt >= IOV_MAX) {
+        return 0;
+    }
+
+    if (wrk->batch_armed) {
+        return 1;
+    }
+
+    /* The timer counts from the oldest event held back */
+    struct kevent ev;
+    EV_SET (&ev,
+            wrk->kq,
+            EVFILT_TIMER,
+            EV_ADD | EV_ONESHOT,
+            0,
+            wrk->batch_delay,
+            0);
+
+    if (kevent (wrk->kq, &ev, 1, NULL, 0, NULL) == -1) {
+        perror_msg ("Failed to set a batch timer");
+        return 0;
+    }
+
+    wrk->batch_armed = 1;
+    return 1;
+}
+
 /**
  * The worker thread command loop.
  *
@@ -453,36 +1881,84 @@ worker_thread (void *arg)
     assert (arg != NULL);
     worker* wrk = (worker *) arg;
 
-    for (;;) {
-        struct kevent received;
+    struct kevent received[WORKER_NEVENTS];
+    dep_diff *listings[WORKER_NEVENTS];
+    int i, j, expired;
 
-        int ret = kevent (wrk->kq, NULL, 0, &received, 1, NULL);
+    for (;;) {
+        int ret = kevent (wrk->kq, NULL, 0, received, WORKER_NEVENTS, NULL);
         if (ret == -1) {
             perror_msg ("kevent failed");
             continue;
         }
 
-        if (received.ident == wrk->io[KQUEUE_FD]) {
-            if (received.flags & EV_EOF) {
-                wrk->closed = 1;
-                wrk->io[INOTIFY_FD] = -1;
-                worker_erase (wrk);
-
-                if (pthread_mutex_trylock (&wrk->mutex) == 0) {
-                    pthread_mutex_unlock (&wrk->mutex);
-                    worker_free (wrk);
+        if (wrk->extended) {
+            wrk->received = monotonic_ns ();
+        }
+        wrk->events = received;
+        wrk->nevents = ret;
+        prefetch_listings (wrk, received, ret, listings);
+
+        expired = 0;
+        for (i = 0; i < ret; i++) {
+            if (received[i].filter == EVFILT_TIMER) {
+                wrk->batch_armed = 0;
+                expired = 1;
+            } else if (received[i].ident == wrk->io[KQUEUE_FD]) {
+                if (received[i].flags & EV_EOF) {
+                    for (j = i; j < ret; j++) {
+                        if (listings[j] != NULL) {
+                            dl_diff_abort (listings[j]);
+                        }
+                    }
+                    wrk->events = NULL;
+                    wrk->nevents = 0;
+
+                    wrk->closed = 1;
+                    wrk->io[INOTIFY_FD] = -1;
+                    worker_erase (wrk);
+
+                    if (pthread_mutex_trylock (&wrk->mutex) == 0) {
+                        pthread_mutex_unlock (&wrk->mutex);
+                        worker_free (wrk);
+                    }
+                    /* If we could not lock on a worker, it means that an
+                     * inotify call (add_watch/rm_watch) has already locked
+                     * it. In this case worker will be freed by a caller
+                     * (caller checks the `closed' flag. */
+                    return NULL;
+                } else {
+                    process_command (wrk);
                 }
-                /* If we could not lock on a worker, it means that an inotify
-                 * call (add_watch/rm_watch) has already locked it. In this
-                 * case worker will be freed by a caller (caller checks the
-                 * `closed' flag. */
-                return NULL;
-            } else {
-                process_command (wrk);
+            } else if ((watch *) received[i].udata != NULL) {
+                produce_notifications (wrk, &received[i], listings[i]);
+            } else if (listings[i] != NULL) {
+                /* The watch has been removed while processing the batch */
+                dl_diff_abort (listings[i]);
             }
-        } else {
-            produce_notifications (wrk, &received);
         }
+
+        wrk->events = NULL;
+        wrk->nevents = 0;
+
+        /* Subtrees of new subdirectories of recursive watches are watched
+         * after all the diffs, so subdirectories moved within the trees
+         * are found at both ends */
+        iwatch_walk (wrk);
+
+        /* Events of the whole batch are sent at once, so a file renamed
+         * between two watched directories is reported as moved. With
+         * IN_BATCH_DELAY set, the following batches are joined too */
+        if (expired || !hold_events (wrk)) {
+            flush_events (wrk);
+        }
+
+        /* No diffs are in flight now, so listings can be replaced and
+         * packed safely */
+        install_filters (wrk);
+        resync_watches (wrk);
+        update_flags (wrk);
+        iwatch_evict_cold (wrk);
     }
     return NULL;
 }
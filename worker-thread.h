@@ -31,5 +31,8 @@
 void* worker_thread (void *arg);
 int   enqueue_event (i_watch *iw, uint32_t mask, const dep_item *di);
 void  flush_events  (worker *wrk);
+void  discard_kevents (worker *wrk, const watch *w);
+void  worker_yield  (worker *wrk);
+void  produce_offline_changes (i_watch *iw, dep_list *stored);
 
 #endif /* __WORKER_THREAD_H__ */
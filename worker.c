@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h> /* open() */
+#include <limits.h> /* INT_MAX */
 #include <unistd.h> /* close() */
 #include <assert.h>
 #include <stdio.h>
@@ -94,6 +95,120 @@ worker_cmd_remove (worker_cmd *cmd, int watch_id)
     cmd->rm_id = watch_id;
 }
 
+/**
+ * Prepare a command with the data of the libinotify_filter_watch() call.
+ *
+ * @param[in] cmd      A pointer to #worker_cmd
+ * @param[in] watch_id The identificator of a watch to filter.
+ * @param[in] kind     IN_FILTER_EXCLUDE or IN_FILTER_INCLUDE.
+ * @param[in] pattern  A glob pattern or NULL to remove the filters.
+ **/
+void
+worker_cmd_filter (worker_cmd *cmd,
+                   int watch_id,
+                   int kind,
+                   const char *pattern)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_FILTER;
+    cmd->filter.wd = watch_id;
+    cmd->filter.kind = kind;
+    cmd->filter.pattern = pattern;
+}
+
+/**
+ * Prepare a command with the data of the libinotify_checkpoint() call.
+ *
+ * @param[in] cmd A pointer to #worker_cmd
+ * @param[in] dir A directory to save snapshots to or NULL.
+ **/
+void
+worker_cmd_checkpoint (worker_cmd *cmd, const char *dir)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_CHECKPOINT;
+    cmd->snapshot_dir = dir;
+}
+
+/**
+ * Prepare a command with the data of the libinotify_get_listing() call.
+ *
+ * @param[in] cmd      A pointer to #worker_cmd
+ * @param[in] watch_id The identificator of a watch to list.
+ **/
+void
+worker_cmd_listing (worker_cmd *cmd, int watch_id)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_LISTING;
+    cmd->listing.wd = watch_id;
+    cmd->listing.entries = NULL;
+    cmd->listing.size = 0;
+}
+
+/**
+ * Prepare a command with the data of the libinotify_resync() call.
+ *
+ * @param[in] cmd      A pointer to #worker_cmd
+ * @param[in] watch_id The identificator of a watch to resync.
+ **/
+void
+worker_cmd_resync (worker_cmd *cmd, int watch_id)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_RESYNC;
+    cmd->resync_id = watch_id;
+}
+
+/**
+ * Prepare a command with the data of the libinotify_set_watch_param() call.
+ *
+ * @param[in] cmd      A pointer to #worker_cmd
+ * @param[in] watch_id The identificator of a watch.
+ * @param[in] param    A parameter to set.
+ * @param[in] value    A new value of the parameter.
+ **/
+void
+worker_cmd_watch_param (worker_cmd *cmd,
+                        int watch_id,
+                        int param,
+                        intptr_t value)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_WATCH_PARAM;
+    cmd->watch_param.wd = watch_id;
+    cmd->watch_param.param = param;
+    cmd->watch_param.value = value;
+}
+
+/**
+ * Prepare a command with the data of the libinotify_set_param() call.
+ *
+ * @param[in] cmd   A pointer to #worker_cmd
+ * @param[in] param A parameter to set.
+ * @param[in] value A new value of the parameter.
+ **/
+void
+worker_cmd_param (worker_cmd *cmd, int param, intptr_t value)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_PARAM;
+    cmd->param.param = param;
+    cmd->param.value = value;
+}
+
 /**
  * Reset the worker command.
  *
@@ -194,6 +309,8 @@ worker_create (int flags)
     sigset_t set, oset;
     int result;
 
+    watch_flags_init ();
+
     worker* wrk = calloc (1, sizeof (worker));
 
     if (wrk == NULL) {
@@ -203,7 +320,16 @@ worker_create (int flags)
 
     wrk->iovalloc = 0;
     wrk->iovcnt = 0;
+    wrk->iovheld = 0;
     wrk->iov = NULL;
+    wrk->events = NULL;
+    wrk->nevents = 0;
+    wrk->diffed = NULL;
+    wrk->extended = (flags & IN_EXTENDED) != 0;
+    wrk->iovbytes = 0;
+    wrk->batch_delay = 0;
+    wrk->batch_bytes = 0;
+    wrk->batch_armed = 0;
     wrk->io[INOTIFY_FD] = -1;
     wrk->io[KQUEUE_FD] = -1;
 
@@ -219,6 +345,9 @@ worker_create (int flags)
     }
 
     SLIST_INIT (&wrk->head);
+    TAILQ_INIT (&wrk->snapshots);
+    TAILQ_INIT (&wrk->unwalked);
+    TAILQ_INIT (&wrk->detached);
 
     EV_SET (&ev,
             wrk->io[KQUEUE_FD],
@@ -287,9 +416,17 @@ worker_free (worker *wrk)
     }
 
     close (wrk->kq);
+    wrk->kq = -1;
     wrk->closed = 1;
 
     worker_cmd_release (&wrk->cmd);
+
+    /* Keep listings to report changes made while nothing is watched */
+    if (wrk->snapshot_dir != NULL) {
+        worker_checkpoint (wrk, wrk->snapshot_dir);
+        free (wrk->snapshot_dir);
+    }
+
     while (!SLIST_EMPTY (&wrk->head)) {
         iw = SLIST_FIRST (&wrk->head);
         SLIST_REMOVE_HEAD (&wrk->head, next);
@@ -300,6 +437,7 @@ worker_free (worker *wrk)
         free (wrk->iov[i].iov_base);
     }
     free (wrk->iov);
+    free (wrk->origins);
     pthread_mutex_destroy (&wrk->mutex);
 
     free (wrk);
@@ -321,6 +459,12 @@ worker_add_or_modify (worker     *wrk,
     assert (path != NULL);
     assert (wrk != NULL);
 
+    /* File sizes are sent with extended event records only */
+    if (flags & IN_TRACK_SIZE && !wrk->extended) {
+        errno = EINVAL;
+        return -1;
+    }
+
     /* Open inotify watch descriptor */
     int fd = iwatch_open (path, flags);
     if (fd == -1) {
@@ -339,7 +483,14 @@ worker_add_or_modify (worker     *wrk,
     SLIST_FOREACH (iw, &wrk->head, next) {
         if (iw->inode == st.st_ino && iw->dev == st.st_dev) {
             close (fd);
-            iwatch_update_flags (iw, flags);
+            if (iw->flags_changed
+                || (wrk->diffed != NULL && iwatch_root (wrk->diffed) == iw)) {
+                /* The tree is being diffed (see worker_yield) or an
+                 * earlier update is waiting for the diff to complete */
+                iwatch_defer_flags (iw, flags);
+            } else {
+                iwatch_update_flags (iw, flags);
+            }
             return iw->wd;
         }
     }
@@ -354,6 +505,9 @@ worker_add_or_modify (worker     *wrk,
     /* add inotify watch to worker`s watchlist */
     SLIST_INSERT_HEAD (&wrk->head, iw, next);
 
+    /* Send changes found against a saved snapshot */
+    flush_events (wrk);
+
     return iw->wd;
 }
 
@@ -378,7 +532,254 @@ worker_remove (worker *wrk,
             enqueue_event (iw, IN_IGNORED, NULL);
             flush_events (wrk);
             SLIST_REMOVE (&wrk->head, iw, i_watch, next);
-            iwatch_free (iw);
+            if (wrk->diffed != NULL && iwatch_root (wrk->diffed) == iw) {
+                /* The watch is removed from inside of its own directory
+                 * diff or a diff of its subdirectory (see worker_yield).
+                 * Leave freeing to the diff. */
+                iw->is_closed = 1;
+                wrk->diffed = NULL;
+            } else {
+                iwatch_free (iw);
+            }
+            return 0;
+        }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Add a name filter pattern to a directory watch.
+ *
+ * @param[in] wrk     A pointer to #worker.
+ * @param[in] id      An ID of the watch.
+ * @param[in] kind    IN_FILTER_EXCLUDE or IN_FILTER_INCLUDE.
+ * @param[in] pattern A glob pattern or NULL to remove all the patterns.
+ * @return 0 on success, -1 of failure.
+ **/
+int
+worker_filter (worker     *wrk,
+               int         id,
+               int         kind,
+               const char *pattern)
+{
+    assert (wrk != NULL);
+
+    if (kind != IN_FILTER_EXCLUDE && kind != IN_FILTER_INCLUDE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    i_watch *iw;
+    SLIST_FOREACH (iw, &wrk->head, next) {
+        if (iw->wd == id) {
+            return iwatch_add_filter (iw,
+                                      kind == IN_FILTER_INCLUDE
+                                      ? NF_INCLUDE : NF_EXCLUDE,
+                                      pattern);
+        }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Save listings of all the directory watches to a snapshot directory and
+ * remember the directory.
+ *
+ * Watches added later are diffed against snapshots found there, and
+ * the snapshots are saved again when the worker is freed.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] dir A directory to keep snapshots in or NULL to stop using
+ *     snapshots.
+ * @return 0 on success, -1 if some of the snapshots have not been saved.
+ **/
+int
+worker_checkpoint (worker *wrk, const char *dir)
+{
+    assert (wrk != NULL);
+
+    if (dir == NULL) {
+        free (wrk->snapshot_dir);
+        wrk->snapshot_dir = NULL;
+        return 0;
+    }
+
+    if (wrk->snapshot_dir != dir) {
+        char *copy = strdup (dir);
+        if (copy == NULL) {
+            return -1;
+        }
+        free (wrk->snapshot_dir);
+        wrk->snapshot_dir = copy;
+    }
+
+    int retval = 0, error = 0;
+    i_watch *iw;
+    SLIST_FOREACH (iw, &wrk->head, next) {
+        if (iwatch_snapshot_save (iw, dir) == -1) {
+            retval = -1;
+            error = errno;
+        }
+    }
+
+    errno = error;
+    return retval;
+}
+
+/**
+ * Report all the entries of a watched tree once more, e.g. after a user
+ * has dropped some of the events.
+ *
+ * The entries are reported at the end of the current batch of kqueue
+ * events, see resync_watches.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] id  An ID of the watch.
+ * @return 0 on success, -1 of failure.
+ **/
+int
+worker_resync (worker *wrk, int id)
+{
+    assert (wrk != NULL);
+
+    i_watch *iw;
+    SLIST_FOREACH (iw, &wrk->head, next) {
+
+        if (iw->wd == id) {
+            if (iw->deps == NULL) {
+                errno = ENOTDIR;
+                return -1;
+            }
+            iwatch_resync_later (iw, IW_RESYNC_FULL, 1);
+            return 0;
+        }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Set a parameter of a watch.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] id    An ID of the watch.
+ * @param[in] param A parameter to set, IN_SUMMARY_THRESHOLD.
+ * @param[in] value A new value of the parameter.
+ * @return 0 on success, -1 of failure.
+ **/
+int
+worker_set_watch_param (worker   *wrk,
+                        int       id,
+                        int       param,
+                        intptr_t  value)
+{
+    assert (wrk != NULL);
+
+    i_watch *iw;
+    SLIST_FOREACH (iw, &wrk->head, next) {
+
+        if (iw->wd == id) {
+            switch (param) {
+            case IN_SUMMARY_THRESHOLD:
+                if (value < 0) {
+                    break;
+                }
+                iw->summary_threshold = value;
+                return 0;
+            default:
+                break;
+            }
+            break;
+        }
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Set a parameter of the instance.
+ *
+ * Events held back are sent at once when batching is relaxed, the next
+ * batch follows the new limits.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] param A parameter to set, IN_BATCH_DELAY or IN_BATCH_BYTES.
+ * @param[in] value A new value of the parameter.
+ * @return 0 on success, -1 of failure.
+ **/
+int
+worker_set_param (worker *wrk, int param, intptr_t value)
+{
+    assert (wrk != NULL);
+
+    if (value < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (param) {
+    case IN_BATCH_DELAY:
+        if (value > INT_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        wrk->batch_delay = value;
+        break;
+    case IN_BATCH_BYTES:
+        wrk->batch_bytes = value;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    flush_events (wrk);
+    return 0;
+}
+
+/**
+ * Copy the directory listing of a watch and mark the point in the event
+ * stream the listing corresponds to with IN_LISTED.
+ *
+ * @param[in]  wrk     A pointer to #worker.
+ * @param[in]  id      An ID of the watch.
+ * @param[out] entries A newly allocated buffer of inotify_dirent records.
+ * @param[out] size    Number of bytes in the buffer.
+ * @return 0 on success, -1 of failure.
+ **/
+int
+worker_get_listing (worker  *wrk,
+                    int      id,
+                    void   **entries,
+                    size_t  *size)
+{
+    assert (wrk != NULL);
+    assert (entries != NULL);
+    assert (size != NULL);
+
+    i_watch *iw;
+    SLIST_FOREACH (iw, &wrk->head, next) {
+
+        if (iw->wd == id) {
+            if (wrk->diffed != NULL && iwatch_root (wrk->diffed) == iw) {
+                /* The listing is updated ahead of the events of a diff
+                 * being made (see worker_yield) */
+                errno = EAGAIN;
+                return -1;
+            }
+
+            void *buf = iwatch_listing (iw, size);
+            if (buf == NULL) {
+                return -1;
+            }
+            if (enqueue_event (iw, IN_LISTED, NULL) == -1) {
+                free (buf);
+                return -1;
+            }
+            flush_events (wrk);
+            *entries = buf;
             return 0;
         }
     }
@@ -39,10 +39,27 @@ typedef struct worker worker;
 #define INOTIFY_FD 0
 #define KQUEUE_FD  1
 
+/* Maximal number of kqueue events received by a worker at once */
+#define WORKER_NEVENTS 64
+
+/* Number of directory entries listed or diffed by a worker between checks
+ * for pending inotify_add_watch/inotify_rm_watch calls */
+#define WORKER_SLICE 1024
+
+/* Maximal number of unpaired removals and additions kept back by a worker
+ * when events are sent in the middle of a batch, see pair_moves */
+#define WORKER_MOVES_HELD 4096
+
 typedef enum {
     WCMD_NONE = 0,   /* uninitialized state */
     WCMD_ADD,        /* add or modify a watch */
     WCMD_REMOVE,     /* remove a watch */
+    WCMD_FILTER,     /* change name filters of a watch */
+    WCMD_CHECKPOINT, /* save directory listings to a snapshot directory */
+    WCMD_LISTING,    /* copy a directory listing of a watch */
+    WCMD_RESYNC,     /* report a watched tree once more */
+    WCMD_WATCH_PARAM, /* set a parameter of a watch */
+    WCMD_PARAM,      /* set a parameter of the instance */
 } worker_cmd_type_t;
 
 /**
@@ -61,6 +78,33 @@ typedef struct worker_cmd {
         } add;
 
         int rm_id;
+
+        int resync_id;
+
+        struct {
+            int wd;
+            int kind;
+            const char *pattern;
+        } filter;
+
+        const char *snapshot_dir;
+
+        struct {
+            int wd;
+            void *entries;
+            size_t size;
+        } listing;
+
+        struct {
+            int wd;
+            int param;
+            intptr_t value;
+        } watch_param;
+
+        struct {
+            int param;
+            intptr_t value;
+        } param;
     };
 
     pthread_barrier_t sync;
@@ -69,18 +113,78 @@ typedef struct worker_cmd {
 void worker_cmd_init    (worker_cmd *cmd);
 void worker_cmd_add     (worker_cmd *cmd, const char *filename, uint32_t mask);
 void worker_cmd_remove  (worker_cmd *cmd, int watch_id);
+void worker_cmd_filter  (worker_cmd *cmd,
+                         int watch_id,
+                         int kind,
+                         const char *pattern);
+void worker_cmd_checkpoint (worker_cmd *cmd, const char *dir);
+void worker_cmd_listing (worker_cmd *cmd, int watch_id);
+void worker_cmd_resync  (worker_cmd *cmd, int watch_id);
+void worker_cmd_watch_param (worker_cmd *cmd,
+                             int watch_id,
+                             int param,
+                             intptr_t value);
+void worker_cmd_param   (worker_cmd *cmd, int param, intptr_t value);
 void worker_cmd_wait    (worker_cmd *cmd);
 void worker_cmd_release (worker_cmd *cmd);
 
+/**
+ * Counters of directory diffs made by a worker. Updated by the worker
+ * thread only, without locking. libinotify_get_param reads them with the
+ * worker mutex held, which keeps the worker from being freed but does not
+ * stop the updates, so the values read are approximate.
+ **/
+typedef struct worker_stats {
+    size_t diffs_full;       /* diffs with moves and overwrites recognized */
+    size_t diffs_membership; /* diffs with additions and removals only */
+    size_t diffs_skipped;    /* directory changes left undiffed */
+} worker_stats;
+
+/**
+ * An entry which removal or addition is reported by a queued event. Such
+ * events of different directories are paired as moves on flush.
+ **/
+typedef struct event_origin {
+    ino_t inode;           /* inode number of the entry, 0 if not paired */
+    dev_t dev;             /* device number of the entry */
+    const i_watch *dir;    /* directory of the entry */
+    uint32_t flags;        /* flags of the watch the event is queued for */
+} event_origin;
+
+struct kevent;
+
 struct worker {
     int kq;                /* kqueue descriptor */
     volatile int io[2];    /* a socket pair */
     struct iovec *iov;     /* inotify events to send */
+    event_origin *origins; /* entries reported by the events */
     int iovcnt;            /* number of events enqueued */
     int iovalloc;          /* number of iovs allocated */
+    int iovheld;           /* number of events kept back to pair moves */
     pthread_t thread;      /* worker thread */
     SLIST_HEAD(, i_watch) head; /* linked list of inotify watches */
+    TAILQ_HEAD(, i_watch) snapshots; /* directory watches, least recently
+                                      * changed first */
+    TAILQ_HEAD(, i_watch) unwalked;  /* new subdirectories of recursive
+                                      * watches waiting for a listing */
+    TAILQ_HEAD(, i_watch) detached;  /* subdirectories of recursive watches
+                                      * removed during the batch */
+    struct kevent *events; /* kqueue events being processed */
+    int nevents;           /* number of kqueue events being processed */
+    i_watch *diffed;       /* inotify watch which directory is being diffed */
     volatile int closed;   /* closed flag */
+    worker_stats stats;    /* directory diff counters */
+    int filters_changed;   /* some watches have filters to install */
+    int flags_changed;     /* some watches have flags to update */
+    char *snapshot_dir;    /* a directory to save listings to or NULL */
+    int resync_pending;    /* some watches have lost events */
+    int extended;          /* events are sent as struct inotify_event_ext */
+    uint64_t seq;          /* number of the last extended event */
+    uint64_t received;     /* time the kqueue events have been received */
+    size_t iovbytes;       /* size of events enqueued in bytes */
+    int batch_delay;       /* time events may be held back in ms, 0 if not */
+    size_t batch_bytes;    /* size of held back events to send at once */
+    int batch_armed;       /* a timer to send held back events is set */
 
     pthread_mutex_t mutex; /* worker mutex */
     worker_cmd cmd;        /* operation to perform on a worker */
@@ -92,5 +196,20 @@ void    worker_free           (worker *wrk);
 
 int     worker_add_or_modify  (worker *wrk, const char *path, uint32_t flags);
 int     worker_remove         (worker *wrk, int id);
+int     worker_filter         (worker *wrk,
+                               int id,
+                               int kind,
+                               const char *pattern);
+int     worker_checkpoint     (worker *wrk, const char *dir);
+int     worker_resync         (worker *wrk, int id);
+int     worker_set_watch_param (worker *wrk,
+                                int id,
+                                int param,
+                                intptr_t value);
+int     worker_set_param      (worker *wrk, int param, intptr_t value);
+int     worker_get_listing    (worker *wrk,
+                               int id,
+                               void **entries,
+                               size_t *size);
 
 #endif /* __WORKER_H__ */